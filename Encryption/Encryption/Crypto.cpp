@@ -0,0 +1,1611 @@
+// Crypto.cpp : the hashes, ciphers, authenticators and key derivations declared in Crypto.h.
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Crypto.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+void cpuid(unsigned leaf, unsigned subleaf, unsigned registers[4])
+{
+#if defined(_MSC_VER)
+    int values[4];
+    __cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i)
+    {
+        registers[i] = static_cast<unsigned>(values[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+unsigned long long read_xcr0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax = 0;
+    unsigned edx = 0;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+
+cpu_features detect_cpu_features()
+{
+    cpu_features features;
+    unsigned registers[4] = {};
+
+    cpuid(0, 0, registers);
+    const unsigned max_leaf = registers[0];
+
+    cpuid(1, 0, registers);
+    features.sse2 = (registers[3] & (1u << 26)) != 0;
+    features.sse42 = (registers[2] & (1u << 20)) != 0;
+    features.aesni = (registers[2] & (1u << 25)) != 0;
+    // the sha kernel also shuffles and blends with ssse3 and sse4.1
+    const bool sse41 = (registers[2] & (1u << 9)) != 0 && (registers[2] & (1u << 19)) != 0;
+
+    // the wide registers are only usable if the OS saves them on a context switch (osxsave + xcr0)
+    const bool osxsave = (registers[2] & (1u << 27)) != 0;
+    const unsigned long long xcr0 = osxsave ? read_xcr0() : 0;
+    const bool os_saves_ymm = (xcr0 & 0x06) == 0x06;
+    const bool os_saves_zmm = (xcr0 & 0xe6) == 0xe6;
+
+    if (max_leaf >= 7)
+    {
+        cpuid(7, 0, registers);
+        features.avx2 = os_saves_ymm && (registers[1] & (1u << 5)) != 0;
+        features.avx512 = os_saves_zmm && (registers[1] & (1u << 16)) != 0;
+        features.sha = sse41 && (registers[1] & (1u << 29)) != 0;
+    }
+
+    return features;
+}
+
+// cpuid only needs to run once per process
+const cpu_features& host_cpu_features()
+{
+    static const cpu_features features = detect_cpu_features();
+    return features;
+}
+
+void put_le(char* at, unsigned long long value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        at[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+unsigned long long get_le(const char* at, size_t bytes)
+{
+    unsigned long long value = 0;
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        value |= static_cast<unsigned long long>(static_cast<unsigned char>(at[i])) << (8 * i);
+    }
+    return value;
+}
+
+// sha-256 round constants (FIPS 180-4 section 4.2.2)
+const unsigned int sha256_round_constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// four rounds on message words w0, then w0 is replaced by the words four steps ahead, scheduled from w0..w3
+#define SHA256_FOUR_ROUNDS_SHANI(step, w0, w1, w2, w3) \
+    { \
+        __m128i message = _mm_add_epi32(w0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(sha256_round_constants + 4 * (step)))); \
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message); \
+        message = _mm_shuffle_epi32(message, 0x0e); \
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, message); \
+        w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3); \
+    }
+
+/// <summary>
+/// sha-256 compression of count whole 64 byte blocks with the sha extensions. the state stays in two registers,
+/// arranged the way sha256rnds2 wants it, from the first block to the last
+/// </summary>
+ENCRYPTION_TARGET("sha,sse4.1")
+void sha256_blocks_shani(unsigned int state[8], const unsigned char* blocks, size_t count)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+
+    // a b c d / e f g h -> a b e f / c d g h
+    const __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xb1);
+    const __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1b);
+    __m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xf0);
+
+    for (; count > 0; --count, blocks += 64)
+    {
+        const __m128i abef_start = abef;
+        const __m128i cdgh_start = cdgh;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks)), byte_swap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16)), byte_swap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 32)), byte_swap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 48)), byte_swap);
+
+        // the words each step schedules past round 63 are never used, that costs less than a branch
+        for (int step = 0; step < 16; step += 4)
+        {
+            SHA256_FOUR_ROUNDS_SHANI(step, w0, w1, w2, w3)
+            SHA256_FOUR_ROUNDS_SHANI(step + 1, w1, w2, w3, w0)
+            SHA256_FOUR_ROUNDS_SHANI(step + 2, w2, w3, w0, w1)
+            SHA256_FOUR_ROUNDS_SHANI(step + 3, w3, w0, w1, w2)
+        }
+
+        abef = _mm_add_epi32(abef, abef_start);
+        cdgh = _mm_add_epi32(cdgh, cdgh_start);
+    }
+
+    // back to a b c d / e f g h
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+void Sha256::update(const void* data, size_t length)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    length_ += length;
+    if (buffered_ > 0)
+    {
+        const size_t take = std::min(length, block_size - buffered_);
+        std::memcpy(buffer_ + buffered_, bytes, take);
+        buffered_ += take;
+        bytes += take;
+        length -= take;
+        if (buffered_ < block_size)
+        {
+            return;
+        }
+        compress_blocks(buffer_, 1);
+        buffered_ = 0;
+    }
+    const size_t whole_blocks = length / block_size;
+    if (whole_blocks > 0)
+    {
+        compress_blocks(bytes, whole_blocks);
+        bytes += whole_blocks * block_size;
+        length -= whole_blocks * block_size;
+    }
+    std::memcpy(buffer_, bytes, length);
+    buffered_ = length;
+}
+
+void Sha256::finish(unsigned char digest[digest_size])
+{
+    // pad with 0x80, zeros and the bit length into one or two final blocks
+    const unsigned long long bit_length = length_ * 8;
+    const unsigned char end_marker = 0x80;
+    const unsigned char zeros[block_size] = {};
+    update(&end_marker, 1);
+    update(zeros, (buffered_ <= 56 ? 56 : 120) - buffered_);
+    unsigned char length_bytes[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        length_bytes[7 - i] = static_cast<unsigned char>(bit_length >> (8 * i));
+    }
+    update(length_bytes, sizeof(length_bytes));
+
+    for (int i = 0; i < 8; ++i)
+    {
+        digest[4 * i] = static_cast<unsigned char>(h_[i] >> 24);
+        digest[4 * i + 1] = static_cast<unsigned char>(h_[i] >> 16);
+        digest[4 * i + 2] = static_cast<unsigned char>(h_[i] >> 8);
+        digest[4 * i + 3] = static_cast<unsigned char>(h_[i]);
+    }
+}
+
+void Sha256::compress_blocks(const unsigned char* blocks, size_t count)
+{
+    if (host_cpu_features().sha)
+    {
+        sha256_blocks_shani(h_, blocks, count);
+        return;
+    }
+    for (; count > 0; --count, blocks += block_size)
+    {
+        compress(blocks);
+    }
+}
+
+void Sha256::compress(const unsigned char* block)
+{
+    unsigned int w[64];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (static_cast<unsigned int>(block[4 * i]) << 24) | (static_cast<unsigned int>(block[4 * i + 1]) << 16)
+            | (static_cast<unsigned int>(block[4 * i + 2]) << 8) | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i)
+    {
+        const unsigned int s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const unsigned int s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    unsigned int a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4], f = h_[5], g = h_[6], hh = h_[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        const unsigned int t1 = hh + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + sha256_round_constants[i] + w[i];
+        const unsigned int t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h_[0] += a; h_[1] += b; h_[2] += c; h_[3] += d; h_[4] += e; h_[5] += f; h_[6] += g; h_[7] += hh;
+}
+
+/// <summary>
+/// sha-256 of a byte string (FIPS 180-4)
+/// </summary>
+/// <param name="digest">receives the 32 byte hash</param>
+void sha256(const void* data, size_t length, unsigned char digest[32])
+{
+    Sha256 hash;
+    hash.update(data, length);
+    hash.finish(digest);
+}
+
+// crc-32c (castagnoli) polynomial, bit reflected
+const unsigned int crc32c_polynomial = 0x82f63b78;
+
+/// <summary>
+/// a * b modulo the crc-32c polynomial, both bit reflected, so x^0 is the top bit
+/// </summary>
+unsigned int crc32c_multiply(unsigned int a, unsigned int b)
+{
+    unsigned int product = 0;
+    for (unsigned int bit = 1u << 31; bit != 0; bit >>= 1)
+    {
+        if (a & bit)
+        {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ crc32c_polynomial : b >> 1;
+    }
+    return product;
+}
+
+/// <summary>
+/// x^(8 * length) modulo the crc-32c polynomial: what running length zero bytes through a crc multiplies it by
+/// </summary>
+unsigned int crc32c_shift_factor(unsigned long long length)
+{
+    // square up x^(2^k) for each set bit of the bit count
+    unsigned int power = 1u << 30;
+    unsigned int factor = 1u << 31;
+    for (unsigned long long bits = length * 8; bits != 0; bits >>= 1)
+    {
+        if (bits & 1)
+        {
+            factor = crc32c_multiply(factor, power);
+        }
+        power = crc32c_multiply(power, power);
+    }
+    return factor;
+}
+
+unsigned int crc32c_combine(unsigned int first, unsigned int second, unsigned long long second_length)
+{
+    return crc32c_multiply(crc32c_shift_factor(second_length), first) ^ second;
+}
+
+/// <summary>
+/// multiplies a crc by one fixed shift factor a byte at a time through four tables, which is what the three lane
+/// crc needs twice every lane and cannot afford to do bit by bit
+/// </summary>
+class Crc32cShift
+{
+public:
+    explicit Crc32cShift(unsigned long long length)
+    {
+        const unsigned int factor = crc32c_shift_factor(length);
+        for (int table = 0; table < 4; ++table)
+        {
+            for (unsigned int value = 0; value < 256; ++value)
+            {
+                tables_[table][value] = crc32c_multiply(factor, value << (8 * table));
+            }
+        }
+    }
+
+    unsigned int operator()(unsigned int crc) const
+    {
+        return tables_[0][crc & 0xff] ^ tables_[1][(crc >> 8) & 0xff] ^ tables_[2][(crc >> 16) & 0xff] ^ tables_[3][crc >> 24];
+    }
+
+private:
+    unsigned int tables_[4][256];
+};
+
+/// <summary>
+/// crc-32c a byte at a time through a table, for processors without sse4.2. works on the raw register,
+/// crc32c does the inversions
+/// </summary>
+unsigned int crc32c_update_table(unsigned int crc, const char* data, size_t length)
+{
+    static const std::vector<unsigned int> table = []()
+    {
+        std::vector<unsigned int> entries(256);
+        for (unsigned int value = 0; value < 256; ++value)
+        {
+            unsigned int entry = value;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                entry = (entry & 1) ? (entry >> 1) ^ crc32c_polynomial : entry >> 1;
+            }
+            entries[value] = entry;
+        }
+        return entries;
+    }();
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+// the crc32 instruction takes eight bytes at a time on x64
+typedef unsigned long long crc32c_word;
+#define CRC32C_STEP _mm_crc32_u64
+#else
+// 32 bit x86 has no eight byte crc32, four bytes at a time
+typedef unsigned int crc32c_word;
+#define CRC32C_STEP _mm_crc32_u32
+#endif
+
+/// <summary>
+/// crc-32c with the sse4.2 crc32 instruction. one instruction takes three cycles to produce its result but a new
+/// one can start every cycle, so three lanes of crc32c_lane_size bytes are run side by side and the three results
+/// merged by shifting the earlier lanes past the later ones. works on the raw register, crc32c does the inversions
+/// </summary>
+ENCRYPTION_TARGET("sse4.2")
+unsigned int crc32c_update_sse42(unsigned int crc, const char* data, size_t length)
+{
+    static const Crc32cShift past_lane(crc32c_lane_size);
+
+    for (; length >= 3 * crc32c_lane_size; data += 3 * crc32c_lane_size, length -= 3 * crc32c_lane_size)
+    {
+        crc32c_word lane0 = crc;
+        crc32c_word lane1 = 0;
+        crc32c_word lane2 = 0;
+        for (size_t i = 0; i < crc32c_lane_size; i += sizeof(crc32c_word))
+        {
+            crc32c_word word0, word1, word2;
+            std::memcpy(&word0, data + i, sizeof(crc32c_word));
+            std::memcpy(&word1, data + crc32c_lane_size + i, sizeof(crc32c_word));
+            std::memcpy(&word2, data + 2 * crc32c_lane_size + i, sizeof(crc32c_word));
+            lane0 = CRC32C_STEP(lane0, word0);
+            lane1 = CRC32C_STEP(lane1, word1);
+            lane2 = CRC32C_STEP(lane2, word2);
+        }
+        crc = past_lane(past_lane(static_cast<unsigned int>(lane0)) ^ static_cast<unsigned int>(lane1)) ^ static_cast<unsigned int>(lane2);
+    }
+
+    // what is left is too short to split, one lane
+    crc32c_word single = crc;
+    for (; length >= sizeof(crc32c_word); data += sizeof(crc32c_word), length -= sizeof(crc32c_word))
+    {
+        crc32c_word word;
+        std::memcpy(&word, data, sizeof(crc32c_word));
+        single = CRC32C_STEP(single, word);
+    }
+    crc = static_cast<unsigned int>(single);
+    for (; length > 0; ++data, --length)
+    {
+        crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+    }
+    return crc;
+}
+
+/// <summary>
+/// crc-32c (castagnoli, as in iscsi and ext4) of a byte string
+/// </summary>
+/// <param name="crc">crc of whatever came before, so a long string can be checked in pieces</param>
+unsigned int crc32c(const void* data, size_t length, unsigned int crc)
+{
+    const char* bytes = static_cast<const char*>(data);
+    return ~(host_cpu_features().sse42 ? crc32c_update_sse42(~crc, bytes, length) : crc32c_update_table(~crc, bytes, length));
+}
+
+// transpose an 8x8 bit matrix held one row per byte, so bit c of byte r becomes bit r of byte c
+unsigned long long transpose_8x8(unsigned long long x)
+{
+    unsigned long long t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+void bytes_to_planes(const unsigned char bytes[64], bit_planes planes)
+{
+    for (int k = 0; k < 8; ++k)
+    {
+        planes[k] = 0;
+    }
+    for (int group = 0; group < 8; ++group)
+    {
+        unsigned long long rows;
+        std::memcpy(&rows, bytes + 8 * group, 8);
+        const unsigned long long columns = transpose_8x8(rows);
+        for (int k = 0; k < 8; ++k)
+        {
+            planes[k] |= ((columns >> (8 * k)) & 0xff) << (8 * group);
+        }
+    }
+}
+
+void planes_to_bytes(const bit_planes planes, unsigned char bytes[64])
+{
+    for (int group = 0; group < 8; ++group)
+    {
+        unsigned long long columns = 0;
+        for (int k = 0; k < 8; ++k)
+        {
+            columns |= ((planes[k] >> (8 * group)) & 0xff) << (8 * k);
+        }
+        const unsigned long long rows = transpose_8x8(columns);
+        std::memcpy(bytes + 8 * group, &rows, 8);
+    }
+}
+
+// multiply 64 pairs of GF(2^8) elements at once, modulo x^8 + x^4 + x^3 + x + 1
+void gf256_multiply_planes(const bit_planes a, const bit_planes b, bit_planes product)
+{
+    const unsigned long long a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3], a4 = a[4], a5 = a[5], a6 = a[6], a7 = a[7];
+
+    // schoolbook product written out so the partial products stay in registers
+    unsigned long long w[15] = {};
+    for (int j = 0; j < 8; ++j)
+    {
+        const unsigned long long bj = b[j];
+        w[j] ^= a0 & bj;
+        w[j + 1] ^= a1 & bj;
+        w[j + 2] ^= a2 & bj;
+        w[j + 3] ^= a3 & bj;
+        w[j + 4] ^= a4 & bj;
+        w[j + 5] ^= a5 & bj;
+        w[j + 6] ^= a6 & bj;
+        w[j + 7] ^= a7 & bj;
+    }
+
+    // fold x^8 and above back down, highest power first so carries are folded again
+    for (int k = 14; k >= 8; --k)
+    {
+        w[k - 4] ^= w[k];
+        w[k - 5] ^= w[k];
+        w[k - 7] ^= w[k];
+        w[k - 8] ^= w[k];
+    }
+    for (int k = 0; k < 8; ++k)
+    {
+        product[k] = w[k];
+    }
+}
+
+// squaring is linear over GF(2), so it is only a few xors of the planes
+void gf256_square_planes(const bit_planes a, bit_planes square)
+{
+    const unsigned long long a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3], a4 = a[4], a5 = a[5], a6 = a[6], a7 = a[7];
+    square[0] = a0 ^ a4 ^ a6;
+    square[1] = a4 ^ a6 ^ a7;
+    square[2] = a1 ^ a5;
+    square[3] = a4 ^ a5 ^ a6 ^ a7;
+    square[4] = a2 ^ a4 ^ a7;
+    square[5] = a5 ^ a6;
+    square[6] = a3 ^ a5;
+    square[7] = a6 ^ a7;
+}
+
+// aes s-box applied to every byte held in the planes: the GF(2^8) inverse as x^254 followed by the affine map
+void aes_sub_planes(bit_planes state)
+{
+    bit_planes x2, x3, x12, x14, x15, t, inverse;
+
+    gf256_square_planes(state, x2);
+    gf256_multiply_planes(x2, state, x3);
+    gf256_square_planes(x3, t);              // x^6
+    gf256_square_planes(t, x12);
+    gf256_multiply_planes(x12, x2, x14);
+    gf256_multiply_planes(x12, x3, x15);
+    gf256_square_planes(x15, t);             // x^30
+    gf256_square_planes(t, x2);              // x^60, x2 is no longer needed
+    gf256_square_planes(x2, t);              // x^120
+    gf256_square_planes(t, x2);              // x^240
+    gf256_multiply_planes(x2, x14, inverse); // x^254, and 0 stays 0
+
+    for (int i = 0; i < 8; ++i)
+    {
+        const unsigned long long constant = ((0x63 >> i) & 1) ? ~0ull : 0ull;
+        state[i] = inverse[i] ^ inverse[(i + 4) & 7] ^ inverse[(i + 5) & 7] ^ inverse[(i + 6) & 7] ^ inverse[(i + 7) & 7] ^ constant;
+    }
+}
+
+/// <summary>
+/// aes s-box on 64 bytes at once without lookup tables.
+/// every byte takes the same instructions whatever its value, so nothing leaks through cache timing.
+/// </summary>
+void aes_sub_bytes_64(unsigned char bytes[64])
+{
+    bit_planes state;
+    bytes_to_planes(bytes, state);
+    aes_sub_planes(state);
+    planes_to_bytes(state, bytes);
+}
+
+/// <summary>
+/// aes-256 key schedule, the same round keys serve the aes-ni and the software paths
+/// </summary>
+void aes256_expand_key(const unsigned char key[32], unsigned char round_keys[(aes256_rounds + 1) * 16])
+{
+    std::memcpy(round_keys, key, aes256_key_size);
+    unsigned char rcon = 0x01;
+    for (size_t i = 8; i < 4 * (aes256_rounds + 1); ++i)
+    {
+        unsigned char word[64] = {};
+        std::memcpy(word, round_keys + 4 * (i - 1), 4);
+        if (i % 8 == 0)
+        {
+            // RotWord then SubWord then Rcon
+            const unsigned char first = word[0];
+            word[0] = word[1];
+            word[1] = word[2];
+            word[2] = word[3];
+            word[3] = first;
+            aes_sub_bytes_64(word);
+            word[0] ^= rcon;
+            rcon = static_cast<unsigned char>((rcon << 1) ^ ((rcon >> 7) * 0x1b));
+        }
+        else if (i % 8 == 4)
+        {
+            aes_sub_bytes_64(word);
+        }
+        for (int b = 0; b < 4; ++b)
+        {
+            round_keys[4 * i + b] = round_keys[4 * (i - 8) + b] ^ word[b];
+        }
+    }
+}
+
+// the planes hold four aes states of 16 bytes, byte row + 4 * column of block b at bit 16 * b + row + 4 * column.
+// ShiftRows and MixColumns only move bytes around inside a block, so they are shifts and masks of whole planes.
+
+// rotate the bits of each 16 bit block lane right by count
+unsigned long long rotate_block_lanes(unsigned long long x, int count)
+{
+    const unsigned long long low = 0xffffull >> count;
+    const unsigned long long low_mask = low * 0x0001000100010001ull;
+    return ((x >> count) & low_mask) | ((x << (16 - count)) & ~low_mask);
+}
+
+// move every byte of a column up one row, row 0 wrapping round to row 3
+unsigned long long rotate_column_rows(unsigned long long x)
+{
+    return ((x >> 1) & 0x7777777777777777ull) | ((x << 3) & 0x8888888888888888ull);
+}
+
+// ShiftRows: row r moves left by r columns
+void aes_shift_rows_planes(bit_planes state)
+{
+    for (int k = 0; k < 8; ++k)
+    {
+        const unsigned long long x = state[k];
+        state[k] = (x & 0x1111111111111111ull)
+            | rotate_block_lanes(x & 0x2222222222222222ull, 4)
+            | rotate_block_lanes(x & 0x4444444444444444ull, 8)
+            | rotate_block_lanes(x & 0x8888888888888888ull, 12);
+    }
+}
+
+// MixColumns: out[r] = c[r] ^ (c[0] ^ c[1] ^ c[2] ^ c[3]) ^ xtime(c[r] ^ c[r + 1])
+void aes_mix_columns_planes(bit_planes state)
+{
+    bit_planes pairs, sums;
+    for (int k = 0; k < 8; ++k)
+    {
+        pairs[k] = state[k] ^ rotate_column_rows(state[k]);
+        sums[k] = pairs[k] ^ rotate_column_rows(rotate_column_rows(pairs[k]));
+    }
+
+    // xtime is a shift of the bit planes with the reduction folded back in from the top bit
+    const unsigned long long top = pairs[7];
+    state[0] ^= sums[0] ^ top;
+    state[1] ^= sums[1] ^ pairs[0] ^ top;
+    state[2] ^= sums[2] ^ pairs[1];
+    state[3] ^= sums[3] ^ pairs[2] ^ top;
+    state[4] ^= sums[4] ^ pairs[3] ^ top;
+    state[5] ^= sums[5] ^ pairs[4];
+    state[6] ^= sums[6] ^ pairs[5];
+    state[7] ^= sums[7] ^ pairs[6];
+}
+
+// round keys repeated for all four blocks and turned into planes once per key
+void aes256_round_key_to_planes(const unsigned char* round_keys, aes256_round_key_planes key_planes)
+{
+    unsigned char repeated[64];
+    for (int round = 0; round <= aes256_rounds; ++round)
+    {
+        for (int block = 0; block < 4; ++block)
+        {
+            std::memcpy(repeated + 16 * block, round_keys + 16 * round, 16);
+        }
+        bytes_to_planes(repeated, key_planes[round]);
+    }
+}
+
+void aes256_set_key(const unsigned char key[32], aes256_key& expanded)
+{
+    aes256_expand_key(key, expanded.round_keys);
+    aes256_round_key_to_planes(expanded.round_keys, expanded.planes);
+}
+
+void aes256_encrypt_4_blocks_soft(const aes256_round_key_planes key_planes, unsigned char blocks[64])
+{
+    bit_planes state;
+    bytes_to_planes(blocks, state);
+    for (int k = 0; k < 8; ++k)
+    {
+        state[k] ^= key_planes[0][k];
+    }
+
+    for (int round = 1; round <= aes256_rounds; ++round)
+    {
+        aes_sub_planes(state);
+        aes_shift_rows_planes(state);
+        if (round != aes256_rounds)
+        {
+            aes_mix_columns_planes(state);
+        }
+        for (int k = 0; k < 8; ++k)
+        {
+            state[k] ^= key_planes[round][k];
+        }
+    }
+    planes_to_bytes(state, blocks);
+}
+
+void aes_counter_block(const unsigned char nonce[aes_ctr_nonce_size], unsigned long long block_index, unsigned char counter[aes_block_size])
+{
+    std::memcpy(counter, nonce, aes_ctr_nonce_size);
+    for (int i = 0; i < 8; ++i)
+    {
+        counter[15 - i] = static_cast<unsigned char>(block_index >> (8 * i));
+    }
+}
+
+void aes256_ctr_blocks_soft(const aes256_key& key, const unsigned char* nonce, unsigned long long first_block, const char* source, char* destination, size_t block_count)
+{
+    unsigned char keystream[64];
+    while (block_count > 0)
+    {
+        const size_t batch = std::min<size_t>(block_count, 4);
+        for (size_t i = 0; i < 4; ++i)
+        {
+            aes_counter_block(nonce, first_block + i, keystream + 16 * i);
+        }
+        aes256_encrypt_4_blocks_soft(key.planes, keystream);
+
+        for (size_t i = 0; i < batch * aes_block_size; ++i)
+        {
+            destination[i] = source[i] ^ static_cast<char>(keystream[i]);
+        }
+        first_block += batch;
+        source += batch * aes_block_size;
+        destination += batch * aes_block_size;
+        block_count -= batch;
+    }
+}
+
+unsigned long long byte_swap_64(unsigned long long value)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(value);
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+ENCRYPTION_TARGET("aes,sse2")
+void aes256_ctr_blocks_aesni(const aes256_key& key, const unsigned char* nonce, unsigned long long first_block, const char* source, char* destination, size_t block_count)
+{
+    __m128i keys[aes256_rounds + 1];
+    for (int round = 0; round <= aes256_rounds; ++round)
+    {
+        keys[round] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key.round_keys + 16 * round));
+    }
+    long long nonce_half;
+    std::memcpy(&nonce_half, nonce, sizeof(nonce_half));
+
+    // eight independent blocks in flight hide the latency of each aesenc
+    size_t done = 0;
+    for (; done + 8 <= block_count; done += 8)
+    {
+        __m128i blocks[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            const long long counter = static_cast<long long>(byte_swap_64(first_block + done + i));
+            blocks[i] = _mm_xor_si128(_mm_set_epi64x(counter, nonce_half), keys[0]);
+        }
+        for (int round = 1; round < aes256_rounds; ++round)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                blocks[i] = _mm_aesenc_si128(blocks[i], keys[round]);
+            }
+        }
+        for (int i = 0; i < 8; ++i)
+        {
+            blocks[i] = _mm_aesenclast_si128(blocks[i], keys[aes256_rounds]);
+            const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16 * (done + i)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * (done + i)), _mm_xor_si128(data, blocks[i]));
+        }
+    }
+
+    for (; done < block_count; ++done)
+    {
+        const long long counter = static_cast<long long>(byte_swap_64(first_block + done));
+        __m128i block = _mm_xor_si128(_mm_set_epi64x(counter, nonce_half), keys[0]);
+        for (int round = 1; round < aes256_rounds; ++round)
+        {
+            block = _mm_aesenc_si128(block, keys[round]);
+        }
+        block = _mm_aesenclast_si128(block, keys[aes256_rounds]);
+        const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16 * done));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * done), _mm_xor_si128(data, block));
+    }
+}
+
+const named_aes_kernel& active_aes_kernel()
+{
+    static const named_aes_kernel kernel = host_cpu_features().aesni
+        ? named_aes_kernel("aes-ni", aes256_ctr_blocks_aesni)
+        : named_aes_kernel("software", aes256_ctr_blocks_soft);
+    return kernel;
+}
+
+/// <summary>
+/// turn the caller's key string into a 256 bit cipher key. a 32 byte key is used as it is, anything else is hashed.
+/// </summary>
+void cipher_key_from_string(const std::string& key, unsigned char cipher_key[32])
+{
+    if (key.length() == cipher_key_size)
+    {
+        std::memcpy(cipher_key, key.data(), cipher_key_size);
+    }
+    else
+    {
+        sha256(key.data(), key.length(), cipher_key);
+    }
+}
+
+/// <summary>
+/// counter mode over any block size: keystream block n only depends on n, so any offset can be started from
+/// </summary>
+/// <param name="key_offset">position of source[0] in the whole stream</param>
+/// <param name="xor_blocks">xor_blocks(first block, source, destination, block count) xors whole keystream blocks in</param>
+template <size_t BlockSize, typename XorBlocks>
+void counter_mode_transform(const char* source, char* destination, size_t length, unsigned long long key_offset, XorBlocks xor_blocks)
+{
+    unsigned long long block = key_offset / BlockSize;
+    size_t skip = static_cast<size_t>(key_offset % BlockSize);
+
+    // a range that starts or ends part way through a block takes what it needs from one keystream block
+    auto partial_block = [&](size_t count)
+    {
+        char zeros[BlockSize] = {};
+        char keystream[BlockSize];
+        xor_blocks(block, zeros, keystream, 1);
+        for (size_t i = 0; i < count; ++i)
+        {
+            destination[i] = source[i] ^ keystream[skip + i];
+        }
+        source += count;
+        destination += count;
+        length -= count;
+        ++block;
+        skip = 0;
+    };
+
+    if (skip != 0)
+    {
+        partial_block(std::min(length, BlockSize - skip));
+    }
+
+    const size_t whole_blocks = length / BlockSize;
+    if (whole_blocks > 0)
+    {
+        xor_blocks(block, source, destination, whole_blocks);
+        source += whole_blocks * BlockSize;
+        destination += whole_blocks * BlockSize;
+        length -= whole_blocks * BlockSize;
+        block += whole_blocks;
+    }
+
+    if (length > 0)
+    {
+        partial_block(length);
+    }
+}
+
+/// <summary>
+/// aes-256-ctr encryption and decryption, the same operation in counter mode
+/// </summary>
+/// <param name="key">expanded key from aes256_set_key</param>
+/// <param name="nonce">aes_ctr_nonce_size bytes, must never repeat for the same key</param>
+/// <param name="key_offset">position of source[0] in the whole stream, any offset can be started from</param>
+void aes256_ctr_transform(const aes256_key& key, const unsigned char* nonce, const char* source, char* destination, size_t length, unsigned long long key_offset, aes_ctr_blocks_kernel kernel)
+{
+    counter_mode_transform<aes_block_size>(source, destination, length, key_offset,
+        [&](unsigned long long first_block, const char* from, char* to, size_t block_count)
+        {
+            kernel(key, nonce, first_block, from, to, block_count);
+        });
+}
+
+void chacha_initial_state(const unsigned char key[32], const unsigned char nonce[chacha_nonce_size], chacha_state& state)
+{
+    // "expand 32-byte k"
+    state.words[0] = 0x61707865;
+    state.words[1] = 0x3320646e;
+    state.words[2] = 0x79622d32;
+    state.words[3] = 0x6b206574;
+    for (int i = 0; i < 8; ++i)
+    {
+        state.words[4 + i] = static_cast<unsigned int>(get_le(reinterpret_cast<const char*>(key) + 4 * i, 4));
+    }
+    state.words[12] = 0;
+    state.words[13] = 0;
+    state.words[14] = static_cast<unsigned int>(get_le(reinterpret_cast<const char*>(nonce), 4));
+    state.words[15] = static_cast<unsigned int>(get_le(reinterpret_cast<const char*>(nonce) + 4, 4));
+}
+
+unsigned int rotate_left_32(unsigned int value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+void chacha_blocks_scalar(const chacha_state& state, unsigned long long first_block, const char* source, char* destination, size_t block_count)
+{
+    for (size_t n = 0; n < block_count; ++n)
+    {
+        const unsigned long long block = first_block + n;
+        unsigned int input[16];
+        std::memcpy(input, state.words, sizeof(input));
+        input[12] = static_cast<unsigned int>(block);
+        input[13] = static_cast<unsigned int>(block >> 32);
+
+        unsigned int x[16];
+        std::memcpy(x, input, sizeof(x));
+        auto quarter_round = [&x](int a, int b, int c, int d)
+        {
+            x[a] += x[b]; x[d] = rotate_left_32(x[d] ^ x[a], 16);
+            x[c] += x[d]; x[b] = rotate_left_32(x[b] ^ x[c], 12);
+            x[a] += x[b]; x[d] = rotate_left_32(x[d] ^ x[a], 8);
+            x[c] += x[d]; x[b] = rotate_left_32(x[b] ^ x[c], 7);
+        };
+        for (int round = 0; round < 10; ++round)
+        {
+            quarter_round(0, 4, 8, 12);
+            quarter_round(1, 5, 9, 13);
+            quarter_round(2, 6, 10, 14);
+            quarter_round(3, 7, 11, 15);
+            quarter_round(0, 5, 10, 15);
+            quarter_round(1, 6, 11, 12);
+            quarter_round(2, 7, 8, 13);
+            quarter_round(3, 4, 9, 14);
+        }
+
+        char keystream[chacha_block_size];
+        for (int i = 0; i < 16; ++i)
+        {
+            put_le(keystream + 4 * i, x[i] + input[i], 4);
+        }
+        for (size_t i = 0; i < chacha_block_size; ++i)
+        {
+            destination[i] = source[i] ^ keystream[i];
+        }
+        source += chacha_block_size;
+        destination += chacha_block_size;
+    }
+}
+
+// the vector kernels hold one state word of several blocks per register, every lane works on its own block
+
+#define CHACHA_QUARTER_ROUND_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = _mm_or_si128(_mm_slli_epi32(d, 16), _mm_srli_epi32(d, 16)); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = _mm_or_si128(_mm_slli_epi32(b, 12), _mm_srli_epi32(b, 20)); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = _mm_or_si128(_mm_slli_epi32(d, 8), _mm_srli_epi32(d, 24)); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = _mm_or_si128(_mm_slli_epi32(b, 7), _mm_srli_epi32(b, 25));
+
+ENCRYPTION_TARGET("sse2")
+void chacha_blocks_sse2(const chacha_state& state, unsigned long long first_block, const char* source, char* destination, size_t block_count)
+{
+    size_t done = 0;
+    for (; done + 4 <= block_count; done += 4)
+    {
+        // four consecutive 64 bit counters, split into low and high words so a carry between lanes is right
+        int low[4];
+        int high[4];
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            const unsigned long long block = first_block + done + lane;
+            low[lane] = static_cast<int>(block);
+            high[lane] = static_cast<int>(block >> 32);
+        }
+
+        __m128i input[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            input[i] = _mm_set1_epi32(static_cast<int>(state.words[i]));
+        }
+        input[12] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low));
+        input[13] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high));
+
+        __m128i x[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            x[i] = input[i];
+        }
+        for (int round = 0; round < 10; ++round)
+        {
+            CHACHA_QUARTER_ROUND_SSE2(x[0], x[4], x[8], x[12])
+            CHACHA_QUARTER_ROUND_SSE2(x[1], x[5], x[9], x[13])
+            CHACHA_QUARTER_ROUND_SSE2(x[2], x[6], x[10], x[14])
+            CHACHA_QUARTER_ROUND_SSE2(x[3], x[7], x[11], x[15])
+            CHACHA_QUARTER_ROUND_SSE2(x[0], x[5], x[10], x[15])
+            CHACHA_QUARTER_ROUND_SSE2(x[1], x[6], x[11], x[12])
+            CHACHA_QUARTER_ROUND_SSE2(x[2], x[7], x[8], x[13])
+            CHACHA_QUARTER_ROUND_SSE2(x[3], x[4], x[9], x[14])
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            x[i] = _mm_add_epi32(x[i], input[i]);
+        }
+
+        // transpose four words of four blocks at a time, row r of the result is 16 bytes of block r
+        for (int group = 0; group < 4; ++group)
+        {
+            const __m128i t0 = _mm_unpacklo_epi32(x[4 * group], x[4 * group + 1]);
+            const __m128i t1 = _mm_unpacklo_epi32(x[4 * group + 2], x[4 * group + 3]);
+            const __m128i t2 = _mm_unpackhi_epi32(x[4 * group], x[4 * group + 1]);
+            const __m128i t3 = _mm_unpackhi_epi32(x[4 * group + 2], x[4 * group + 3]);
+            const __m128i rows[4] = { _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1), _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3) };
+            for (int row = 0; row < 4; ++row)
+            {
+                const size_t at = (done + row) * chacha_block_size + 16 * group;
+                const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + at));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + at), _mm_xor_si128(data, rows[row]));
+            }
+        }
+    }
+
+    if (done < block_count)
+    {
+        chacha_blocks_scalar(state, first_block + done, source + done * chacha_block_size, destination + done * chacha_block_size, block_count - done);
+    }
+}
+
+#undef CHACHA_QUARTER_ROUND_SSE2
+
+// avx2 rotates by 16 and 8 with a byte shuffle, by 12 and 7 with shifts
+#define CHACHA_QUARTER_ROUND_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = _mm256_or_si256(_mm256_slli_epi32(b, 12), _mm256_srli_epi32(b, 20)); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate8); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = _mm256_or_si256(_mm256_slli_epi32(b, 7), _mm256_srli_epi32(b, 25));
+
+ENCRYPTION_TARGET("avx2")
+void chacha_blocks_avx2(const chacha_state& state, unsigned long long first_block, const char* source, char* destination, size_t block_count)
+{
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+    size_t done = 0;
+    for (; done + 8 <= block_count; done += 8)
+    {
+        int low[8];
+        int high[8];
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            const unsigned long long block = first_block + done + lane;
+            low[lane] = static_cast<int>(block);
+            high[lane] = static_cast<int>(block >> 32);
+        }
+
+        __m256i input[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            input[i] = _mm256_set1_epi32(static_cast<int>(state.words[i]));
+        }
+        input[12] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(low));
+        input[13] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(high));
+
+        __m256i x[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            x[i] = input[i];
+        }
+        for (int round = 0; round < 10; ++round)
+        {
+            CHACHA_QUARTER_ROUND_AVX2(x[0], x[4], x[8], x[12])
+            CHACHA_QUARTER_ROUND_AVX2(x[1], x[5], x[9], x[13])
+            CHACHA_QUARTER_ROUND_AVX2(x[2], x[6], x[10], x[14])
+            CHACHA_QUARTER_ROUND_AVX2(x[3], x[7], x[11], x[15])
+            CHACHA_QUARTER_ROUND_AVX2(x[0], x[5], x[10], x[15])
+            CHACHA_QUARTER_ROUND_AVX2(x[1], x[6], x[11], x[12])
+            CHACHA_QUARTER_ROUND_AVX2(x[2], x[7], x[8], x[13])
+            CHACHA_QUARTER_ROUND_AVX2(x[3], x[4], x[9], x[14])
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            x[i] = _mm256_add_epi32(x[i], input[i]);
+        }
+
+        // transpose inside each 128 bit half as the sse2 kernel does, the low halves hold blocks 0-3 and the high halves blocks 4-7
+        __m256i rows[16];
+        for (int group = 0; group < 4; ++group)
+        {
+            const __m256i t0 = _mm256_unpacklo_epi32(x[4 * group], x[4 * group + 1]);
+            const __m256i t1 = _mm256_unpacklo_epi32(x[4 * group + 2], x[4 * group + 3]);
+            const __m256i t2 = _mm256_unpackhi_epi32(x[4 * group], x[4 * group + 1]);
+            const __m256i t3 = _mm256_unpackhi_epi32(x[4 * group + 2], x[4 * group + 3]);
+            rows[4 * group + 0] = _mm256_unpacklo_epi64(t0, t1);
+            rows[4 * group + 1] = _mm256_unpackhi_epi64(t0, t1);
+            rows[4 * group + 2] = _mm256_unpacklo_epi64(t2, t3);
+            rows[4 * group + 3] = _mm256_unpackhi_epi64(t2, t3);
+        }
+
+        // then pair the halves up so each store covers 32 contiguous bytes of one block
+        for (int row = 0; row < 4; ++row)
+        {
+            const __m256i pieces[4] =
+            {
+                _mm256_permute2x128_si256(rows[row], rows[4 + row], 0x20),      // block row, bytes 0-31
+                _mm256_permute2x128_si256(rows[8 + row], rows[12 + row], 0x20), // block row, bytes 32-63
+                _mm256_permute2x128_si256(rows[row], rows[4 + row], 0x31),      // block row + 4, bytes 0-31
+                _mm256_permute2x128_si256(rows[8 + row], rows[12 + row], 0x31), // block row + 4, bytes 32-63
+            };
+            for (int piece = 0; piece < 4; ++piece)
+            {
+                const size_t at = (done + row + 4 * (piece / 2)) * chacha_block_size + 32 * (piece % 2);
+                const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + at));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + at), _mm256_xor_si256(data, pieces[piece]));
+            }
+        }
+    }
+
+    if (done < block_count)
+    {
+        chacha_blocks_sse2(state, first_block + done, source + done * chacha_block_size, destination + done * chacha_block_size, block_count - done);
+    }
+}
+
+#undef CHACHA_QUARTER_ROUND_AVX2
+
+std::vector<named_chacha_kernel> supported_chacha_kernels()
+{
+    const cpu_features& features = host_cpu_features();
+
+    std::vector<named_chacha_kernel> kernels;
+    kernels.emplace_back("scalar", chacha_blocks_scalar);
+    if (features.sse2)
+    {
+        kernels.emplace_back("sse2", chacha_blocks_sse2);
+    }
+    if (features.avx2)
+    {
+        kernels.emplace_back("avx2", chacha_blocks_avx2);
+    }
+    return kernels;
+}
+
+const named_chacha_kernel& active_chacha_kernel()
+{
+    static const named_chacha_kernel kernel = supported_chacha_kernels().back();
+    return kernel;
+}
+
+/// <summary>
+/// chacha20 encryption and decryption
+/// </summary>
+/// <param name="state">initial state from chacha_initial_state</param>
+/// <param name="key_offset">position of source[0] in the whole stream, any offset can be started from</param>
+void chacha20_transform(const chacha_state& state, const char* source, char* destination, size_t length, unsigned long long key_offset, chacha_blocks_kernel kernel)
+{
+    counter_mode_transform<chacha_block_size>(source, destination, length, key_offset,
+        [&](unsigned long long first_block, const char* from, char* to, size_t block_count)
+        {
+            kernel(state, first_block, from, to, block_count);
+        });
+}
+
+Poly1305::Poly1305(const unsigned char key[32])
+{
+    const char* k = reinterpret_cast<const char*>(key);
+    // clamp r as the spec requires while splitting it into limbs
+    r_[0] = static_cast<unsigned int>(get_le(k + 0, 4)) & 0x3ffffff;
+    r_[1] = (static_cast<unsigned int>(get_le(k + 3, 4)) >> 2) & 0x3ffff03;
+    r_[2] = (static_cast<unsigned int>(get_le(k + 6, 4)) >> 4) & 0x3ffc0ff;
+    r_[3] = (static_cast<unsigned int>(get_le(k + 9, 4)) >> 6) & 0x3f03fff;
+    r_[4] = (static_cast<unsigned int>(get_le(k + 12, 4)) >> 8) & 0x00fffff;
+    for (int i = 0; i < 4; ++i)
+    {
+        pad_[i] = static_cast<unsigned int>(get_le(k + 16 + 4 * i, 4));
+    }
+}
+
+void Poly1305::update(const char* data, size_t length)
+{
+    if (buffered_ > 0)
+    {
+        const size_t take = std::min(length, sizeof(buffer_) - buffered_);
+        std::memcpy(buffer_ + buffered_, data, take);
+        buffered_ += take;
+        data += take;
+        length -= take;
+        if (buffered_ < sizeof(buffer_))
+        {
+            return;
+        }
+        blocks(buffer_, sizeof(buffer_), 1u << 24);
+        buffered_ = 0;
+    }
+
+    const size_t whole = length & ~static_cast<size_t>(15);
+    blocks(data, whole, 1u << 24);
+    std::memcpy(buffer_, data + whole, length - whole);
+    buffered_ = length - whole;
+}
+
+void Poly1305::pad_to_block()
+{
+    if (buffered_ > 0)
+    {
+        std::memset(buffer_ + buffered_, 0, sizeof(buffer_) - buffered_);
+        blocks(buffer_, sizeof(buffer_), 1u << 24);
+        buffered_ = 0;
+    }
+}
+
+void Poly1305::finish(unsigned char tag[tag_size])
+{
+    if (buffered_ > 0)
+    {
+        // the final partial block has its 1 bit appended by hand instead of at 2^128
+        buffer_[buffered_] = 1;
+        std::memset(buffer_ + buffered_ + 1, 0, sizeof(buffer_) - buffered_ - 1);
+        blocks(buffer_, sizeof(buffer_), 0);
+        buffered_ = 0;
+    }
+
+    const unsigned int mask26 = 0x3ffffff;
+    unsigned int h0 = h_[0], h1 = h_[1], h2 = h_[2], h3 = h_[3], h4 = h_[4];
+    unsigned int c = h1 >> 26; h1 &= mask26;
+    h2 += c; c = h2 >> 26; h2 &= mask26;
+    h3 += c; c = h3 >> 26; h3 &= mask26;
+    h4 += c; c = h4 >> 26; h4 &= mask26;
+    h0 += c * 5; c = h0 >> 26; h0 &= mask26;
+    h1 += c;
+
+    // h - p, kept only if it did not go negative, chosen with a mask rather than a branch
+    unsigned int g0 = h0 + 5; c = g0 >> 26; g0 &= mask26;
+    unsigned int g1 = h1 + c; c = g1 >> 26; g1 &= mask26;
+    unsigned int g2 = h2 + c; c = g2 >> 26; g2 &= mask26;
+    unsigned int g3 = h3 + c; c = g3 >> 26; g3 &= mask26;
+    unsigned int g4 = h4 + c - (1u << 26);
+    unsigned int select = (g4 >> 31) - 1;
+    g0 &= select; g1 &= select; g2 &= select; g3 &= select; g4 &= select;
+    select = ~select;
+    h0 = (h0 & select) | g0;
+    h1 = (h1 & select) | g1;
+    h2 = (h2 & select) | g2;
+    h3 = (h3 & select) | g3;
+    h4 = (h4 & select) | g4;
+
+    // back to four 32 bit words, then add the pad modulo 2^128
+    const unsigned int words[4] = { h0 | (h1 << 26), (h1 >> 6) | (h2 << 20), (h2 >> 12) | (h3 << 14), (h3 >> 18) | (h4 << 8) };
+    unsigned long long carry = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        carry += static_cast<unsigned long long>(words[i]) + pad_[i];
+        put_le(reinterpret_cast<char*>(tag) + 4 * i, carry & 0xffffffff, 4);
+        carry >>= 32;
+    }
+}
+
+void Poly1305::blocks(const char* data, size_t length, unsigned int high_bit)
+{
+    const unsigned int mask26 = 0x3ffffff;
+    const unsigned long long r0 = r_[0], r1 = r_[1], r2 = r_[2], r3 = r_[3], r4 = r_[4];
+    const unsigned long long s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    unsigned int h0 = h_[0], h1 = h_[1], h2 = h_[2], h3 = h_[3], h4 = h_[4];
+
+    for (; length >= 16; data += 16, length -= 16)
+    {
+        h0 += static_cast<unsigned int>(get_le(data + 0, 4)) & mask26;
+        h1 += (static_cast<unsigned int>(get_le(data + 3, 4)) >> 2) & mask26;
+        h2 += (static_cast<unsigned int>(get_le(data + 6, 4)) >> 4) & mask26;
+        h3 += (static_cast<unsigned int>(get_le(data + 9, 4)) >> 6) & mask26;
+        h4 += (static_cast<unsigned int>(get_le(data + 12, 4)) >> 8) | high_bit;
+
+        // h * r modulo 2^130 - 5, the limbs that wrap past 2^130 come back multiplied by 5
+        const unsigned long long d0 = h0 * r0 + h1 * s4 + h2 * s3 + h3 * s2 + h4 * s1;
+        unsigned long long d1 = h0 * r1 + h1 * r0 + h2 * s4 + h3 * s3 + h4 * s2;
+        unsigned long long d2 = h0 * r2 + h1 * r1 + h2 * r0 + h3 * s4 + h4 * s3;
+        unsigned long long d3 = h0 * r3 + h1 * r2 + h2 * r1 + h3 * r0 + h4 * s4;
+        unsigned long long d4 = h0 * r4 + h1 * r3 + h2 * r2 + h3 * r1 + h4 * r0;
+
+        h0 = static_cast<unsigned int>(d0) & mask26; d1 += d0 >> 26;
+        h1 = static_cast<unsigned int>(d1) & mask26; d2 += d1 >> 26;
+        h2 = static_cast<unsigned int>(d2) & mask26; d3 += d2 >> 26;
+        h3 = static_cast<unsigned int>(d3) & mask26; d4 += d3 >> 26;
+        h4 = static_cast<unsigned int>(d4) & mask26;
+        h0 += static_cast<unsigned int>(d4 >> 26) * 5;
+        h1 += h0 >> 26;
+        h0 &= mask26;
+    }
+
+    h_[0] = h0; h_[1] = h1; h_[2] = h2; h_[3] = h3; h_[4] = h4;
+}
+
+// the tag and the keystream are worked out this much at a time, so the ciphertext is still in l1 when it is hashed
+const size_t sealed_fuse_size = 4 * 1024;
+
+/// <summary>
+/// first chacha20 block of a segment. segments are spaced 2^20 blocks apart and the last one also sets the top bit,
+/// so reordering, dropping or cutting segments off the end all change the keys the reader uses and fail the tag.
+/// </summary>
+unsigned long long sealed_segment_counter(unsigned long long segment, bool last)
+{
+    return (segment << 20) | (last ? 1ull << 63 : 0);
+}
+
+/// <summary>
+/// encrypt (sealing) or decrypt (opening) one segment and compute its tag in a single pass. block 0 of the
+/// segment keys poly1305 and the data uses the blocks after it, as in the RFC 8439 aead with no associated data.
+/// the tag always covers the ciphertext: sealing hashes each piece right after encrypting it, opening right before.
+/// </summary>
+void sealed_segment_transform(const chacha_state& state, chacha_blocks_kernel kernel, unsigned long long segment, bool last, bool sealing,
+    const char* source, char* destination, size_t length, unsigned char tag[Poly1305::tag_size])
+{
+    assert(length <= sealed_segment_size);
+    const unsigned long long first_block = sealed_segment_counter(segment, last);
+
+    char poly_key[chacha_block_size] = {};
+    kernel(state, first_block, poly_key, poly_key, 1);
+    Poly1305 poly(reinterpret_cast<const unsigned char*>(poly_key));
+
+    for (size_t offset = 0; offset < length; offset += sealed_fuse_size)
+    {
+        const size_t piece = std::min(sealed_fuse_size, length - offset);
+        if (!sealing)
+        {
+            poly.update(source + offset, piece);
+        }
+        chacha20_transform(state, source + offset, destination + offset, piece, (first_block + 1) * chacha_block_size + offset, kernel);
+        if (sealing)
+        {
+            poly.update(destination + offset, piece);
+        }
+    }
+
+    char lengths[16];
+    put_le(lengths, 0, 8);
+    put_le(lengths + 8, length, 8);
+    poly.pad_to_block();
+    poly.update(lengths, sizeof(lengths));
+    poly.finish(tag);
+}
+
+bool tags_equal(const unsigned char* a, const unsigned char* b)
+{
+    unsigned char difference = 0;
+    for (size_t i = 0; i < Poly1305::tag_size; ++i)
+    {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
+unsigned long long sealed_length(unsigned long long plain_length)
+{
+    const unsigned long long segments = std::max<unsigned long long>(1, (plain_length + sealed_segment_size - 1) / sealed_segment_size);
+    return plain_length + segments * Poly1305::tag_size;
+}
+
+bool sealed_plain_length(unsigned long long length, unsigned long long& plain_length)
+{
+    const unsigned long long stride = sealed_segment_size + Poly1305::tag_size;
+    const unsigned long long segments = std::max<unsigned long long>(1, (length + stride - 1) / stride);
+    if (length < segments * Poly1305::tag_size)
+    {
+        return false;
+    }
+    plain_length = length - segments * Poly1305::tag_size;
+    return sealed_length(plain_length) == length;
+}
+
+/// <summary>
+/// encrypt and authenticate length bytes into sealed, segment by segment, each segment followed by its tag
+/// </summary>
+/// <param name="sealed">room for sealed_length(length) bytes</param>
+void seal_segments(const chacha_state& state, chacha_blocks_kernel kernel, const char* source, size_t length, char* sealed)
+{
+    size_t in = 0;
+    size_t out = 0;
+    for (unsigned long long segment = 0;; ++segment)
+    {
+        const size_t segment_length = std::min(sealed_segment_size, length - in);
+        const bool last = in + segment_length == length;
+        unsigned char tag[Poly1305::tag_size];
+        sealed_segment_transform(state, kernel, segment, last, true, source + in, sealed + out, segment_length, tag);
+        std::memcpy(sealed + out + segment_length, tag, sizeof(tag));
+        in += segment_length;
+        out += segment_length + sizeof(tag);
+        if (last)
+        {
+            return;
+        }
+    }
+}
+
+/// <summary>
+/// encrypt and authenticate a whole payload with chacha20-poly1305
+/// </summary>
+/// <param name="nonce">chacha_nonce_size bytes from make_nonce</param>
+/// <returns>sealed payload, sealed_length(data.length()) bytes</returns>
+std::string seal_data(const std::string& data, const std::string& key, const std::string& nonce)
+{
+    unsigned char cipher_key[cipher_key_size];
+    cipher_key_from_string(key, cipher_key);
+    chacha_state state;
+    chacha_initial_state(cipher_key, reinterpret_cast<const unsigned char*>(nonce.data()), state);
+
+    std::string sealed(static_cast<size_t>(sealed_length(data.length())), '\0');
+    seal_segments(state, active_chacha_kernel().second, data.data(), data.length(), &sealed[0]);
+    return sealed;
+}
+
+/// <summary>
+/// verify and decrypt a sealed payload while streaming it. each segment is checked before any of its plain text
+/// is written, and reading stops at the first segment that fails, so nothing unauthenticated ever reaches output
+/// and the whole plain text is never held in memory.
+/// </summary>
+/// <param name="input">positioned at the start of the sealed payload</param>
+/// <param name="length">sealed payload length in bytes</param>
+/// <param name="failed_segment">receives the index of the segment that failed</param>
+/// <returns>false if the payload is truncated or a segment fails its tag</returns>
+bool open_sealed_stream(std::istream& input, unsigned long long length, std::ostream& output, const std::string& key, const std::string& nonce, unsigned long long& failed_segment)
+{
+    unsigned char cipher_key[cipher_key_size];
+    cipher_key_from_string(key, cipher_key);
+    chacha_state state;
+    chacha_initial_state(cipher_key, reinterpret_cast<const unsigned char*>(nonce.data()), state);
+    const chacha_blocks_kernel kernel = active_chacha_kernel().second;
+
+    failed_segment = 0;
+    unsigned long long plain_length;
+    if (!sealed_plain_length(length, plain_length))
+    {
+        return false;
+    }
+
+    std::vector<char> sealed(sealed_segment_size + Poly1305::tag_size);
+    std::vector<char> plain(sealed_segment_size);
+    unsigned long long remaining = plain_length;
+    for (unsigned long long segment = 0;; ++segment)
+    {
+        failed_segment = segment;
+        const size_t segment_length = static_cast<size_t>(std::min<unsigned long long>(sealed_segment_size, remaining));
+        const bool last = segment_length == remaining;
+        if (!input.read(sealed.data(), static_cast<std::streamsize>(segment_length + Poly1305::tag_size)))
+        {
+            return false;
+        }
+
+        unsigned char tag[Poly1305::tag_size];
+        sealed_segment_transform(state, kernel, segment, last, false, sealed.data(), plain.data(), segment_length, tag);
+        if (!tags_equal(tag, reinterpret_cast<const unsigned char*>(sealed.data() + segment_length)))
+        {
+            return false;
+        }
+        output.write(plain.data(), static_cast<std::streamsize>(segment_length));
+        remaining -= segment_length;
+        if (last)
+        {
+            return static_cast<bool>(output);
+        }
+    }
+}
+
+HmacSha256::HmacSha256(const std::string& key)
+{
+    unsigned char block[Sha256::block_size] = {};
+    if (key.length() > Sha256::block_size)
+    {
+        sha256(key.data(), key.length(), block);
+    }
+    else
+    {
+        std::memcpy(block, key.data(), key.length());
+    }
+    unsigned char pad[Sha256::block_size];
+    for (size_t i = 0; i < sizeof(pad); ++i)
+    {
+        pad[i] = block[i] ^ 0x36;
+    }
+    inner_.update(pad, sizeof(pad));
+    for (size_t i = 0; i < sizeof(pad); ++i)
+    {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    outer_.update(pad, sizeof(pad));
+}
+
+void HmacSha256::mac(const void* data, size_t length, unsigned char digest[Sha256::digest_size]) const
+{
+    Sha256 inner = inner_;
+    inner.update(data, length);
+    inner.finish(digest);
+    Sha256 outer = outer_;
+    outer.update(digest, Sha256::digest_size);
+    outer.finish(digest);
+}
+
+/// <summary>
+/// pbkdf2 with hmac-sha256 (RFC 8018)
+/// </summary>
+/// <param name="iterations">hmac calls per 32 bytes of output, the cost of a guess</param>
+/// <param name="length">bytes of key to derive</param>
+std::string pbkdf2_sha256(const std::string& password, const std::string& salt, unsigned int iterations, size_t length)
+{
+    const HmacSha256 hmac(password);
+    std::string derived(length, '\0');
+    std::string first_input = salt + std::string(4, '\0');
+    for (unsigned int block = 1; (block - 1) * Sha256::digest_size < length; ++block)
+    {
+        // big endian block index after the salt
+        for (int i = 0; i < 4; ++i)
+        {
+            first_input[salt.length() + i] = static_cast<char>(block >> (24 - 8 * i));
+        }
+        unsigned char u[Sha256::digest_size];
+        unsigned char t[Sha256::digest_size];
+        hmac.mac(first_input.data(), first_input.length(), u);
+        std::memcpy(t, u, sizeof(t));
+        for (unsigned int i = 1; i < iterations; ++i)
+        {
+            hmac.mac(u, sizeof(u), u);
+            for (size_t j = 0; j < sizeof(t); ++j)
+            {
+                t[j] ^= u[j];
+            }
+        }
+        const size_t offset = (block - 1) * Sha256::digest_size;
+        std::memcpy(&derived[offset], t, std::min(sizeof(t), length - offset));
+    }
+    return derived;
+}
+
+// salsa20/8 core (RFC 7914), the mixing function inside scrypt
+void salsa20_8(unsigned int block[16])
+{
+    unsigned int x[16];
+    std::memcpy(x, block, sizeof(x));
+    auto r = [](unsigned int value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+    for (int round = 0; round < 8; round += 2)
+    {
+        x[4] ^= r(x[0] + x[12], 7);   x[8] ^= r(x[4] + x[0], 9);    x[12] ^= r(x[8] + x[4], 13);  x[0] ^= r(x[12] + x[8], 18);
+        x[9] ^= r(x[5] + x[1], 7);    x[13] ^= r(x[9] + x[5], 9);   x[1] ^= r(x[13] + x[9], 13);  x[5] ^= r(x[1] + x[13], 18);
+        x[14] ^= r(x[10] + x[6], 7);  x[2] ^= r(x[14] + x[10], 9);  x[6] ^= r(x[2] + x[14], 13);  x[10] ^= r(x[6] + x[2], 18);
+        x[3] ^= r(x[15] + x[11], 7);  x[7] ^= r(x[3] + x[15], 9);   x[11] ^= r(x[7] + x[3], 13);  x[15] ^= r(x[11] + x[7], 18);
+        x[1] ^= r(x[0] + x[3], 7);    x[2] ^= r(x[1] + x[0], 9);    x[3] ^= r(x[2] + x[1], 13);   x[0] ^= r(x[3] + x[2], 18);
+        x[6] ^= r(x[5] + x[4], 7);    x[7] ^= r(x[6] + x[5], 9);    x[4] ^= r(x[7] + x[6], 13);   x[5] ^= r(x[4] + x[7], 18);
+        x[11] ^= r(x[10] + x[9], 7);  x[8] ^= r(x[11] + x[10], 9);  x[9] ^= r(x[8] + x[11], 13);  x[10] ^= r(x[9] + x[8], 18);
+        x[12] ^= r(x[15] + x[14], 7); x[13] ^= r(x[12] + x[15], 9); x[14] ^= r(x[13] + x[12], 13); x[15] ^= r(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        block[i] += x[i];
+    }
+}
+
+/// <summary>
+/// scrypt BlockMix: 2r salsa20/8 blocks chained, even outputs to the first half and odd ones to the second
+/// </summary>
+void scrypt_block_mix(const unsigned int* input, unsigned int* output, unsigned int r)
+{
+    unsigned int x[16];
+    std::memcpy(x, input + (2 * r - 1) * 16, sizeof(x));
+    for (unsigned int i = 0; i < 2 * r; ++i)
+    {
+        for (int j = 0; j < 16; ++j)
+        {
+            x[j] ^= input[i * 16 + j];
+        }
+        salsa20_8(x);
+        std::memcpy(output + ((i / 2) + (i % 2) * r) * 16, x, sizeof(x));
+    }
+}
+
+/// <summary>
+/// scrypt (RFC 7914). every guess has to fill and then read back in random order a table of 128 * r * n bytes,
+/// which is what makes trying passwords on custom hardware expensive.
+/// </summary>
+/// <param name="log2_n">cost, the table has 2^log2_n entries</param>
+/// <param name="r">block size factor, each entry is 128 * r bytes</param>
+/// <param name="p">independent lanes, each fills its own table</param>
+std::string scrypt(const std::string& password, const std::string& salt, unsigned int log2_n, unsigned int r, unsigned int p, size_t length)
+{
+    // callers bound the costs, see parse_kdf_params, this only guards the shift and the table size against wrapping
+    assert(log2_n < 8 * sizeof(size_t) && r >= 1 && p >= 1);
+    const size_t n = size_t(1) << log2_n;
+    const size_t words = 32 * r;
+    assert(n <= std::numeric_limits<size_t>::max() / sizeof(unsigned int) / words);
+    std::string b = pbkdf2_sha256(password, salt, 1, p * 128 * r);
+
+    std::vector<unsigned int> table(n * words);
+    std::vector<unsigned int> x(words);
+    std::vector<unsigned int> y(words);
+    for (unsigned int lane = 0; lane < p; ++lane)
+    {
+        char* const lane_bytes = &b[lane * 128 * r];
+        for (size_t i = 0; i < words; ++i)
+        {
+            x[i] = static_cast<unsigned int>(get_le(lane_bytes + 4 * i, 4));
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            std::memcpy(&table[i * words], x.data(), words * sizeof(unsigned int));
+            scrypt_block_mix(x.data(), y.data(), r);
+            x.swap(y);
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            const size_t j = x[(2 * r - 1) * 16] & (n - 1);
+            for (size_t k = 0; k < words; ++k)
+            {
+                x[k] ^= table[j * words + k];
+            }
+            scrypt_block_mix(x.data(), y.data(), r);
+            x.swap(y);
+        }
+        for (size_t i = 0; i < words; ++i)
+        {
+            put_le(lane_bytes + 4 * i, x[i], 4);
+        }
+    }
+    return pbkdf2_sha256(password, b, 1, length);
+}
+
+// password based key derivations a job can choose from
@@ -0,0 +1,229 @@
+// Crypto.h : the hashes, ciphers, authenticators and key derivations behind the Encryption program, shared with the
+// EncryptionBenchmark and EncryptionTest projects.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+// MSVC lets any intrinsic be used in any function, gcc/clang need the instruction set named on the function
+#if defined(_MSC_VER)
+#define ENCRYPTION_TARGET(isa)
+#else
+#define ENCRYPTION_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/// <summary>
+/// instruction set extensions the xor kernels can use on this machine
+/// </summary>
+struct cpu_features
+{
+    bool sse2 = false;
+    bool sse42 = false;
+    bool aesni = false;
+    bool avx2 = false;
+    bool avx512 = false;
+    bool sha = false;
+};
+
+// what this processor supports, detected once per process
+const cpu_features& host_cpu_features();
+
+// store the low bytes of value little endian at at
+void put_le(char* at, unsigned long long value, size_t bytes);
+
+// read a little endian number bytes long from at
+unsigned long long get_le(const char* at, size_t bytes);
+
+/// <summary>
+/// sha-256 (FIPS 180-4) fed in pieces. the state can be copied part way, which lets hmac hash its two padded
+/// key blocks once and start every message from there.
+/// </summary>
+class Sha256
+{
+public:
+    static const size_t digest_size = 32;
+    static const size_t block_size = 64;
+
+    void update(const void* data, size_t length);
+    void finish(unsigned char digest[digest_size]);
+
+private:
+    static unsigned int rotate(unsigned int value, int bits) { return (value >> bits) | (value << (32 - bits)); }
+
+    void compress_blocks(const unsigned char* blocks, size_t count);
+    void compress(const unsigned char* block);
+
+    unsigned int h_[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char buffer_[block_size];
+    size_t buffered_ = 0;
+    unsigned long long length_ = 0;
+};
+
+// sha-256 of a byte string into a 32 byte digest
+void sha256(const void* data, size_t length, unsigned char digest[32]);
+
+/// <summary>
+/// hmac-sha256 (RFC 2104) with the padded key blocks hashed once up front, so each message costs only its own blocks
+/// </summary>
+class HmacSha256
+{
+public:
+    explicit HmacSha256(const std::string& key);
+
+    void mac(const void* data, size_t length, unsigned char digest[Sha256::digest_size]) const;
+
+private:
+    Sha256 inner_;
+    Sha256 outer_;
+};
+
+// pbkdf2 with hmac-sha256 (RFC 8018), length bytes of key at iterations hmac calls per 32 bytes
+std::string pbkdf2_sha256(const std::string& password, const std::string& salt, unsigned int iterations, size_t length);
+
+// scrypt (RFC 7914) with a table of 2^log2_n entries of 128 * r bytes, p lanes
+std::string scrypt(const std::string& password, const std::string& salt, unsigned int log2_n, unsigned int r, unsigned int p, size_t length);
+
+// bytes in each of the three lanes the sse4.2 crc runs side by side, three lanes fit in the l1 cache with room to spare
+const size_t crc32c_lane_size = 2048;
+
+// crc-32c of a byte string followed by another, from the crcs of the two and the length of the second
+unsigned int crc32c_combine(unsigned int first, unsigned int second, unsigned long long second_length);
+
+// crc-32c a byte at a time through a table on the raw register, without the inversions crc32c does
+unsigned int crc32c_update_table(unsigned int crc, const char* data, size_t length);
+
+// crc-32c (castagnoli) of a byte string, continuing from the crc of whatever came before
+unsigned int crc32c(const void* data, size_t length, unsigned int crc = 0);
+
+// aes-256 block cipher (FIPS 197) used in counter mode
+const size_t aes_block_size = 16;
+const int aes256_rounds = 14;
+const size_t aes256_key_size = 32;
+// the counter block is this nonce followed by the big endian block index
+const size_t aes_ctr_nonce_size = 8;
+
+// eight bit planes of 64 bytes: bit i of plane k is bit k of byte i
+typedef unsigned long long bit_planes[8];
+typedef bit_planes aes256_round_key_planes[aes256_rounds + 1];
+
+/// <summary>
+/// an expanded aes-256 key, as round key bytes for aes-ni and as planes for the software rounds
+/// </summary>
+struct aes256_key
+{
+    unsigned char round_keys[(aes256_rounds + 1) * 16];
+    aes256_round_key_planes planes;
+};
+
+void aes256_set_key(const unsigned char key[32], aes256_key& expanded);
+
+// encrypt four blocks at once in software, four blocks fill exactly one set of bitsliced planes
+void aes256_encrypt_4_blocks_soft(const aes256_round_key_planes key_planes, unsigned char blocks[64]);
+
+// xor block_count whole blocks of keystream, starting at block first_block, into source
+typedef void (*aes_ctr_blocks_kernel)(const aes256_key& key, const unsigned char* nonce, unsigned long long first_block, const char* source, char* destination, size_t block_count);
+
+void aes256_ctr_blocks_soft(const aes256_key& key, const unsigned char* nonce, unsigned long long first_block, const char* source, char* destination, size_t block_count);
+void aes256_ctr_blocks_aesni(const aes256_key& key, const unsigned char* nonce, unsigned long long first_block, const char* source, char* destination, size_t block_count);
+
+typedef std::pair<const char*, aes_ctr_blocks_kernel> named_aes_kernel;
+
+// aes-ni when the cpu has it, otherwise the table-free software rounds
+const named_aes_kernel& active_aes_kernel();
+
+// every cipher other than xor takes a 256 bit key
+const size_t cipher_key_size = 32;
+
+// a 32 byte key string as it is, anything else hashed down to 32 bytes
+void cipher_key_from_string(const std::string& key, unsigned char cipher_key[32]);
+
+// aes-256-ctr encryption and decryption from any key_offset in the stream
+void aes256_ctr_transform(const aes256_key& key, const unsigned char* nonce, const char* source, char* destination, size_t length, unsigned long long key_offset, aes_ctr_blocks_kernel kernel);
+
+// chacha20 stream cipher in the original layout with a 64 bit block counter and a 64 bit nonce, so a file is not limited to 256 GB
+const size_t chacha_block_size = 64;
+const size_t chacha_nonce_size = 8;
+
+/// <summary>
+/// chacha20 input block: constants, key, block counter, nonce. the counter words are filled in per block.
+/// </summary>
+struct chacha_state
+{
+    unsigned int words[16];
+};
+
+void chacha_initial_state(const unsigned char key[32], const unsigned char nonce[chacha_nonce_size], chacha_state& state);
+
+// xor block_count whole 64 byte blocks of keystream, starting at block first_block, into source
+typedef void (*chacha_blocks_kernel)(const chacha_state& state, unsigned long long first_block, const char* source, char* destination, size_t block_count);
+
+void chacha_blocks_scalar(const chacha_state& state, unsigned long long first_block, const char* source, char* destination, size_t block_count);
+
+typedef std::pair<const char*, chacha_blocks_kernel> named_chacha_kernel;
+
+// every chacha20 kernel this cpu can run, slowest first
+std::vector<named_chacha_kernel> supported_chacha_kernels();
+
+// the fastest of supported_chacha_kernels
+const named_chacha_kernel& active_chacha_kernel();
+
+// chacha20 encryption and decryption from any key_offset in the stream
+void chacha20_transform(const chacha_state& state, const char* source, char* destination, size_t length, unsigned long long key_offset, chacha_blocks_kernel kernel);
+
+/// <summary>
+/// poly1305 one-time authenticator (RFC 8439) with 26 bit limbs, so every product fits in 64 bits on any compiler
+/// </summary>
+class Poly1305
+{
+public:
+    static const size_t tag_size = 16;
+
+    explicit Poly1305(const unsigned char key[32]);
+
+    void update(const char* data, size_t length);
+
+    // zero bytes up to the next 16 byte boundary, as the aead construction pads each part of the input
+    void pad_to_block();
+
+    void finish(unsigned char tag[tag_size]);
+
+private:
+    void blocks(const char* data, size_t length, unsigned int high_bit);
+
+    unsigned int r_[5];
+    unsigned int h_[5] = {};
+    unsigned int pad_[4];
+    char buffer_[16];
+    size_t buffered_ = 0;
+};
+
+// sealed payloads are cut into segments that each carry their own tag, so a reader can check
+// every segment as it streams past and stop at the first bad one instead of at the end of the file
+const size_t sealed_segment_size = 64 * 1024;
+
+// encrypt (sealing) or decrypt (opening) one segment of a chacha20-poly1305 payload and compute its tag in one pass
+void sealed_segment_transform(const chacha_state& state, chacha_blocks_kernel kernel, unsigned long long segment, bool last, bool sealing,
+    const char* source, char* destination, size_t length, unsigned char tag[Poly1305::tag_size]);
+
+// compare tags in time that does not depend on where they differ
+bool tags_equal(const unsigned char* a, const unsigned char* b);
+
+// bytes a sealed payload takes for plain_length bytes of plain text, an empty file still has one empty segment
+unsigned long long sealed_length(unsigned long long plain_length);
+
+// the inverse of sealed_length, false if no plain text length seals to exactly this many bytes
+bool sealed_plain_length(unsigned long long length, unsigned long long& plain_length);
+
+// encrypt and authenticate length bytes into sealed, which has room for sealed_length(length) bytes
+void seal_segments(const chacha_state& state, chacha_blocks_kernel kernel, const char* source, size_t length, char* sealed);
+
+// encrypt and authenticate a whole payload with chacha20-poly1305
+std::string seal_data(const std::string& data, const std::string& key, const std::string& nonce);
+
+// verify and decrypt a sealed payload while streaming it, false at the first segment (failed_segment) that does not verify
+bool open_sealed_stream(std::istream& input, unsigned long long length, std::ostream& output, const std::string& key, const std::string& nonce, unsigned long long& failed_segment);
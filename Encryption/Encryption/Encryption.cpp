@@ -1,145 +1,7059 @@
 // Encryption.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <ctime>
+#include <vector>
+
+#include "Crypto.h"
+#include "Encryption.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+TiledKey::TiledKey(const std::string& key)
+    : key_length_(key.length())
+{
+    assert(key_length_ > 0);
+
+    const size_t tiled_length = key_length_ + max_xor_vector_width - 1;
+    // short keys (including "password") are tiled on the stack, only very long keys need the heap
+    char* tiled = inline_;
+    if (tiled_length > sizeof(inline_))
+    {
+        heap_.resize(tiled_length);
+        tiled = heap_.data();
+    }
+    // lay the key down once, then keep doubling what is already there
+    const size_t first_copy = std::min(key_length_, tiled_length);
+    std::memcpy(tiled, key.data(), first_copy);
+    for (size_t filled = first_copy; filled < tiled_length;)
+    {
+        const size_t count = std::min(filled, tiled_length - filled);
+        std::memcpy(tiled + filled, tiled, count);
+        filled += count;
+    }
+    data_ = tiled;
+}
+
+void xor_kernel_scalar(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase)
+{
+    // walk the key position alongside the data instead of taking i % key_length for every byte
+    for (size_t i = 0; i < length; ++i)
+    {
+        destination[i] = source[i] ^ tiled_key[phase];
+        if (++phase == key_length)
+        {
+            phase = 0;
+        }
+    }
+}
+
+ENCRYPTION_TARGET("sse2")
+void xor_kernel_sse2(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase)
+{
+    // how far the key position moves for every vector processed
+    const size_t step = 16 % key_length;
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+        const __m128i pad = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tiled_key + phase));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_xor_si128(data, pad));
+
+        phase += step;
+        if (phase >= key_length)
+        {
+            phase -= key_length;
+        }
+    }
+
+    // finish the tail that does not fill a whole vector
+    xor_kernel_scalar(source + i, destination + i, length - i, tiled_key, key_length, phase);
+}
+
+ENCRYPTION_TARGET("avx2")
+void xor_kernel_avx2(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase)
+{
+    const size_t step = 32 % key_length;
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+        const __m256i pad = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tiled_key + phase));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_xor_si256(data, pad));
+
+        phase += step;
+        if (phase >= key_length)
+        {
+            phase -= key_length;
+        }
+    }
+
+    xor_kernel_scalar(source + i, destination + i, length - i, tiled_key, key_length, phase);
+}
+
+ENCRYPTION_TARGET("avx512f")
+void xor_kernel_avx512(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase)
+{
+    const size_t step = 64 % key_length;
+
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        const __m512i data = _mm512_loadu_si512(source + i);
+        const __m512i pad = _mm512_loadu_si512(tiled_key + phase);
+        _mm512_storeu_si512(destination + i, _mm512_xor_si512(data, pad));
+
+        phase += step;
+        if (phase >= key_length)
+        {
+            phase -= key_length;
+        }
+    }
+
+    xor_kernel_scalar(source + i, destination + i, length - i, tiled_key, key_length, phase);
+}
+
+/// <summary>
+/// every xor kernel this machine can run, narrowest first. the scalar kernel is always present.
+/// </summary>
+std::vector<named_xor_kernel> supported_xor_kernels()
+{
+    const cpu_features& features = host_cpu_features();
+
+    std::vector<named_xor_kernel> kernels;
+    kernels.emplace_back("scalar", xor_kernel_scalar);
+    if (features.sse2)
+    {
+        kernels.emplace_back("sse2", xor_kernel_sse2);
+    }
+    if (features.avx2)
+    {
+        kernels.emplace_back("avx2", xor_kernel_avx2);
+    }
+    if (features.avx512)
+    {
+        kernels.emplace_back("avx512", xor_kernel_avx512);
+    }
+    return kernels;
+}
+
+// the widest kernel is picked once, the first time anything is transformed
+const named_xor_kernel& active_xor_kernel()
+{
+    static const named_xor_kernel kernel = supported_xor_kernels().back();
+    return kernel;
+}
+
+/// <summary>
+/// encrypt or decrypt length bytes from source into destination using the provided key
+/// </summary>
+/// <param name="source">input bytes to process</param>
+/// <param name="destination">caller owned buffer of at least length bytes, may be the same as source</param>
+/// <param name="length">number of bytes to process</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="key_offset">position of source[0] in the whole stream, so a chunk lines up with the right key byte</param>
+void encrypt_decrypt(const char* source, char* destination, size_t length, const std::string& key, unsigned long long key_offset)
+{
+    const auto key_length = key.length();
+
+    // assert that our input data is good
+    assert(key_length > 0);
+    assert(length > 0);
+    assert(source != nullptr && destination != nullptr);
+
+    const size_t phase = static_cast<size_t>(key_offset % key_length);
+
+    // too short to fill a vector, tiling the key would cost more than the transform itself
+    if (length < max_xor_vector_width)
+    {
+        xor_kernel_scalar(source, destination, length, key.data(), key_length, phase);
+        return;
+    }
+
+    // transform the buffer a vector at a time, each byte is xored with the key position it falls on.
+    // nothing here allocates unless the key is too long to tile on the stack.
+    const TiledKey tiled_key(key);
+    active_xor_kernel().second(source, destination, length, tiled_key.data(), key_length, phase);
+}
+
+/// <summary>
+/// encrypt or decrypt a caller owned buffer in place using the provided key
+/// </summary>
+/// <param name="data">bytes to transform, overwritten with the result</param>
+/// <param name="length">number of bytes to process</param>
+/// <param name="key">key to use in encryption / decryption</param>
+void encrypt_decrypt(char* data, size_t length, const std::string& key)
+{
+    encrypt_decrypt(data, data, length, key);
+}
+
+/// <summary>
+/// encrypt or decrypt a source string using the provided key
+/// </summary>
+/// <param name="source">input string to process</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <returns>transformed string</returns>
+std::string encrypt_decrypt(const std::string& source, const std::string& key)
+{
+    // get lengths now instead of calling the function every time.
+    // this would have most likely been inlined by the compiler, but design for perfomance.
+    const auto key_length = key.length();
+    const auto source_length = source.length();
+
+    // assert that our input data is good
+    assert(key_length > 0);
+    assert(source_length > 0);
+
+    std::string output(source_length, '\0');
+    encrypt_decrypt(source.data(), &output[0], source_length, key);
+
+    // our output length must equal our source length
+    assert(output.length() == source_length);
+
+    // return the transformed string
+    return output;
+}
+
+// longest combined key worth building for a re-key. it is read over and over alongside the data, so past what stays
+// in the cache the combined keystream is made a piece at a time instead
+const size_t max_rekey_period = 256 * 1024;
+// bytes of combined keystream made at once when the period is too long to build
+const size_t rekey_piece_size = 16 * 1024;
+
+Rekey::Rekey(const std::string& old_key, const std::string& new_key)
+    : old_key_(old_key), new_key_(new_key)
+{
+    assert(!old_key.empty() && !new_key.empty());
+    const size_t period = old_key.length() / std::gcd(old_key.length(), new_key.length()) * new_key.length();
+    if (period <= max_rekey_period)
+    {
+        // tiled like TiledKey, so a vector load can start at any phase
+        period_ = period;
+        combined_.resize(period + max_xor_vector_width - 1);
+        for (size_t i = 0, o = 0, n = 0; i < combined_.size(); ++i)
+        {
+            combined_[i] = old_key[o] ^ new_key[n];
+            o = o + 1 == old_key.length() ? 0 : o + 1;
+            n = n + 1 == new_key.length() ? 0 : n + 1;
+        }
+    }
+}
+
+/// <summary>
+/// re-key length bytes from source into destination, which may be the same buffer
+/// </summary>
+/// <param name="offset">position of source[0] in the encrypted stream, so both keys line up</param>
+void Rekey::transform(const char* source, char* destination, size_t length, unsigned long long offset) const
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (period_ != 0)
+    {
+        active_xor_kernel().second(source, destination, length, combined_.data(), period_, static_cast<size_t>(offset % period_));
+        return;
+    }
+
+    // the keystream piece is key_length long and read from phase 0, so the kernel's vector loads need its tail too
+    std::vector<char> keystream(rekey_piece_size + max_xor_vector_width);
+    for (size_t done = 0; done < length; done += rekey_piece_size)
+    {
+        const size_t piece = std::min(rekey_piece_size, length - done);
+        std::fill(keystream.begin(), keystream.begin() + piece, '\0');
+        encrypt_decrypt(keystream.data(), keystream.data(), piece, old_key_, offset + done);
+        encrypt_decrypt(keystream.data(), keystream.data(), piece, new_key_, offset + done);
+        active_xor_kernel().second(source + done, destination + done, piece, keystream.data(), piece, 0);
+    }
+}
+
+/// <summary>
+/// fixed set of worker threads that run parallel loops handed to them by one caller at a time
+/// </summary>
+class ThreadPool
+{
+public:
+    /// <param name="thread_count">total threads working a loop, including the calling thread</param>
+    explicit ThreadPool(size_t thread_count)
+    {
+        assert(thread_count > 0);
+        for (size_t i = 1; i < thread_count; ++i)
+        {
+            workers_.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t thread_count() const { return workers_.size() + 1; }
+
+    /// <summary>
+    /// call task(i) for every i in [0, count), returning once all of them have finished.
+    /// indexes are handed out one at a time so faster threads pick up more of them.
+    /// </summary>
+    void parallel_for(size_t count, const std::function<void(size_t)>& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            task_count_ = count;
+            next_index_ = 0;
+            busy_workers_ = workers_.size();
+            ++generation_;
+        }
+        work_ready_.notify_all();
+
+        // the caller works the loop too rather than sitting idle
+        run_tasks();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_done_.wait(lock, [this]() { return busy_workers_ == 0; });
+        task_ = nullptr;
+    }
+
+private:
+    void run_tasks()
+    {
+        for (size_t index = next_index_++; index < task_count_; index = next_index_++)
+        {
+            (*task_)(index);
+        }
+    }
+
+    void worker_loop()
+    {
+        unsigned long long seen_generation = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_ready_.wait(lock, [&]() { return stopping_ || generation_ != seen_generation; });
+                if (stopping_)
+                {
+                    return;
+                }
+                seen_generation = generation_;
+            }
+
+            run_tasks();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_workers_ == 0)
+            {
+                work_done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t task_count_ = 0;
+    std::atomic<size_t> next_index_{ 0 };
+    size_t busy_workers_ = 0;
+    unsigned long long generation_ = 0;
+    bool stopping_ = false;
+};
+
+// smallest piece of a buffer worth handing to another thread
+const size_t default_min_parallel_chunk = 1024 * 1024;
+
+/// <summary>
+/// multi-threaded encrypt_decrypt. the buffer is cut into chunks that are a whole number of keys long,
+/// so every chunk starts on the first key byte and the output is identical to the serial function.
+/// </summary>
+/// <param name="source">input bytes to process</param>
+/// <param name="destination">caller owned buffer of at least length bytes, may be the same as source</param>
+/// <param name="length">number of bytes to process</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="pool">threads to spread the chunks across</param>
+/// <param name="min_chunk_size">no chunk is made smaller than this, small buffers stay on one thread</param>
+void encrypt_decrypt_parallel(const char* source, char* destination, size_t length, const std::string& key, ThreadPool& pool, size_t min_chunk_size = default_min_parallel_chunk)
+{
+    const auto key_length = key.length();
+
+    // assert that our input data is good
+    assert(key_length > 0);
+    assert(length > 0);
+    assert(min_chunk_size > 0);
+
+    // a few chunks per thread evens out threads that get descheduled, then round up to whole keys
+    const size_t chunks_wanted = pool.thread_count() * 4;
+    size_t chunk_size = std::max(min_chunk_size, (length + chunks_wanted - 1) / chunks_wanted);
+    chunk_size = (chunk_size + key_length - 1) / key_length * key_length;
+    const size_t chunk_count = (length + chunk_size - 1) / chunk_size;
+
+    const TiledKey tiled_key(key);
+    const xor_kernel kernel = active_xor_kernel().second;
+
+    if (chunk_count == 1)
+    {
+        kernel(source, destination, length, tiled_key.data(), key_length, 0);
+        return;
+    }
+
+    pool.parallel_for(chunk_count, [&](size_t chunk)
+    {
+        const size_t offset = chunk * chunk_size;
+        const size_t chunk_length = std::min(chunk_size, length - offset);
+        kernel(source + offset, destination + offset, chunk_length, tiled_key.data(), key_length, 0);
+    });
+}
+
+/// <summary>
+/// 64 bit xxhash (XXH64) of a byte string. not cryptographic, but several times faster than sha-256, so it suits
+/// telling changed data from unchanged data when nobody is trying to forge a collision
+/// </summary>
+unsigned long long xxhash64(const void* data, size_t length, unsigned long long seed = 0)
+{
+    const unsigned long long prime1 = 0x9e3779b185ebca87ull;
+    const unsigned long long prime2 = 0xc2b2ae3d27d4eb4full;
+    const unsigned long long prime3 = 0x165667b19e3779f9ull;
+    const unsigned long long prime4 = 0x85ebca77c2b2ae63ull;
+    const unsigned long long prime5 = 0x27d4eb2f165667c5ull;
+    auto rotate = [](unsigned long long x, int bits) { return (x << bits) | (x >> (64 - bits)); };
+    auto read_64 = [](const unsigned char* p) { unsigned long long v; std::memcpy(&v, p, sizeof(v)); return v; };
+    auto round = [&](unsigned long long accumulator, unsigned long long input)
+    {
+        return rotate(accumulator + input * prime2, 31) * prime1;
+    };
+
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* const end = p + length;
+    unsigned long long h;
+    if (length >= 32)
+    {
+        // four independent lanes, so the multiplies overlap
+        unsigned long long v1 = seed + prime1 + prime2, v2 = seed + prime2, v3 = seed, v4 = seed - prime1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = round(v1, read_64(p));
+            v2 = round(v2, read_64(p + 8));
+            v3 = round(v3, read_64(p + 16));
+            v4 = round(v4, read_64(p + 24));
+        }
+        h = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+        for (const unsigned long long v : { v1, v2, v3, v4 })
+        {
+            h = (h ^ round(0, v)) * prime1 + prime4;
+        }
+    }
+    else
+    {
+        h = seed + prime5;
+    }
+    h += length;
+
+    for (; end - p >= 8; p += 8)
+    {
+        h = rotate(h ^ round(0, read_64(p)), 27) * prime1 + prime4;
+    }
+    if (end - p >= 4)
+    {
+        unsigned int v;
+        std::memcpy(&v, p, sizeof(v));
+        h = rotate(h ^ (v * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h = rotate(h ^ (*p * prime5), 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// <summary>
+/// encrypt_decrypt that also carries a crc-32c over what it writes. each piece is checked straight after the xor
+/// kernel wrote it, while it is still in the l1 cache, so the check costs almost nothing on top of the xor
+/// </summary>
+/// <param name="crc">crc of the output so far, updated with this output</param>
+void encrypt_decrypt_crc32c(const char* source, char* destination, size_t length, const std::string& key, unsigned long long key_offset, unsigned int& crc)
+{
+    assert(!key.empty());
+    if (length < max_xor_vector_width)
+    {
+        xor_kernel_scalar(source, destination, length, key.data(), key.length(), static_cast<size_t>(key_offset % key.length()));
+        crc = crc32c(destination, length, crc);
+        return;
+    }
+
+    const TiledKey tiled_key(key);
+    const xor_kernel kernel = active_xor_kernel().second;
+    for (size_t done = 0; done < length;)
+    {
+        const size_t piece = std::min(3 * crc32c_lane_size, length - done);
+        kernel(source + done, destination + done, piece, tiled_key.data(), key.length(), static_cast<size_t>((key_offset + done) % key.length()));
+        crc = crc32c(destination + done, piece, crc);
+        done += piece;
+    }
+}
+
+// a file with a crc trailer ends "\ncrc32c:" and eight hex digits and a newline, after the payload's own final newline
+const char crc32c_trailer_prefix[] = "crc32c:";
+const size_t crc32c_trailer_size = 16;
+// and says so on its date line, after the date. the payload is ciphertext of whatever the user wrote, so its last
+// bytes can look like a trailer, the date line is only ever written by this program
+const char crc32c_date_marker[] = " crc32c";
+
+/// <summary>
+/// whether a text layout file's date line, without its newline, says the file ends in a crc trailer
+/// </summary>
+bool crc32c_marked(const char* date_line, size_t length)
+{
+    const size_t marker_length = sizeof(crc32c_date_marker) - 1;
+    return length >= marker_length && std::memcmp(date_line + length - marker_length, crc32c_date_marker, marker_length) == 0;
+}
+
+/// <summary>
+/// the trailer line recording the crc-32c of every byte before it
+/// </summary>
+std::string crc32c_trailer(unsigned int crc)
+{
+    char trailer[crc32c_trailer_size + 1];
+    std::snprintf(trailer, sizeof(trailer), "%s%08x\n", crc32c_trailer_prefix, crc);
+    return std::string(trailer, crc32c_trailer_size);
+}
+
+/// <summary>
+/// read the crc from the trailer of a file whose date line is marked as having one
+/// </summary>
+/// <param name="tail">the last bytes of the file</param>
+/// <param name="length">how many, at least crc32c_trailer_size + 1</param>
+/// <param name="crc">receives the recorded crc</param>
+/// <returns>false if the file does not end in a well formed trailer, i.e. it was cut short or damaged</returns>
+bool parse_crc32c_trailer(const char* tail, size_t length, unsigned int& crc)
+{
+    if (length < crc32c_trailer_size + 1)
+    {
+        return false;
+    }
+    const char* trailer = tail + length - crc32c_trailer_size;
+    if (trailer[-1] != '\n' || std::memcmp(trailer, crc32c_trailer_prefix, sizeof(crc32c_trailer_prefix) - 1) != 0 || trailer[crc32c_trailer_size - 1] != '\n')
+    {
+        return false;
+    }
+    crc = 0;
+    for (size_t i = sizeof(crc32c_trailer_prefix) - 1; i < crc32c_trailer_size - 1; ++i)
+    {
+        const char c = trailer[i];
+        const int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (digit < 0)
+        {
+            return false;
+        }
+        crc = (crc << 4) | static_cast<unsigned int>(digit);
+    }
+    return true;
+}
+
+/// <summary>
+/// map a --cipher argument to a cipher
+/// </summary>
+/// <returns>false if the name is not a known cipher</returns>
+bool parse_cipher_name(const std::string& name, cipher_id& cipher)
+{
+    if (name == "xor")
+    {
+        cipher = cipher_id::xor_key;
+        return true;
+    }
+    if (name == "aes256-ctr" || name == "aes")
+    {
+        cipher = cipher_id::aes256_ctr;
+        return true;
+    }
+    if (name == "chacha20")
+    {
+        cipher = cipher_id::chacha20;
+        return true;
+    }
+    if (name == "chacha20-poly1305")
+    {
+        cipher = cipher_id::chacha20_poly1305;
+        return true;
+    }
+    return false;
+}
+
+// bytes of nonce each cipher needs, stored alongside the ciphertext
+size_t cipher_nonce_size(cipher_id cipher)
+{
+    switch (cipher)
+    {
+    case cipher_id::aes256_ctr:
+        return aes_ctr_nonce_size;
+    case cipher_id::chacha20:
+    case cipher_id::chacha20_poly1305:
+        return chacha_nonce_size;
+    default:
+        return 0;
+    }
+}
+
+// sealed ciphers add tags to the payload, so their output is longer than their input and cannot be transformed in place
+bool cipher_is_sealed(cipher_id cipher)
+{
+    return cipher == cipher_id::chacha20_poly1305;
+}
+
+/// <summary>
+/// fresh nonce for one file. a nonce must never be reused with the same key, so it comes from the os random source.
+/// </summary>
+std::string make_nonce(cipher_id cipher)
+{
+    std::random_device random;
+    std::string nonce(cipher_nonce_size(cipher), '\0');
+    for (char& c : nonce)
+    {
+        c = static_cast<char>(random());
+    }
+    return nonce;
+}
+
+/// <summary>
+/// a cipher keyed and ready to transform data. every engine is seekable: any range of the stream can be
+/// transformed on its own given its offset, so the streaming, parallel and range paths work with all of them.
+/// </summary>
+class CipherEngine
+{
+public:
+    virtual ~CipherEngine() = default;
+
+    // encrypt or decrypt length bytes, source[0] sits at offset in the whole stream
+    virtual void transform(const char* source, char* destination, size_t length, unsigned long long offset) const = 0;
+};
+
+// the original repeating key xor
+class XorCipherEngine : public CipherEngine
+{
+public:
+    explicit XorCipherEngine(const std::string& key)
+        : key_(key)
+    {
+    }
+
+    void transform(const char* source, char* destination, size_t length, unsigned long long offset) const override
+    {
+        if (length > 0)
+        {
+            encrypt_decrypt(source, destination, length, key_, offset);
+        }
+    }
+
+private:
+    std::string key_;
+};
+
+class Aes256CtrCipherEngine : public CipherEngine
+{
+public:
+    Aes256CtrCipherEngine(const std::string& key, const std::string& nonce)
+        : kernel_(active_aes_kernel().second)
+    {
+        assert(nonce.length() == aes_ctr_nonce_size);
+        unsigned char aes_key[cipher_key_size];
+        cipher_key_from_string(key, aes_key);
+        aes256_set_key(aes_key, key_);
+        std::memcpy(nonce_, nonce.data(), aes_ctr_nonce_size);
+    }
+
+    void transform(const char* source, char* destination, size_t length, unsigned long long offset) const override
+    {
+        aes256_ctr_transform(key_, nonce_, source, destination, length, offset, kernel_);
+    }
+
+private:
+    aes256_key key_;
+    unsigned char nonce_[aes_ctr_nonce_size];
+    aes_ctr_blocks_kernel kernel_;
+};
+
+class ChaCha20CipherEngine : public CipherEngine
+{
+public:
+    ChaCha20CipherEngine(const std::string& key, const std::string& nonce)
+        : kernel_(active_chacha_kernel().second)
+    {
+        assert(nonce.length() == chacha_nonce_size);
+        unsigned char chacha_key[cipher_key_size];
+        cipher_key_from_string(key, chacha_key);
+        chacha_initial_state(chacha_key, reinterpret_cast<const unsigned char*>(nonce.data()), state_);
+    }
+
+    void transform(const char* source, char* destination, size_t length, unsigned long long offset) const override
+    {
+        chacha20_transform(state_, source, destination, length, offset, kernel_);
+    }
+
+private:
+    chacha_state state_;
+    chacha_blocks_kernel kernel_;
+};
+
+/// <summary>
+/// build the engine for a cipher
+/// </summary>
+/// <param name="cipher">any cipher that is not sealed, those go through seal_data and open_sealed_stream</param>
+/// <param name="nonce">from make_nonce when encrypting, from the file when decrypting</param>
+std::unique_ptr<CipherEngine> make_cipher_engine(cipher_id cipher, const std::string& key, const std::string& nonce)
+{
+    assert(!cipher_is_sealed(cipher));
+    if (cipher == cipher_id::aes256_ctr)
+    {
+        return std::unique_ptr<CipherEngine>(new Aes256CtrCipherEngine(key, nonce));
+    }
+    if (cipher == cipher_id::chacha20)
+    {
+        return std::unique_ptr<CipherEngine>(new ChaCha20CipherEngine(key, nonce));
+    }
+    return std::unique_ptr<CipherEngine>(new XorCipherEngine(key));
+}
+
+/// <summary>
+/// encrypt or decrypt a source string with the chosen cipher, the same call as encrypt_decrypt plus the cipher and its nonce.
+/// sealed ciphers are not symmetric like this, they go through encrypt_payload and open_sealed_stream.
+/// </summary>
+/// <returns>transformed string</returns>
+std::string encrypt_decrypt(const std::string& source, const std::string& key, cipher_id cipher, const std::string& nonce)
+{
+    std::string output(source.length(), '\0');
+    if (!source.empty())
+    {
+        make_cipher_engine(cipher, key, nonce)->transform(source.data(), &output[0], source.length(), 0);
+    }
+    return output;
+}
+
+/// <summary>
+/// encrypt a payload in place with any cipher, sealed ciphers grow it by their tags
+/// </summary>
+/// <param name="nonce">from make_nonce(cipher)</param>
+void encrypt_payload(std::string& data, const std::string& key, cipher_id cipher, const std::string& nonce)
+{
+    if (cipher_is_sealed(cipher))
+    {
+        data = seal_data(data, key, nonce);
+    }
+    else
+    {
+        make_cipher_engine(cipher, key, nonce)->transform(data.data(), &data[0], data.length(), 0);
+    }
+}
+
+// lz4 block format limits: a match is at least 4 bytes and at most 64 KB back, the last 5 bytes are always
+// literals and no match starts in the last 12, so a decoder can copy in whole words near the end
+const size_t lz_min_match = 4;
+const size_t lz_max_offset = 65535;
+const size_t lz_last_literals = 5;
+const size_t lz_match_limit = 12;
+// 4096 entries of 4 bytes, small enough to stay in l1 next to the block being compressed
+const int lz_hash_bits = 12;
+
+size_t lz_compress_bound(size_t length)
+{
+    return length + length / 255 + 32;
+}
+
+inline unsigned int lz_read_32(const char* p)
+{
+    unsigned int value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline unsigned long long lz_read_64(const char* p)
+{
+    unsigned long long value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// how many bytes from a and b are equal, stopping at limit. eight at a time, the first differing bit gives the count
+inline size_t lz_common_length(const char* a, const char* b, const char* limit)
+{
+    const char* const start = a;
+    while (a + 8 <= limit)
+    {
+        const unsigned long long difference = lz_read_64(a) ^ lz_read_64(b);
+        if (difference != 0)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, difference);
+            return static_cast<size_t>(a - start) + index / 8;
+#else
+            return static_cast<size_t>(a - start) + static_cast<size_t>(__builtin_ctzll(difference)) / 8;
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b)
+    {
+        ++a;
+        ++b;
+    }
+    return static_cast<size_t>(a - start);
+}
+
+inline unsigned int lz_hash(unsigned int sequence)
+{
+    return (sequence * 2654435761u) >> (32 - lz_hash_bits);
+}
+
+// a literal or match length too long for its 4 bits of the token carries on in bytes of 255
+inline char* lz_write_length(char* out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = static_cast<char>(255);
+    }
+    *out++ = static_cast<char>(length);
+    return out;
+}
+
+/// <summary>
+/// compress one block in the lz4 block format: greedy matching through a single hash table of the last position
+/// each 4 byte sequence was seen at, skipping ahead faster the longer nothing matches. fast rather than small.
+/// </summary>
+/// <param name="destination">at least lz_compress_bound(length) bytes</param>
+/// <returns>compressed length</returns>
+size_t lz_compress_block(const char* source, size_t length, char* destination)
+{
+    unsigned int table[1 << lz_hash_bits] = {};
+    const char* const end = source + length;
+    const char* anchor = source;
+    char* out = destination;
+
+    if (length > lz_match_limit)
+    {
+        const char* const search_end = end - lz_match_limit;
+        const char* const match_end = end - lz_last_literals;
+        const char* in = source + 1;
+        while (in < search_end)
+        {
+            // look for a 4 byte sequence seen before within reach of an offset
+            const char* candidate = nullptr;
+            for (unsigned int misses = 0; in < search_end; in += 1 + (misses++ >> 6))
+            {
+                const unsigned int sequence = lz_read_32(in);
+                unsigned int& entry = table[lz_hash(sequence)];
+                const char* const seen = source + entry;
+                entry = static_cast<unsigned int>(in - source);
+                if (seen < in && static_cast<size_t>(in - seen) <= lz_max_offset && lz_read_32(seen) == sequence)
+                {
+                    candidate = seen;
+                    break;
+                }
+            }
+            if (candidate == nullptr)
+            {
+                break;
+            }
+
+            // grow the match backwards over literals that also match, then forwards as far as allowed
+            while (in > anchor && candidate > source && in[-1] == candidate[-1])
+            {
+                --in;
+                --candidate;
+            }
+            const char* const match = in + lz_min_match + lz_common_length(in + lz_min_match, candidate + lz_min_match, match_end);
+
+            const size_t literal_length = static_cast<size_t>(in - anchor);
+            const size_t match_length = static_cast<size_t>(match - in) - lz_min_match;
+            char* const token = out++;
+            *token = static_cast<char>((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_length, 15));
+            if (literal_length >= 15)
+            {
+                out = lz_write_length(out, literal_length - 15);
+            }
+            if (literal_length < 16 && end - anchor >= 16)
+            {
+                // a short run is copied as one fixed 16 byte move, cheaper than a call sized to the run
+                std::memcpy(out, anchor, 16);
+            }
+            else
+            {
+                std::memcpy(out, anchor, literal_length);
+            }
+            out += literal_length;
+            const size_t offset = static_cast<size_t>(in - candidate);
+            *out++ = static_cast<char>(offset & 0xff);
+            *out++ = static_cast<char>(offset >> 8);
+            if (match_length >= 15)
+            {
+                out = lz_write_length(out, match_length - 15);
+            }
+
+            in = match;
+            anchor = in;
+            if (in < search_end)
+            {
+                // the position just before the next search is cheap to remember and often starts the next match
+                table[lz_hash(lz_read_32(in - 2))] = static_cast<unsigned int>(in - 2 - source);
+            }
+        }
+    }
+
+    // whatever is left goes out as a final run of literals with no match
+    const size_t literal_length = static_cast<size_t>(end - anchor);
+    *out++ = static_cast<char>(std::min<size_t>(literal_length, 15) << 4);
+    if (literal_length >= 15)
+    {
+        out = lz_write_length(out, literal_length - 15);
+    }
+    std::memcpy(out, anchor, literal_length);
+    out += literal_length;
+    return static_cast<size_t>(out - destination);
+}
+
+/// <summary>
+/// decompress one lz4 block, checking every length and offset so a damaged or hostile block cannot write out of bounds
+/// </summary>
+/// <param name="plain_length">exact size the block decompresses to</param>
+/// <returns>false if the block is malformed or does not decompress to exactly plain_length bytes</returns>
+bool lz_decompress_block(const char* source, size_t length, char* destination, size_t plain_length)
+{
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(source);
+    const unsigned char* const in_end = in + length;
+    char* out = destination;
+    char* const out_end = destination + plain_length;
+
+    auto read_length = [&](size_t& value) -> bool
+    {
+        for (;;)
+        {
+            if (in == in_end)
+            {
+                return false;
+            }
+            const unsigned char byte = *in++;
+            value += byte;
+            if (byte != 255)
+            {
+                return true;
+            }
+        }
+    };
+
+    while (in < in_end)
+    {
+        const unsigned char token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(literal_length))
+        {
+            return false;
+        }
+        if (literal_length > static_cast<size_t>(in_end - in) || literal_length > static_cast<size_t>(out_end - out))
+        {
+            return false;
+        }
+        if (literal_length <= 16 && in_end - in >= 16 && out_end - out >= 16)
+        {
+            // most literal runs are short, one fixed 16 byte move is cheaper than a call sized to the run
+            std::memcpy(out, in, 16);
+        }
+        else
+        {
+            std::memcpy(out, in, literal_length);
+        }
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end)
+        {
+            // the last sequence has literals only
+            break;
+        }
+
+        if (in_end - in < 2)
+        {
+            return false;
+        }
+        const size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(match_length))
+        {
+            return false;
+        }
+        match_length += lz_min_match;
+        if (offset == 0 || offset > static_cast<size_t>(out - destination) || match_length > static_cast<size_t>(out_end - out))
+        {
+            return false;
+        }
+
+        const char* from = out - offset;
+        if (offset >= 8 && static_cast<size_t>(out_end - out) >= match_length + 8)
+        {
+            // eight bytes at a time, each move only reads bytes already written, and may run up to 7 bytes past
+            // the match into space the next sequence overwrites anyway
+            char* const match_end = out + match_length;
+            for (; out < match_end; out += 8, from += 8)
+            {
+                std::memcpy(out, from, 8);
+            }
+            out = match_end;
+        }
+        else if (offset >= match_length)
+        {
+            std::memcpy(out, from, match_length);
+            out += match_length;
+        }
+        else
+        {
+            // an overlapping match repeats the last offset bytes, it has to be copied forwards one byte at a time
+            for (size_t i = 0; i < match_length; ++i)
+            {
+                *out++ = *from++;
+            }
+        }
+    }
+    return out == out_end;
+}
+
+/// <summary>
+/// compress a payload block by block ahead of encryption. a block that would not get smaller is stored as it is,
+/// so incompressible data grows by only 4 bytes a block.
+/// </summary>
+/// <param name="block_size">plain bytes per block, at most max_compression_block_size</param>
+/// <returns>the framed blocks, each a u32 length word followed by the block</returns>
+std::string compress_payload(const std::string& data, size_t block_size)
+{
+    assert(block_size > 0 && block_size <= max_compression_block_size);
+    const size_t block_count = (data.length() + block_size - 1) / block_size;
+    std::string compressed(block_count * (4 + lz_compress_bound(block_size)), '\0');
+    size_t out = 0;
+    for (size_t in = 0; in < data.length(); in += block_size)
+    {
+        const size_t length = std::min(block_size, data.length() - in);
+        size_t stored = lz_compress_block(data.data() + in, length, &compressed[out + 4]);
+        unsigned int word = static_cast<unsigned int>(stored);
+        if (stored >= length)
+        {
+            std::memcpy(&compressed[out + 4], data.data() + in, length);
+            stored = length;
+            word = static_cast<unsigned int>(length) | compressed_block_stored;
+        }
+        put_le(&compressed[out], word, 4);
+        out += 4 + stored;
+    }
+    compressed.resize(out);
+    return compressed;
+}
+
+std::streamsize DecompressingBuffer::xsputn(const char* data, std::streamsize count)
+{
+    const std::streamsize taken = count;
+    while (count > 0 && !failed_)
+    {
+        if (word_bytes_ < sizeof(word_))
+        {
+            // the length word can itself be split across writes
+            const size_t take = std::min(sizeof(word_) - word_bytes_, static_cast<size_t>(count));
+            std::memcpy(word_ + word_bytes_, data, take);
+            word_bytes_ += take;
+            data += take;
+            count -= static_cast<std::streamsize>(take);
+            if (word_bytes_ == sizeof(word_) && !start_block())
+            {
+                failed_ = true;
+            }
+            continue;
+        }
+
+        const size_t missing = stored_length_ - block_.size();
+        if (block_.empty() && static_cast<size_t>(count) >= stored_length_)
+        {
+            failed_ = !finish_block(data);
+            data += stored_length_;
+            count -= static_cast<std::streamsize>(stored_length_);
+            continue;
+        }
+        const size_t take = std::min(missing, static_cast<size_t>(count));
+        block_.insert(block_.end(), data, data + take);
+        data += take;
+        count -= static_cast<std::streamsize>(take);
+        if (block_.size() == stored_length_)
+        {
+            failed_ = !finish_block(block_.data());
+        }
+    }
+    return failed_ ? 0 : taken;
+}
+
+DecompressingBuffer::int_type DecompressingBuffer::overflow(int_type c)
+{
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        return traits_type::not_eof(c);
+    }
+    const char byte = traits_type::to_char_type(c);
+    return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+}
+
+// the length word is complete, check it fits the block it announces
+bool DecompressingBuffer::start_block()
+{
+    const unsigned int word = static_cast<unsigned int>(get_le(word_, 4));
+    stored_ = (word & compressed_block_stored) != 0;
+    stored_length_ = word & ~compressed_block_stored;
+    plain_length_ = static_cast<size_t>(std::min<unsigned long long>(block_size_, remaining_));
+    block_.clear();
+    return plain_length_ > 0 && (stored_ ? stored_length_ == plain_length_ : stored_length_ <= lz_compress_bound(plain_length_));
+}
+
+bool DecompressingBuffer::finish_block(const char* block)
+{
+    word_bytes_ = 0;
+    remaining_ -= plain_length_;
+    bool ok = true;
+    if (stored_)
+    {
+        output_.write(block, static_cast<std::streamsize>(plain_length_));
+    }
+    else if ((ok = lz_decompress_block(block, stored_length_, plain_.data(), plain_length_)))
+    {
+        output_.write(plain_.data(), static_cast<std::streamsize>(plain_length_));
+    }
+    block_.clear();
+    return ok && output_.good();
+}
+
+// salt bytes generated per job
+const size_t kdf_salt_size = 16;
+
+/// <summary>
+/// parse a job's derivation from "pbkdf2[:iterations]" or "scrypt[:log2 n[:r[:p]]]"
+/// </summary>
+/// <returns>false if the text names no derivation or a cost is out of range</returns>
+bool parse_kdf_params(const std::string& text, kdf_params& params)
+{
+    std::vector<unsigned long> numbers;
+    std::string name = text;
+    const size_t colon = text.find(':');
+    if (colon != std::string::npos)
+    {
+        name = text.substr(0, colon);
+        std::istringstream fields(text.substr(colon + 1));
+        std::string field;
+        while (std::getline(fields, field, ':'))
+        {
+            if (field.empty() || field.find_first_not_of("0123456789") != std::string::npos || field.length() > 9)
+            {
+                return false;
+            }
+            numbers.push_back(std::stoul(field));
+        }
+    }
+
+    params = kdf_params();
+    if (name == "pbkdf2")
+    {
+        params.kind = kdf_id::pbkdf2_sha256;
+        params.iterations = numbers.size() > 0 ? static_cast<unsigned int>(numbers[0]) : params.iterations;
+        return numbers.size() <= 1 && params.iterations > 0;
+    }
+    if (name == "scrypt")
+    {
+        params.kind = kdf_id::scrypt;
+        params.scrypt_log2_n = numbers.size() > 0 ? static_cast<unsigned int>(numbers[0]) : params.scrypt_log2_n;
+        params.scrypt_r = numbers.size() > 1 ? static_cast<unsigned int>(numbers[1]) : params.scrypt_r;
+        params.scrypt_p = numbers.size() > 2 ? static_cast<unsigned int>(numbers[2]) : params.scrypt_p;
+        // the table is 128 * r * 2^log2_n bytes, kept under 4 GB. log2_n is bounded first so the shift cannot overflow
+        return numbers.size() <= 3 && params.scrypt_log2_n >= 1 && params.scrypt_log2_n <= max_scrypt_log2_n
+            && params.scrypt_r >= 1 && params.scrypt_p >= 1 && params.scrypt_r <= 256 && params.scrypt_p <= 256
+            && (128ull * params.scrypt_r << params.scrypt_log2_n) <= (4ull << 30);
+    }
+    return false;
+}
+
+/// <summary>
+/// derive a cipher_key_size byte key from a password
+/// </summary>
+std::string derive_key(const std::string& password, const std::string& salt, const kdf_params& params)
+{
+    if (params.kind == kdf_id::pbkdf2_sha256)
+    {
+        return pbkdf2_sha256(password, salt, params.iterations, cipher_key_size);
+    }
+    return scrypt(password, salt, params.scrypt_log2_n, params.scrypt_r, params.scrypt_p, cipher_key_size);
+}
+
+/// <summary>
+/// text that records the derivation and salt, written where the key used to be so a reader with the password
+/// can derive the same key again: "pbkdf2-sha256$iterations$salt" or "scrypt$log2 n$r$p$salt", salt in hex
+/// </summary>
+std::string kdf_descriptor(const kdf_params& params, const std::string& salt)
+{
+    std::ostringstream descriptor;
+    if (params.kind == kdf_id::pbkdf2_sha256)
+    {
+        descriptor << "pbkdf2-sha256$" << params.iterations << "$";
+    }
+    else
+    {
+        descriptor << "scrypt$" << params.scrypt_log2_n << "$" << params.scrypt_r << "$" << params.scrypt_p << "$";
+    }
+    descriptor << std::hex << std::setfill('0');
+    for (const char c : salt)
+    {
+        descriptor << std::setw(2) << static_cast<unsigned int>(static_cast<unsigned char>(c));
+    }
+    return descriptor.str();
+}
+
+/// <summary>
+/// the inverse of kdf_descriptor
+/// </summary>
+/// <returns>false if the text is not a descriptor</returns>
+bool parse_kdf_descriptor(const std::string& descriptor, kdf_params& params, std::string& salt)
+{
+    std::vector<std::string> fields;
+    std::istringstream input(descriptor);
+    std::string field;
+    while (std::getline(input, field, '$'))
+    {
+        fields.push_back(field);
+    }
+    if (fields.size() < 3)
+    {
+        return false;
+    }
+
+    const std::string& salt_hex = fields.back();
+    if (salt_hex.length() % 2 != 0 || salt_hex.find_first_not_of("0123456789abcdef") != std::string::npos)
+    {
+        return false;
+    }
+    salt.clear();
+    for (size_t i = 0; i < salt_hex.length(); i += 2)
+    {
+        salt.push_back(static_cast<char>(std::stoul(salt_hex.substr(i, 2), nullptr, 16)));
+    }
+
+    std::string text = fields[0] == "pbkdf2-sha256" ? "pbkdf2" : fields[0];
+    for (size_t i = 1; i + 1 < fields.size(); ++i)
+    {
+        text += ":" + fields[i];
+    }
+    return parse_kdf_params(text, params);
+}
+
+// random salt for a job
+std::string make_salt()
+{
+    std::random_device random;
+    std::string salt(kdf_salt_size, '\0');
+    for (char& c : salt)
+    {
+        c = static_cast<char>(random());
+    }
+    return salt;
+}
+
+// derived keys kept when no capacity is given, a few hundred bytes each
+const size_t default_derived_key_cache_size = 256;
+
+/// <summary>
+/// bounded cache of derived keys, so a job that encrypts thousands of files under one password and salt derives
+/// the key once. entries are found by (password id, salt and derivation) and the least recently used one goes when
+/// the cache is full. lookups from any number of threads are safe: the derivation runs outside the lock, and threads
+/// that miss on a key another thread is already deriving wait for that result instead of deriving it again.
+/// the id names the password so the password itself is never a map key; a caller must use a new id for a new password.
+/// </summary>
+class DerivedKeyCache
+{
+public:
+    explicit DerivedKeyCache(size_t capacity = default_derived_key_cache_size)
+        : capacity_(capacity)
+    {
+        assert(capacity > 0);
+    }
+
+    DerivedKeyCache(const DerivedKeyCache&) = delete;
+    DerivedKeyCache& operator=(const DerivedKeyCache&) = delete;
+
+    /// <summary>
+    /// the key for this password and salt, derived only if it is not cached
+    /// </summary>
+    std::string get(const std::string& password_id, const std::string& password, const std::string& salt, const kdf_params& params)
+    {
+        const cache_key key(password_id, kdf_descriptor(params, salt));
+        std::promise<std::string> promise;
+        std::shared_future<std::string> result;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto found = index_.find(key);
+            if (found != index_.end())
+            {
+                ++hits_;
+                // move to the front, the most recently used end
+                entries_.splice(entries_.begin(), entries_, found->second);
+                result = found->second->second;
+            }
+            else
+            {
+                ++misses_;
+                entries_.emplace_front(key, promise.get_future().share());
+                index_[key] = entries_.begin();
+                if (entries_.size() > capacity_)
+                {
+                    // anyone still waiting on the evicted key holds its own copy of the result
+                    index_.erase(entries_.back().first);
+                    entries_.pop_back();
+                    ++evictions_;
+                }
+            }
+        }
+        if (result.valid())
+        {
+            return result.get();
+        }
+
+        try
+        {
+            const std::string derived = derive_key(password, salt, params);
+            promise.set_value(derived);
+            return derived;
+        }
+        catch (...)
+        {
+            // a failed derivation is not cached, the next lookup tries again
+            promise.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto found = index_.find(key);
+            if (found != index_.end())
+            {
+                entries_.erase(found->second);
+                index_.erase(found);
+            }
+            throw;
+        }
+    }
+
+    size_t hits() const { std::lock_guard<std::mutex> lock(mutex_); return hits_; }
+    size_t misses() const { std::lock_guard<std::mutex> lock(mutex_); return misses_; }
+    size_t evictions() const { std::lock_guard<std::mutex> lock(mutex_); return evictions_; }
+
+private:
+    typedef std::pair<std::string, std::string> cache_key;
+    typedef std::list<std::pair<cache_key, std::shared_future<std::string>>> entry_list;
+
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    entry_list entries_;
+    std::map<cache_key, entry_list::iterator> index_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+};
+
+/// <summary>
+/// how a job turns its password into keys: the derivation, the job's salt and the cache shared by its files
+/// </summary>
+struct key_derivation
+{
+    std::string password_id;
+    kdf_params params;
+    std::string salt;
+    DerivedKeyCache* cache = nullptr;
+};
+
+std::string read_file(const std::string& filename)
+{
+    std::string file_text;
+
+    try
+    {
+        std::ifstream readFile(filename, std::ios::in | std::ios::binary);
+        if (readFile)
+        {
+            // Seek to the end of the file to get its size
+            readFile.seekg(0, std::ios::end);
+            std::streamsize file_size = readFile.tellg();
+            readFile.seekg(0, std::ios::beg);
+
+            // Resize the file_text string to accommodate the file's content
+            file_text.resize(static_cast<size_t>(file_size));
+
+            // Read the entire file into the file_text string
+            if (readFile.read(&file_text[0], file_size))
+            {
+                // File reading successful
+                readFile.close();
+                return file_text;
+            }
+        }
+        else
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << filename << std::endl;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        // Exception occurred during file reading
+        std::cout << "Failed to read file: " << e.what() << std::endl;
+    }
+
+    return std::string(); // Return an empty string in case of failure
+}
+
+std::string get_student_name(const std::string& string_data)
+{
+    std::string student_name;
+
+    // find the first newline
+    size_t pos = string_data.find('\n');
+    // did we find a newline
+    if (pos != std::string::npos)
+    { // we did, so copy that substring as the student name
+        student_name = string_data.substr(0, pos);
+    }
+
+    return student_name;
+}
+
+/// <summary>
+/// today's date as yyyy-mm-dd in local time
+/// </summary>
+std::string current_date()
+{
+    // Get the current timestamp
+    std::time_t now = std::time(nullptr);
+    std::tm localTime;
+#if defined(_WIN32)
+    localtime_s(&localTime, &now);
+#else
+    localtime_r(&now, &localTime);
+#endif
+
+    // Format timestamp (yyyy-mm-dd)
+    char buffer[80];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d", &localTime);
+    return buffer;
+}
+
+/// <summary>
+/// write the student name, today's date and the key, one per line, ahead of the data
+/// </summary>
+/// <param name="crc_trailer">mark the date line, the file is going to end in a crc trailer</param>
+void write_data_header(std::ostream& writeFile, const std::string& student_name, const std::string& key, bool crc_trailer = false)
+{
+    // Write Student Name
+    writeFile << student_name << std::endl;
+
+    // Write timestamp (yyyy-mm-dd)
+    writeFile << current_date() << (crc_trailer ? crc32c_date_marker : "") << std::endl;
+
+    // Write key
+    writeFile << key << std::endl;
+}
+
+#if defined(_WIN32)
+typedef HANDLE native_file;
+const native_file invalid_native_file = INVALID_HANDLE_VALUE;
+#else
+typedef int native_file;
+const native_file invalid_native_file = -1;
+#endif
+
+/// <summary>
+/// create or truncate a file for writing through the os directly, bypassing the iostream layer
+/// </summary>
+native_file create_native_file(const std::string& filename)
+{
+#if defined(_WIN32)
+    return CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+    return open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+/// <summary>
+/// open an existing file for reading through the os directly
+/// </summary>
+native_file open_native_file(const std::string& filename)
+{
+#if defined(_WIN32)
+    return CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+    return open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+/// <summary>
+/// read until buffer is full or the file ends
+/// </summary>
+/// <returns>bytes read, or -1 if a read failed</returns>
+long long read_native_file(native_file file, char* buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+#if defined(_WIN32)
+        DWORD got = 0;
+        if (!ReadFile(file, buffer + done, static_cast<DWORD>(std::min<size_t>(length - done, 1u << 30)), &got, nullptr))
+        {
+            // a pipe whose writer has gone reports that as an error, for a reader it is just the end
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+            {
+                break;
+            }
+            return -1;
+        }
+#else
+        const ssize_t got = read(file, buffer + done, length - done);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+#endif
+        if (got == 0)
+        {
+            break;
+        }
+        done += static_cast<size_t>(got);
+    }
+    return static_cast<long long>(done);
+}
+
+void close_native_file(native_file file)
+{
+#if defined(_WIN32)
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+/// <summary>
+/// flush a file's data to the storage device, metadata that is not needed to read it back may lag behind
+/// </summary>
+bool sync_native_file(native_file file)
+{
+#if defined(_WIN32)
+    return FlushFileBuffers(file) != 0;
+#elif defined(__APPLE__)
+    return fsync(file) == 0;
+#else
+    return fdatasync(file) == 0;
+#endif
+}
+
+// one piece of a gathered write
+typedef std::pair<const char*, size_t> write_piece;
+
+// most pieces a single gathered write accepts, well under every platform's IOV_MAX
+const size_t max_write_pieces = 16;
+
+/// <summary>
+/// write up to max_write_pieces separate buffers back to back. on posix this is a single writev unless the kernel
+/// accepts only part of it, on windows each piece is one WriteFile with no formatting or flushing.
+/// </summary>
+/// <returns>false if any byte could not be written</returns>
+bool write_gathered(native_file file, write_piece* pieces, size_t count)
+{
+#if defined(_WIN32)
+    for (size_t i = 0; i < count; ++i)
+    {
+        const char* at = pieces[i].first;
+        size_t remaining = pieces[i].second;
+        while (remaining > 0)
+        {
+            const DWORD request = static_cast<DWORD>(std::min<size_t>(remaining, 1u << 30));
+            DWORD written = 0;
+            if (!WriteFile(file, at, request, &written, nullptr) || written == 0)
+            {
+                return false;
+            }
+            at += written;
+            remaining -= written;
+        }
+    }
+    return true;
+#else
+    // the vectors live on the stack, a write never allocates
+    iovec vectors[max_write_pieces];
+    size_t vector_count = 0;
+    assert(count <= max_write_pieces);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (pieces[i].second > 0)
+        {
+            vectors[vector_count++] = iovec{ const_cast<char*>(pieces[i].first), pieces[i].second };
+        }
+    }
+
+    size_t next = 0;
+    while (next < vector_count)
+    {
+        const ssize_t written = writev(file, &vectors[next], static_cast<int>(vector_count - next));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        // skip whatever was fully written and trim a partially written vector
+        size_t advanced = static_cast<size_t>(written);
+        while (next < vector_count && advanced >= vectors[next].iov_len)
+        {
+            advanced -= vectors[next].iov_len;
+            ++next;
+        }
+        if (advanced > 0)
+        {
+            vectors[next].iov_base = static_cast<char*>(vectors[next].iov_base) + advanced;
+            vectors[next].iov_len -= advanced;
+        }
+    }
+    return true;
+#endif
+}
+
+/// <summary>
+/// defers the flush to disk of finished files so the cost is paid once per batch instead of once per file.
+/// while a file waits here the os is already writing it back alongside the others. safe to share between threads.
+/// </summary>
+class FileSyncBatch
+{
+public:
+    /// <param name="batch_size">number of files to hold before syncing them all</param>
+    explicit FileSyncBatch(size_t batch_size)
+        : batch_size_(std::max<size_t>(1, batch_size))
+    {
+    }
+
+    ~FileSyncBatch() { flush(); }
+
+    FileSyncBatch(const FileSyncBatch&) = delete;
+    FileSyncBatch& operator=(const FileSyncBatch&) = delete;
+
+    /// <summary>
+    /// take ownership of a fully written file, it is synced and closed with the rest of its batch
+    /// </summary>
+    void add(native_file file)
+    {
+        std::vector<native_file> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(file);
+            if (pending_.size() < batch_size_)
+            {
+                return;
+            }
+            ready.swap(pending_);
+        }
+        sync_and_close(ready);
+    }
+
+    /// <summary>
+    /// sync and close everything still waiting
+    /// </summary>
+    /// <returns>false if any file failed to sync since the last flush</returns>
+    bool flush()
+    {
+        std::vector<native_file> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ready.swap(pending_);
+        }
+        sync_and_close(ready);
+        return !failed_.exchange(false);
+    }
+
+private:
+    void sync_and_close(const std::vector<native_file>& files)
+    {
+        for (const native_file file : files)
+        {
+            if (!sync_native_file(file))
+            {
+                failed_ = true;
+            }
+            close_native_file(file);
+        }
+    }
+
+    const size_t batch_size_;
+    std::mutex mutex_;
+    std::vector<native_file> pending_;
+    std::atomic<bool> failed_{ false };
+};
+
+/// <summary>
+/// write the student name, date, key and data in the text layout. the whole file goes out in one gathered
+/// write straight from the caller's strings, nothing is formatted through a stream and nothing is flushed per line.
+/// </summary>
+/// <param name="filename">file to write</param>
+/// <param name="student_name">first line</param>
+/// <param name="key">third line</param>
+/// <param name="data">payload, written byte for byte</param>
+/// <param name="sync_batch">optional, hands the finished file over to be synced to disk with others</param>
+/// <param name="data_crc">optional crc-32c of data, best taken by encrypt_decrypt_crc32c as it was encrypted.
+/// with it the date line is marked and the file ends in a trailer line holding the crc-32c of everything before it</param>
+/// <returns>true if the whole file was written</returns>
+bool save_data_file(const std::string& filename, const std::string& student_name, const std::string& key, const std::string& data, FileSyncBatch* sync_batch, const unsigned int* data_crc)
+{
+    const native_file file = create_native_file(filename);
+    if (file == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+
+    // the date line is the only part that needs formatting, it is built on the stack
+    char date_line[32];
+    std::snprintf(date_line, sizeof(date_line), "\n%s%s\n", current_date().c_str(), data_crc != nullptr ? crc32c_date_marker : "");
+    const char newline[] = "\n";
+
+    // the data is not read again for the trailer, the few header bytes are checked and the data's crc shifted past them
+    std::string trailer;
+    if (data_crc != nullptr)
+    {
+        unsigned int crc = crc32c(student_name.data(), student_name.length());
+        crc = crc32c(date_line, std::strlen(date_line), crc);
+        crc = crc32c(key.data(), key.length(), crc);
+        crc = crc32c(newline, 1, crc);
+        crc = crc32c_combine(crc, *data_crc, data.length());
+        trailer = crc32c_trailer(crc32c(newline, 1, crc));
+    }
+
+    // Write Student Name, date, key and data
+    write_piece pieces[] =
+    {
+        write_piece(student_name.data(), student_name.length()),
+        write_piece(date_line, std::strlen(date_line)),
+        write_piece(key.data(), key.length()),
+        write_piece(newline, 1),
+        write_piece(data.data(), data.length()),
+        write_piece(newline, 1),
+        write_piece(trailer.data(), trailer.length()),
+    };
+    const bool written = write_gathered(file, pieces, sizeof(pieces) / sizeof(pieces[0]));
+    if (!written)
+    {
+        // Failed while writing the file
+        std::cout << "Failed to write file: " << filename << std::endl;
+    }
+
+    // Close file, or leave that to the sync batch
+    if (written && sync_batch != nullptr)
+    {
+        sync_batch->add(file);
+    }
+    else
+    {
+        close_native_file(file);
+    }
+    return written;
+}
+
+// chunk size used by the streaming path when none is given
+const size_t default_chunk_size = 4 * 1024 * 1024;
+
+/// <summary>
+/// encrypt or decrypt everything left in input, writing each chunk to output as soon as it is transformed
+/// </summary>
+/// <param name="input">stream to read from, it never needs to be seekable</param>
+/// <param name="output">stream the transformed bytes are written to</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="buffer">reusable chunk buffer, its size bounds the memory used whatever the input size</param>
+/// <param name="key_offset">stream position of the next byte read, carried across chunks to keep the key in phase</param>
+/// <param name="crc">optional, crc-32c carried on over everything written</param>
+/// <returns>stream position after the last byte transformed</returns>
+unsigned long long encrypt_decrypt_stream(std::istream& input, std::ostream& output, const std::string& key, std::vector<char>& buffer, unsigned long long key_offset = 0,
+    unsigned int* crc = nullptr)
+{
+    assert(!buffer.empty());
+
+    while (input)
+    {
+        input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        const size_t chunk_length = static_cast<size_t>(input.gcount());
+        if (chunk_length == 0)
+        {
+            break;
+        }
+
+        if (crc != nullptr)
+        {
+            encrypt_decrypt_crc32c(buffer.data(), buffer.data(), chunk_length, key, key_offset, *crc);
+        }
+        else
+        {
+            encrypt_decrypt(buffer.data(), buffer.data(), chunk_length, key, key_offset);
+        }
+        output.write(buffer.data(), static_cast<std::streamsize>(chunk_length));
+        key_offset += chunk_length;
+    }
+
+    return key_offset;
+}
+
+/// <summary>
+/// streaming version of read_file -> encrypt_decrypt -> save_data_file.
+/// the output is byte for byte what the one-shot path writes, but only one chunk is ever held in memory
+/// </summary>
+/// <param name="input_filename">file to encrypt or decrypt, may be a pipe or anything else that cannot seek</param>
+/// <param name="output_filename">file to write in the save_data_file layout</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="chunk_size">bytes read, transformed and written at a time</param>
+/// <param name="crc_trailer">end the file with a crc-32c trailer line, taken in the same pass as the encryption</param>
+/// <returns>true if the whole input was transformed and written</returns>
+bool stream_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key, size_t chunk_size = default_chunk_size,
+    bool crc_trailer = false)
+{
+    assert(chunk_size > 0);
+
+    try
+    {
+        std::ifstream readFile(input_filename, std::ios::in | std::ios::binary);
+        if (!readFile)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << input_filename << std::endl;
+            return false;
+        }
+
+        std::ofstream writeFile(output_filename, std::ios::out | std::ios::binary);
+        if (!writeFile)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << output_filename << std::endl;
+            return false;
+        }
+
+        std::vector<char> buffer(chunk_size);
+
+        // the student name has to be written before any data, so it comes from the first chunk.
+        // a first line longer than a whole chunk is treated as no name.
+        readFile.read(buffer.data(), static_cast<std::streamsize>(chunk_size));
+        const size_t first_length = static_cast<size_t>(readFile.gcount());
+        const char* first_newline = static_cast<const char*>(std::memchr(buffer.data(), '\n', first_length));
+        const std::string student_name = first_newline ? std::string(buffer.data(), static_cast<size_t>(first_newline - buffer.data())) : std::string();
+
+        std::ostringstream header;
+        write_data_header(header, student_name, key, crc_trailer);
+        writeFile << header.str();
+        unsigned int crc = crc32c(header.str().data(), header.str().length());
+
+        unsigned long long key_offset = 0;
+        if (first_length > 0)
+        {
+            if (crc_trailer)
+            {
+                encrypt_decrypt_crc32c(buffer.data(), buffer.data(), first_length, key, key_offset, crc);
+            }
+            else
+            {
+                encrypt_decrypt(buffer.data(), buffer.data(), first_length, key, key_offset);
+            }
+            writeFile.write(buffer.data(), static_cast<std::streamsize>(first_length));
+            key_offset = first_length;
+        }
+        encrypt_decrypt_stream(readFile, writeFile, key, buffer, key_offset, crc_trailer ? &crc : nullptr);
+
+        writeFile << std::endl;
+        if (crc_trailer)
+        {
+            writeFile << crc32c_trailer(crc32c("\n", 1, crc));
+        }
+        if (readFile.bad() || !writeFile)
+        {
+            std::cout << "Failed to stream file: " << input_filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        // Exception occurred during streaming
+        std::cout << "Failed to stream file: " << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// fixed capacity queue between exactly one producer thread and one consumer thread. neither side ever takes a lock,
+/// each only writes its own index and reads the other's, so a push and a pop never wait on each other.
+/// </summary>
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : slots_(capacity + 1)
+    {
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // false if the queue is full
+    bool try_push(const T& value)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t next = tail + 1 == slots_.size() ? 0 : tail + 1;
+        if (next == head_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        slots_[tail] = value;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // false if the queue is empty
+    bool try_pop(T& value)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = slots_[head];
+        head_.store(head + 1 == slots_.size() ? 0 : head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // push, waiting while the queue is full. a full queue is the back pressure that holds a fast stage back
+    void push(const T& value)
+    {
+        for (unsigned spins = 0; !try_push(value); ++spins)
+        {
+            wait_a_moment(spins);
+        }
+    }
+
+    // pop, waiting while the queue is empty
+    T pop()
+    {
+        T value;
+        for (unsigned spins = 0; !try_pop(value); ++spins)
+        {
+            wait_a_moment(spins);
+        }
+        return value;
+    }
+
+private:
+    // spin briefly since the other side is usually about to finish, then give the core away
+    static void wait_a_moment(unsigned spins)
+    {
+        if (spins < 64)
+        {
+            return;
+        }
+        if (spins < 1024)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    std::vector<T> slots_;
+    // kept on separate cache lines so the producer and the consumer do not fight over one
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+};
+
+// buffers kept in flight between the pipeline stages when none is given
+const size_t default_pipeline_buffers = 4;
+
+/// <summary>
+/// what each pipeline stage spent its time on. a stage that is busy close to 100% of the time is the bottleneck,
+/// the others spend the rest of it waiting on their queues.
+/// </summary>
+struct pipeline_stats
+{
+    unsigned long long bytes = 0;
+    double seconds = 0;
+    double read_seconds = 0;
+    double transform_seconds = 0;
+    double write_seconds = 0;
+};
+
+/// <summary>
+/// stream_data_file split into a reader, a transformer and a writer thread, so the disk reads the next chunk and
+/// writes the last one while the current one is encrypted. chunk buffers are allocated once and go round
+/// free -> reader -> transformer -> writer -> free, their number bounds both memory and how far the reader can run ahead.
+/// the output is byte for byte what stream_data_file writes.
+/// </summary>
+/// <param name="input_filename">file to encrypt or decrypt</param>
+/// <param name="output_filename">file to write in the save_data_file layout</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="chunk_size">bytes per buffer</param>
+/// <param name="buffer_count">buffers in flight, at least 2 for any overlap and 3 for all three stages to overlap</param>
+/// <param name="stats">optional, receives how busy each stage was</param>
+/// <returns>true if the whole input was transformed and written</returns>
+bool pipeline_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key,
+    size_t chunk_size = default_chunk_size, size_t buffer_count = default_pipeline_buffers, pipeline_stats* stats = nullptr)
+{
+    assert(chunk_size > 0 && buffer_count > 0);
+
+    const native_file input = open_native_file(input_filename);
+    if (input == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << input_filename << std::endl;
+        return false;
+    }
+    const native_file output = create_native_file(output_filename);
+    if (output == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << output_filename << std::endl;
+        close_native_file(input);
+        return false;
+    }
+
+    struct chunk
+    {
+        std::vector<char> data;
+        size_t length = 0;
+        unsigned long long offset = 0;
+    };
+    std::vector<chunk> chunks(buffer_count);
+    for (chunk& c : chunks)
+    {
+        c.data.resize(chunk_size);
+    }
+
+    // queues carry buffer indices, end_of_input follows the last chunk down the line
+    const size_t end_of_input = static_cast<size_t>(-1);
+    BoundedQueue<size_t> free_chunks(buffer_count);
+    BoundedQueue<size_t> read_chunks(buffer_count);
+    BoundedQueue<size_t> transformed_chunks(buffer_count);
+    for (size_t i = 0; i < buffer_count; ++i)
+    {
+        free_chunks.push(i);
+    }
+
+    std::atomic<bool> failed{ false };
+    std::string student_name;
+    typedef std::chrono::steady_clock clock;
+    std::chrono::duration<double> read_time(0), transform_time(0), write_time(0);
+    const auto start = clock::now();
+
+    std::thread reader([&]()
+    {
+        unsigned long long offset = 0;
+        for (;;)
+        {
+            const size_t index = free_chunks.pop();
+            chunk& c = chunks[index];
+            const auto began = clock::now();
+            const long long got = failed ? 0 : read_native_file(input, c.data.data(), chunk_size);
+            read_time += clock::now() - began;
+            if (got <= 0)
+            {
+                if (got < 0)
+                {
+                    failed = true;
+                }
+                read_chunks.push(end_of_input);
+                return;
+            }
+            c.length = static_cast<size_t>(got);
+            c.offset = offset;
+            if (offset == 0)
+            {
+                // the name goes in the header ahead of any data, so it comes from the first chunk before it is encrypted.
+                // the queue hands it to the writer along with the chunk.
+                const char* newline = static_cast<const char*>(std::memchr(c.data.data(), '\n', c.length));
+                if (newline != nullptr)
+                {
+                    student_name.assign(c.data.data(), static_cast<size_t>(newline - c.data.data()));
+                }
+            }
+            offset += c.length;
+            read_chunks.push(index);
+        }
+    });
+
+    std::thread transformer([&]()
+    {
+        for (;;)
+        {
+            const size_t index = read_chunks.pop();
+            if (index == end_of_input)
+            {
+                transformed_chunks.push(end_of_input);
+                return;
+            }
+            chunk& c = chunks[index];
+            const auto began = clock::now();
+            encrypt_decrypt(c.data.data(), c.data.data(), c.length, key, c.offset);
+            transform_time += clock::now() - began;
+            transformed_chunks.push(index);
+        }
+    });
+
+    // the writer runs here. after a failed write it keeps recycling buffers so the other stages can finish
+    unsigned long long bytes = 0;
+    bool header_written = false;
+    const char newline[] = "\n";
+    char date_line[32];
+    std::snprintf(date_line, sizeof(date_line), "\n%s\n", current_date().c_str());
+    for (;;)
+    {
+        const size_t index = transformed_chunks.pop();
+        const bool last = index == end_of_input;
+        const auto began = clock::now();
+        if (!failed)
+        {
+            write_piece pieces[6];
+            size_t piece_count = 0;
+            if (!header_written)
+            {
+                pieces[piece_count++] = write_piece(student_name.data(), student_name.length());
+                pieces[piece_count++] = write_piece(date_line, std::strlen(date_line));
+                pieces[piece_count++] = write_piece(key.data(), key.length());
+                pieces[piece_count++] = write_piece(newline, 1);
+                header_written = true;
+            }
+            if (!last)
+            {
+                pieces[piece_count++] = write_piece(chunks[index].data.data(), chunks[index].length);
+            }
+            else
+            {
+                pieces[piece_count++] = write_piece(newline, 1);
+            }
+            if (!write_gathered(output, pieces, piece_count))
+            {
+                failed = true;
+            }
+        }
+        write_time += clock::now() - began;
+        if (last)
+        {
+            break;
+        }
+        bytes += chunks[index].length;
+        free_chunks.push(index);
+    }
+
+    reader.join();
+    transformer.join();
+    close_native_file(input);
+    close_native_file(output);
+
+    if (stats != nullptr)
+    {
+        stats->bytes = bytes;
+        stats->seconds = std::chrono::duration<double>(clock::now() - start).count();
+        stats->read_seconds = read_time.count();
+        stats->transform_seconds = transform_time.count();
+        stats->write_seconds = write_time.count();
+    }
+    if (failed)
+    {
+        std::cout << "Failed to stream file: " << input_filename << std::endl;
+    }
+    return !failed;
+}
+
+// o_direct and FILE_FLAG_NO_BUFFERING need every buffer address, length and file offset to be a multiple of the
+// device's logical block size. 4096 covers 4k drives and 512 byte sector drives alike
+const size_t direct_io_alignment = 4096;
+
+// round length up to the next multiple of direct_io_alignment
+size_t align_up(size_t length)
+{
+    return (length + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+}
+
+/// <summary>
+/// heap buffer starting on a direct_io_alignment boundary, allocated once and reused for every chunk
+/// </summary>
+class AlignedBuffer
+{
+public:
+    explicit AlignedBuffer(size_t size)
+        : size_(size)
+    {
+#if defined(_WIN32)
+        data_ = static_cast<char*>(_aligned_malloc(size, direct_io_alignment));
+#else
+        void* data = nullptr;
+        data_ = posix_memalign(&data, direct_io_alignment, size) == 0 ? static_cast<char*>(data) : nullptr;
+#endif
+        if (data_ == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~AlignedBuffer()
+    {
+#if defined(_WIN32)
+        _aligned_free(data_);
+#else
+        free(data_);
+#endif
+    }
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    char* data() { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    char* data_;
+    size_t size_;
+};
+
+/// <summary>
+/// open a file so its reads or writes go between the device and the caller's buffer without a copy in the page cache
+/// </summary>
+/// <param name="for_writing">create or truncate the file for writing, otherwise open it for reading</param>
+/// <returns>invalid_native_file if the file cannot be opened or its file system does not support unbuffered i/o</returns>
+native_file open_direct_file(const std::string& filename, bool for_writing)
+{
+#if defined(_WIN32)
+    return CreateFileA(filename.c_str(), for_writing ? GENERIC_WRITE : GENERIC_READ, for_writing ? 0 : FILE_SHARE_READ, nullptr, for_writing ? CREATE_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+    const int flags = for_writing ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+#if defined(O_DIRECT)
+    return open(filename.c_str(), flags | O_DIRECT, 0644);
+#else
+    const native_file file = open(filename.c_str(), flags, 0644);
+#if defined(F_NOCACHE)
+    // macos has no o_direct, this asks it to keep the file's pages out of the cache instead
+    if (file != invalid_native_file)
+    {
+        fcntl(file, F_NOCACHE, 1);
+    }
+#endif
+    return file;
+#endif
+#endif
+}
+
+/// <summary>
+/// one read of up to length bytes, which for unbuffered i/o has to be a whole number of aligned blocks.
+/// a regular file only returns fewer bytes than asked for at its end.
+/// </summary>
+/// <returns>bytes read, or -1 if the read failed</returns>
+long long read_direct_file(native_file file, char* buffer, size_t length)
+{
+#if defined(_WIN32)
+    DWORD got = 0;
+    return ReadFile(file, buffer, static_cast<DWORD>(length), &got, nullptr) ? static_cast<long long>(got) : -1;
+#else
+    for (;;)
+    {
+        const ssize_t got = read(file, buffer, length);
+        if (got >= 0 || errno != EINTR)
+        {
+            return got;
+        }
+    }
+#endif
+}
+
+/// <summary>
+/// cut a file back to length bytes, used after the last aligned write went past the real end
+/// </summary>
+bool truncate_native_file(native_file file, unsigned long long length)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(length);
+    return SetFilePointerEx(file, position, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+#else
+    return ftruncate(file, static_cast<off_t>(length)) == 0;
+#endif
+}
+
+/// <summary>
+/// stream_data_file with unbuffered i/o, for files far larger than memory. nothing passes through the page cache,
+/// so encrypting a huge archive does not evict everything else on the host. the header makes the output offsets
+/// differ from the input ones, so each chunk is encrypted from the aligned read buffer straight into an aligned write
+/// buffer at the right place, and the few bytes past the last whole block wait there for the next chunk. the last
+/// partial block is written padded and the file cut back to its real length.
+/// the output is byte for byte what stream_data_file writes. a file system without unbuffered i/o gets ordinary
+/// buffered i/o for that file.
+/// </summary>
+/// <param name="input_filename">file to encrypt or decrypt</param>
+/// <param name="output_filename">file to write in the save_data_file layout</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="chunk_size">bytes read at a time, rounded up to a whole number of aligned blocks</param>
+/// <returns>true if the whole input was transformed and written</returns>
+bool direct_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key, size_t chunk_size = default_chunk_size)
+{
+    assert(chunk_size > 0);
+    chunk_size = align_up(chunk_size);
+
+    native_file input = open_direct_file(input_filename, false);
+    if (input == invalid_native_file)
+    {
+        input = open_native_file(input_filename);
+        if (input != invalid_native_file)
+        {
+            std::cout << "Unbuffered i/o is not supported for " << input_filename << ", reading it through the cache" << std::endl;
+        }
+    }
+    if (input == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << input_filename << std::endl;
+        return false;
+    }
+    native_file output = open_direct_file(output_filename, true);
+    if (output == invalid_native_file)
+    {
+        output = create_native_file(output_filename);
+        if (output != invalid_native_file)
+        {
+            std::cout << "Unbuffered i/o is not supported for " << output_filename << ", writing it through the cache" << std::endl;
+        }
+    }
+    if (output == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << output_filename << std::endl;
+        close_native_file(input);
+        return false;
+    }
+
+    bool ok = true;
+    try
+    {
+        AlignedBuffer input_buffer(chunk_size);
+        long long got = read_direct_file(input, input_buffer.data(), chunk_size);
+        ok = got >= 0;
+
+        // the student name has to be written before any data, so it comes from the first chunk
+        const size_t first_length = ok ? static_cast<size_t>(got) : 0;
+        const char* first_newline = static_cast<const char*>(std::memchr(input_buffer.data(), '\n', first_length));
+        const size_t name_length = first_newline ? static_cast<size_t>(first_newline - input_buffer.data()) : 0;
+        char date_line[32];
+        std::snprintf(date_line, sizeof(date_line), "\n%s\n", current_date().c_str());
+        const size_t header_length = name_length + std::strlen(date_line) + key.length() + 1;
+
+        // after every flush fewer than direct_io_alignment bytes stay behind, so a whole chunk always fits after them
+        AlignedBuffer output_buffer(align_up(header_length) + chunk_size + direct_io_alignment);
+        char* const out = output_buffer.data();
+        std::memcpy(out, input_buffer.data(), name_length);
+        std::memcpy(out + name_length, date_line, std::strlen(date_line));
+        std::memcpy(out + name_length + std::strlen(date_line), key.data(), key.length());
+        out[header_length - 1] = '\n';
+        size_t pending = header_length;
+        unsigned long long written = 0;
+        unsigned long long key_offset = 0;
+
+        while (ok && got > 0)
+        {
+            const size_t length = static_cast<size_t>(got);
+            encrypt_decrypt(input_buffer.data(), out + pending, length, key, key_offset);
+            key_offset += length;
+            pending += length;
+
+            // write every whole block and keep the rest for the next chunk
+            const size_t whole = pending / direct_io_alignment * direct_io_alignment;
+            write_piece piece(out, whole);
+            ok = whole == 0 || write_gathered(output, &piece, 1);
+            written += whole;
+            std::memmove(out, out + whole, pending - whole);
+            pending -= whole;
+
+            if (length < chunk_size)
+            {
+                break;
+            }
+            got = read_direct_file(input, input_buffer.data(), chunk_size);
+            ok = ok && got >= 0;
+        }
+
+        if (ok)
+        {
+            // the final newline, then the last partial block padded out to a whole one and the padding cut off again
+            out[pending++] = '\n';
+            const size_t padded = align_up(pending);
+            std::memset(out + pending, 0, padded - pending);
+            write_piece piece(out, padded);
+            ok = write_gathered(output, &piece, 1) && truncate_native_file(output, written + pending);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Failed to allocate buffers: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    close_native_file(input);
+    close_native_file(output);
+    if (!ok)
+    {
+        std::cout << "Failed to stream file: " << input_filename << std::endl;
+    }
+    return ok;
+}
+
+/// <summary>
+/// whole-file memory mapping, read only for an input or pre-sized and writable for an output
+/// </summary>
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { unmap(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// <summary>
+    /// map an existing file read only with a sequential access hint
+    /// </summary>
+    /// <returns>false if the file is empty or cannot be mapped</returns>
+    bool map_input(const std::string& filename)
+    {
+        unmap();
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER file_size = {};
+        if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && static_cast<unsigned long long>(file_size.QuadPart) <= SIZE_MAX)
+        {
+            // the view keeps the mapping object alive, so both handles can be closed straight away
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr)
+            {
+                data_ = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                size_ = data_ ? static_cast<size_t>(file_size.QuadPart) : 0;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        const int file = open(filename.c_str(), O_RDONLY);
+        if (file < 0)
+        {
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0 && static_cast<unsigned long long>(file_stat.st_size) <= SIZE_MAX)
+        {
+            const size_t file_size = static_cast<size_t>(file_stat.st_size);
+            void* view = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (view != MAP_FAILED)
+            {
+                madvise(view, file_size, MADV_SEQUENTIAL);
+                data_ = static_cast<char*>(view);
+                size_ = file_size;
+            }
+        }
+        close(file);
+#endif
+        return data_ != nullptr;
+    }
+
+    /// <summary>
+    /// create or truncate a file, size it up front and map it writable
+    /// </summary>
+    /// <returns>false if the file cannot be created, sized or mapped</returns>
+    bool map_output(const std::string& filename, size_t size)
+    {
+        unmap();
+        assert(size > 0);
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        // creating a mapping larger than the file extends the file to that size
+        const unsigned long long mapping_size = size;
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(mapping_size >> 32), static_cast<DWORD>(mapping_size), nullptr);
+        if (mapping != nullptr)
+        {
+            data_ = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size));
+            size_ = data_ ? size : 0;
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+#else
+        const int file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+        {
+            return false;
+        }
+        if (ftruncate(file, static_cast<off_t>(size)) == 0)
+        {
+            void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if (view != MAP_FAILED)
+            {
+                madvise(view, size, MADV_SEQUENTIAL);
+                data_ = static_cast<char*>(view);
+                size_ = size;
+            }
+        }
+        close(file);
+#endif
+        return data_ != nullptr;
+    }
+
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    void unmap()
+    {
+        if (data_ != nullptr)
+        {
+#if defined(_WIN32)
+            UnmapViewOfFile(data_);
+#else
+            munmap(data_, size_);
+#endif
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/// <summary>
+/// memory mapped version of read_file -> encrypt_decrypt -> save_data_file.
+/// the kernel reads straight from the input mapping and writes straight into the output mapping,
+/// so the payload is never copied through a stream buffer.
+/// </summary>
+/// <param name="input_filename">file to encrypt or decrypt</param>
+/// <param name="output_filename">file to write in the save_data_file layout</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <returns>false if either file could not be mapped, nothing useful has been written in that case</returns>
+bool map_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key)
+{
+    MappedFile input;
+    if (!input.map_input(input_filename))
+    {
+        return false;
+    }
+
+    const char* first_newline = static_cast<const char*>(std::memchr(input.data(), '\n', input.size()));
+    const std::string student_name = first_newline ? std::string(input.data(), static_cast<size_t>(first_newline - input.data())) : std::string();
+
+    // the header lines are written exactly as save_data_file writes them
+    std::ostringstream header_stream;
+    write_data_header(header_stream, student_name, key);
+    const std::string header = header_stream.str();
+
+    MappedFile output;
+    if (!output.map_output(output_filename, header.length() + input.size() + 1))
+    {
+        return false;
+    }
+
+    std::memcpy(output.data(), header.data(), header.length());
+    encrypt_decrypt(input.data(), output.data() + header.length(), input.size(), key);
+    output.data()[output.size() - 1] = '\n';
+
+    return true;
+}
+
+/// <summary>
+/// encrypt a file through memory mappings, falling back to the streaming path when mapping fails
+/// </summary>
+/// <returns>true if the output was written by either path</returns>
+bool map_or_stream_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key)
+{
+    if (map_data_file(input_filename, output_filename, key))
+    {
+        return true;
+    }
+
+    std::cout << "Could not map " << input_filename << ", using streams instead" << std::endl;
+    return stream_data_file(input_filename, output_filename, key);
+}
+
+/// <summary>
+/// 64 bit fingerprint of a key, stored in place of the key so a reader can tell the wrong key was supplied.
+/// it is hmac-sha256 keyed with the key over a per file salt, truncated, so it cannot be looked up in a table made
+/// in advance or matched between files, and checking a guessed key against it costs an hmac for that one file
+/// </summary>
+unsigned long long key_fingerprint(const std::string& key, const char salt[key_id_salt_size])
+{
+    static const char label[] = "key fingerprint ";
+    char message[sizeof(label) - 1 + key_id_salt_size];
+    std::memcpy(message, label, sizeof(label) - 1);
+    std::memcpy(message + sizeof(label) - 1, salt, key_id_salt_size);
+    unsigned char digest[Sha256::digest_size];
+    HmacSha256(key).mac(message, sizeof(message), digest);
+    return get_le(reinterpret_cast<const char*>(digest), 8);
+}
+
+/// <summary>
+/// fresh salt for a key fingerprint, from the os random source like make_nonce
+/// </summary>
+void make_key_id_salt(char salt[key_id_salt_size])
+{
+    std::random_device random;
+    for (size_t i = 0; i < key_id_salt_size; ++i)
+    {
+        salt[i] = static_cast<char>(random());
+    }
+}
+
+void encode_container_header(const container_header& header, char* out)
+{
+    std::memset(out, 0, container_header_size);
+    std::memcpy(out, container_magic, sizeof(container_magic));
+    put_le(out + 4, header.version, 2);
+    put_le(out + 6, header.header_size, 2);
+    put_le(out + 8, header.flags, 4);
+    put_le(out + 12, static_cast<unsigned char>(header.cipher), 1);
+    put_le(out + 16, header.metadata_offset, 8);
+    put_le(out + 24, header.metadata_length, 8);
+    put_le(out + 32, header.key_id, 8);
+    put_le(out + 40, header.payload_offset, 8);
+    put_le(out + 48, header.payload_length, 8);
+    put_le(out + 56, static_cast<unsigned long long>(header.created), 8);
+    std::memcpy(out + 64, header.nonce, container_nonce_size);
+    put_le(out + 80, header.compression_block_size, 4);
+    put_le(out + 88, header.plain_length, 8);
+    std::memcpy(out + 96, header.key_salt, key_id_salt_size);
+}
+
+/// <summary>
+/// parse and sanity check a container header
+/// </summary>
+/// <returns>false if the bytes are not a container header this version understands</returns>
+bool decode_container_header(const char* in, size_t length, container_header& header)
+{
+    if (length < container_header_size || std::memcmp(in, container_magic, sizeof(container_magic)) != 0)
+    {
+        return false;
+    }
+
+    header.version = static_cast<unsigned short>(get_le(in + 4, 2));
+    header.header_size = static_cast<unsigned short>(get_le(in + 6, 2));
+    header.flags = static_cast<unsigned int>(get_le(in + 8, 4));
+    header.metadata_offset = get_le(in + 16, 8);
+    header.metadata_length = get_le(in + 24, 8);
+    header.key_id = get_le(in + 32, 8);
+    header.payload_offset = get_le(in + 40, 8);
+    header.payload_length = get_le(in + 48, 8);
+    header.created = static_cast<long long>(get_le(in + 56, 8));
+    const unsigned long long cipher = get_le(in + 12, 1);
+    header.cipher = static_cast<cipher_id>(cipher);
+    std::memcpy(header.nonce, in + 64, container_nonce_size);
+    header.compression_block_size = static_cast<unsigned int>(get_le(in + 80, 4));
+    header.plain_length = get_le(in + 88, 8);
+    std::memcpy(header.key_salt, in + 96, key_id_salt_size);
+    const bool compressed = (header.flags & container_flag_compressed) != 0;
+
+    // a cipher this build does not know would decrypt to garbage, so the file is refused instead
+    return header.version == container_version
+        && cipher <= static_cast<unsigned char>(cipher_id::chacha20_poly1305)
+        && (!compressed || (header.compression_block_size > 0 && header.compression_block_size <= max_compression_block_size))
+        && header.header_size >= container_header_size
+        && header.metadata_offset >= header.header_size
+        && header.metadata_length <= max_container_metadata_size
+        && header.payload_offset <= max_container_offset
+        && header.metadata_offset <= header.payload_offset
+        && header.metadata_length <= header.payload_offset - header.metadata_offset
+        && header.payload_length <= max_container_offset - header.payload_offset;
+}
+
+/// <summary>
+/// build the metadata block: each field is a u32 length followed by its bytes
+/// </summary>
+std::string encode_container_metadata(const std::string& student_name, const std::string& date, const std::string& kdf = std::string())
+{
+    std::string metadata;
+    for (const std::string* field : { &student_name, &date, &kdf })
+    {
+        if (field == &kdf && kdf.empty())
+        {
+            break;
+        }
+        char length[4];
+        put_le(length, field->length(), 4);
+        metadata.append(length, sizeof(length));
+        metadata.append(*field);
+    }
+    return metadata;
+}
+
+/// <summary>
+/// split a metadata block back into its fields
+/// </summary>
+/// <param name="kdf">optional, receives the key derivation descriptor, empty if the key was not derived from a password</param>
+/// <returns>false if a field runs past the end of the block</returns>
+bool decode_container_metadata(const std::string& metadata, std::string& student_name, std::string& date, std::string* kdf = nullptr)
+{
+    std::string kdf_field;
+    size_t position = 0;
+    for (std::string* field : { &student_name, &date, &kdf_field })
+    {
+        if (field == &kdf_field && position == metadata.length())
+        {
+            // containers written without a derived key stop after the date
+            break;
+        }
+        if (metadata.length() - position < 4)
+        {
+            return false;
+        }
+        const size_t field_length = static_cast<size_t>(get_le(metadata.data() + position, 4));
+        position += 4;
+        if (metadata.length() - position < field_length)
+        {
+            return false;
+        }
+        field->assign(metadata, position, field_length);
+        position += field_length;
+    }
+    if (kdf != nullptr)
+    {
+        kdf->swap(kdf_field);
+    }
+    return true;
+}
+
+/// <summary>
+/// binary replacement for save_data_file. the header records where everything is, so a reader
+/// finds the payload without scanning and newline bytes in the ciphertext cannot break the layout.
+/// </summary>
+/// <param name="filename">container file to write</param>
+/// <param name="student_name">stored in the metadata block</param>
+/// <param name="key">key the payload was encrypted with, only its fingerprint is written</param>
+/// <param name="data">encrypted payload</param>
+/// <param name="cipher">cipher data was encrypted with</param>
+/// <param name="nonce">nonce data was encrypted with, empty for the xor cipher</param>
+/// <param name="sync_batch">optional, hands the finished file over to be synced to disk with others</param>
+/// <param name="compression_block_size">block size data was compressed with before it was encrypted, 0 if it was not</param>
+/// <param name="plain_length">length of the data before compression</param>
+/// <param name="kdf">kdf_descriptor of how key was derived from a password, empty if it was not</param>
+/// <returns>true if the whole file was written</returns>
+bool save_container_file(const std::string& filename, const std::string& student_name, const std::string& key, const std::string& data,
+    cipher_id cipher = cipher_id::xor_key, const std::string& nonce = std::string(), FileSyncBatch* sync_batch = nullptr,
+    size_t compression_block_size = 0, unsigned long long plain_length = 0, const std::string& kdf = std::string())
+{
+    try
+    {
+        const std::string metadata = encode_container_metadata(student_name, current_date(), kdf);
+        if (metadata.length() > max_container_metadata_size)
+        {
+            // a reader would refuse the header
+            std::cout << "Student name too long for a container: " << filename << std::endl;
+            return false;
+        }
+
+        container_header header;
+        header.metadata_offset = container_header_size;
+        header.metadata_length = metadata.length();
+        make_key_id_salt(header.key_salt);
+        header.key_id = key_fingerprint(key, header.key_salt);
+        header.payload_offset = (container_header_size + metadata.length() + container_payload_alignment - 1) / container_payload_alignment * container_payload_alignment;
+        header.payload_length = data.length();
+        header.created = static_cast<long long>(std::time(nullptr));
+        header.cipher = cipher;
+        assert(nonce.length() == cipher_nonce_size(cipher));
+        std::memcpy(header.nonce, nonce.data(), std::min(nonce.length(), container_nonce_size));
+        if (compression_block_size > 0)
+        {
+            header.flags |= container_flag_compressed;
+            header.compression_block_size = static_cast<unsigned int>(compression_block_size);
+            header.plain_length = plain_length;
+        }
+
+        // header, metadata and padding are built together and go out in one gathered write with the payload
+        std::string prefix(static_cast<size_t>(header.payload_offset), '\0');
+        encode_container_header(header, &prefix[0]);
+        prefix.replace(container_header_size, metadata.length(), metadata);
+
+        const native_file file = create_native_file(filename);
+        if (file == invalid_native_file)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        write_piece pieces[] =
+        {
+            write_piece(prefix.data(), prefix.length()),
+            write_piece(data.data(), data.length()),
+        };
+        const bool written = write_gathered(file, pieces, sizeof(pieces) / sizeof(pieces[0]));
+        if (!written)
+        {
+            // Failed while writing the file
+            std::cout << "Failed to write file: " << filename << std::endl;
+        }
+        if (written && sync_batch != nullptr)
+        {
+            sync_batch->add(file);
+        }
+        else
+        {
+            close_native_file(file);
+        }
+        return written;
+    }
+    catch (const std::exception& e)
+    {
+        // Exception occurred during file writing
+        std::cout << "Failed to write file: " << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// read a container's header and metadata, leaving the stream positioned at the start of the payload
+/// </summary>
+/// <returns>false if the file is not a valid container</returns>
+/// <param name="kdf">optional, receives the key derivation descriptor</param>
+bool read_container_header(std::istream& readFile, container_header& header, std::string& student_name, std::string& date, std::string* kdf = nullptr)
+{
+    char raw_header[container_header_size];
+    if (!readFile.read(raw_header, sizeof(raw_header)) || !decode_container_header(raw_header, sizeof(raw_header), header))
+    {
+        return false;
+    }
+
+    std::string metadata(static_cast<size_t>(header.metadata_length), '\0');
+    readFile.seekg(static_cast<std::streamoff>(header.metadata_offset));
+    if (!metadata.empty() && !readFile.read(&metadata[0], static_cast<std::streamsize>(metadata.length())))
+    {
+        return false;
+    }
+    if (!decode_container_metadata(metadata, student_name, date, kdf))
+    {
+        return false;
+    }
+
+    // one seek straight to the payload
+    readFile.seekg(static_cast<std::streamoff>(header.payload_offset));
+    return static_cast<bool>(readFile);
+}
+
+/// <summary>
+/// read a container file's metadata and encrypted payload
+/// </summary>
+/// <returns>false if the file cannot be read or is not a valid container</returns>
+bool read_container_file(const std::string& filename, container_header& header, std::string& student_name, std::string& date, std::string& payload)
+{
+    try
+    {
+        std::ifstream readFile(filename, std::ios::in | std::ios::binary);
+        if (!readFile)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        if (!read_container_header(readFile, header, student_name, date))
+        {
+            std::cout << "Not a valid container file: " << filename << std::endl;
+            return false;
+        }
+
+        payload.resize(static_cast<size_t>(header.payload_length));
+        if (!payload.empty() && !readFile.read(&payload[0], static_cast<std::streamsize>(payload.length())))
+        {
+            std::cout << "Container payload is truncated: " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        // Exception occurred during file reading
+        std::cout << "Failed to read file: " << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// map a container file and locate its payload inside the mapping without reading anything else
+/// </summary>
+/// <param name="mapping">receives the mapping, the payload pointer is only valid while it lives</param>
+/// <returns>pointer to the first payload byte, or nullptr if the file cannot be mapped or is not a valid container</returns>
+const char* map_container_payload(const std::string& filename, MappedFile& mapping, container_header& header)
+{
+    if (!mapping.map_input(filename)
+        || !decode_container_header(mapping.data(), mapping.size(), header)
+        || header.payload_offset > mapping.size()
+        || header.payload_length > mapping.size() - header.payload_offset)
+    {
+        return nullptr;
+    }
+    return mapping.data() + header.payload_offset;
+}
+
+// the most read_student_name looks at, the name line of any real file is far shorter
+const size_t student_name_prefix_size = 4096;
+
+/// <summary>
+/// get a file's student name from a small bounded prefix instead of reading the whole file first.
+/// a plain input or save_data_file output has the name as its first line, a container has it in its metadata block.
+/// </summary>
+/// <param name="filename">file to look in</param>
+/// <param name="student_name">receives the name, empty if a short file has no newline, as get_student_name does</param>
+/// <returns>false if the file cannot be read or the name does not end within the prefix</returns>
+bool read_student_name(const std::string& filename, std::string& student_name)
+{
+    student_name.clear();
+    const native_file file = open_native_file(filename);
+    if (file == invalid_native_file)
+    {
+        // Failed to open the file
+        std::cout << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+    char prefix[student_name_prefix_size];
+    const long long prefix_length = read_native_file(file, prefix, sizeof(prefix));
+    close_native_file(file);
+    if (prefix_length < 0)
+    {
+        std::cout << "Failed to read file: " << filename << std::endl;
+        return false;
+    }
+    const size_t length = static_cast<size_t>(prefix_length);
+
+    container_header header;
+    if (decode_container_header(prefix, length, header))
+    {
+        std::string date;
+        return header.metadata_offset <= length
+            && header.metadata_length <= length - header.metadata_offset
+            && decode_container_metadata(std::string(prefix + header.metadata_offset, static_cast<size_t>(header.metadata_length)), student_name, date);
+    }
+
+    const char* newline = static_cast<const char*>(std::memchr(prefix, '\n', length));
+    if (newline != nullptr)
+    {
+        student_name.assign(prefix, static_cast<size_t>(newline - prefix));
+        return true;
+    }
+    // a file shorter than the prefix was read whole, so it really has no name line
+    if (length < sizeof(prefix))
+    {
+        return true;
+    }
+    std::cout << "No student name in the first " << sizeof(prefix) << " bytes: " << filename << std::endl;
+    return false;
+}
+
+/// <summary>
+/// decrypts arbitrary byte ranges of an encrypted file's payload without reading the rest of it.
+/// the file is opened and its payload located once, so many small reads only cost a seek and a read each.
+/// </summary>
+class RangeReader
+{
+public:
+    /// <summary>
+    /// open an encrypted file in either the binary container or the save_data_file text layout
+    /// </summary>
+    /// <returns>false if the file cannot be opened or its payload cannot be found</returns>
+    bool open(const std::string& filename)
+    {
+        payload_offset_ = 0;
+        payload_length_ = 0;
+        cipher_ = cipher_id::xor_key;
+        nonce_.clear();
+        engine_.reset();
+        engine_key_.clear();
+        readFile_.close();
+        readFile_.clear();
+        readFile_.open(filename, std::ios::in | std::ios::binary);
+        if (!readFile_)
+        {
+            std::cout << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+
+        readFile_.seekg(0, std::ios::end);
+        const unsigned long long file_size = static_cast<unsigned long long>(readFile_.tellg());
+        readFile_.seekg(0, std::ios::beg);
+
+        // the header lines of the text layout are short, a bounded prefix is enough to find either kind of header
+        char prefix[4096];
+        readFile_.read(prefix, sizeof(prefix));
+        const size_t prefix_length = static_cast<size_t>(readFile_.gcount());
+        readFile_.clear();
+
+        container_header header;
+        if (decode_container_header(prefix, prefix_length, header))
+        {
+            if (header.payload_offset > file_size || header.payload_length > file_size - header.payload_offset)
+            {
+                std::cout << "Container payload is truncated: " << filename << std::endl;
+                return false;
+            }
+            if ((header.flags & container_flag_compressed) != 0)
+            {
+                // plain text offsets do not map to payload offsets once the blocks are compressed
+                std::cout << "Range reads of compressed containers are not supported: " << filename << std::endl;
+                return false;
+            }
+            payload_offset_ = header.payload_offset;
+            payload_length_ = header.payload_length;
+            cipher_ = header.cipher;
+            nonce_.assign(header.nonce, cipher_nonce_size(header.cipher));
+            if (cipher_is_sealed(cipher_) && !sealed_plain_length(header.payload_length, payload_length_))
+            {
+                std::cout << "Sealed payload has an impossible length: " << filename << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // text layout: name, date and key lines, then the payload followed by a final newline.
+        // files written by older builds in text mode on windows have any newline bytes inside the ciphertext
+        // expanded to two bytes, offsets into such a payload drift after the first one.
+        size_t line_starts[4] = { 0 };
+        for (int line = 0; line < 3; ++line)
+        {
+            const char* newline = static_cast<const char*>(std::memchr(prefix + line_starts[line], '\n', prefix_length - line_starts[line]));
+            if (newline == nullptr)
+            {
+                std::cout << "Could not find the payload in: " << filename << std::endl;
+                return false;
+            }
+            line_starts[line + 1] = static_cast<size_t>(newline - prefix) + 1;
+        }
+        payload_offset_ = line_starts[3];
+        payload_length_ = file_size > payload_offset_ ? file_size - payload_offset_ - 1 : 0;
+        // a file marked on its date line ends in a trailer that is not part of the payload
+        if (crc32c_marked(prefix + line_starts[1], line_starts[2] - line_starts[1] - 1))
+        {
+            payload_length_ -= std::min<unsigned long long>(payload_length_, crc32c_trailer_size);
+        }
+        return true;
+    }
+
+    unsigned long long payload_length() const { return payload_length_; }
+
+    /// <summary>
+    /// read and decrypt payload bytes [offset, offset + length), clipped to the end of the payload
+    /// </summary>
+    /// <param name="output">receives the plain text, its capacity is reused between calls</param>
+    /// <returns>false if the range starts past the end of the payload or the read fails</returns>
+    bool read(unsigned long long offset, size_t length, const std::string& key, std::string& output)
+    {
+        output.clear();
+        if (offset > payload_length_)
+        {
+            return false;
+        }
+        length = static_cast<size_t>(std::min<unsigned long long>(length, payload_length_ - offset));
+        if (length == 0)
+        {
+            return true;
+        }
+
+        if (cipher_is_sealed(cipher_))
+        {
+            return read_sealed(offset, length, key, output);
+        }
+
+        output.resize(length);
+        readFile_.seekg(static_cast<std::streamoff>(payload_offset_ + offset));
+        if (!readFile_.read(&output[0], static_cast<std::streamsize>(length)))
+        {
+            readFile_.clear();
+            output.clear();
+            return false;
+        }
+
+        // the key position of a payload byte is just its offset, so the range decrypts on its own.
+        // the engine is kept between reads so a cipher's key schedule is only worked out once per key.
+        if (!engine_ || engine_key_ != key)
+        {
+            engine_ = make_cipher_engine(cipher_, key, nonce_);
+            engine_key_ = key;
+        }
+        engine_->transform(&output[0], &output[0], length, offset);
+        return true;
+    }
+
+private:
+    // a sealed payload can only be trusted a whole segment at a time, so every segment the range touches
+    // is read and verified, and only the requested part of it is handed back
+    bool read_sealed(unsigned long long offset, size_t length, const std::string& key, std::string& output)
+    {
+        if (engine_key_ != key || segment_.empty())
+        {
+            unsigned char cipher_key[cipher_key_size];
+            cipher_key_from_string(key, cipher_key);
+            chacha_initial_state(cipher_key, reinterpret_cast<const unsigned char*>(nonce_.data()), sealed_state_);
+            engine_key_ = key;
+            segment_.resize(sealed_segment_size + Poly1305::tag_size);
+            plain_segment_.resize(sealed_segment_size);
+        }
+
+        const chacha_blocks_kernel kernel = active_chacha_kernel().second;
+        output.resize(length);
+        size_t copied = 0;
+        while (copied < length)
+        {
+            const unsigned long long position = offset + copied;
+            const unsigned long long segment = position / sealed_segment_size;
+            const unsigned long long segment_start = segment * sealed_segment_size;
+            const size_t segment_length = static_cast<size_t>(std::min<unsigned long long>(sealed_segment_size, payload_length_ - segment_start));
+            const bool last = segment_start + segment_length == payload_length_;
+
+            readFile_.seekg(static_cast<std::streamoff>(payload_offset_ + segment * (sealed_segment_size + Poly1305::tag_size)));
+            unsigned char tag[Poly1305::tag_size];
+            if (!readFile_.read(segment_.data(), static_cast<std::streamsize>(segment_length + Poly1305::tag_size)))
+            {
+                readFile_.clear();
+                output.clear();
+                return false;
+            }
+            sealed_segment_transform(sealed_state_, kernel, segment, last, false, segment_.data(), plain_segment_.data(), segment_length, tag);
+            if (!tags_equal(tag, reinterpret_cast<const unsigned char*>(segment_.data() + segment_length)))
+            {
+                std::cout << "Authentication failed at segment " << segment << std::endl;
+                output.clear();
+                return false;
+            }
+
+            const size_t skip = static_cast<size_t>(position - segment_start);
+            const size_t take = std::min(length - copied, segment_length - skip);
+            std::memcpy(&output[copied], plain_segment_.data() + skip, take);
+            copied += take;
+        }
+        return true;
+    }
+
+    std::ifstream readFile_;
+    unsigned long long payload_offset_ = 0;
+    unsigned long long payload_length_ = 0;
+    cipher_id cipher_ = cipher_id::xor_key;
+    std::string nonce_;
+    std::unique_ptr<CipherEngine> engine_;
+    std::string engine_key_;
+    chacha_state sealed_state_;
+    std::vector<char> segment_;
+    std::vector<char> plain_segment_;
+};
+
+/// <summary>
+/// decrypt bytes [offset, offset + length) of an encrypted file's payload
+/// </summary>
+/// <returns>false if the file cannot be read or the range starts past the end of the payload</returns>
+bool decrypt_range(const std::string& filename, const std::string& key, unsigned long long offset, size_t length, std::string& output)
+{
+    RangeReader reader;
+    return reader.open(filename) && reader.read(offset, length, key, output);
+}
+
+/// <summary>
+/// re-key an encrypted file from old_key to new_key. a save_data_file layout file gets the new key on its key line
+/// and its payload re-keyed; a container encrypted with the xor cipher gets its payload re-keyed and the new key's
+/// fingerprint. the payload is streamed a chunk at a time through one fused pass and never decrypted.
+/// with no separate output, or an output that is the same file under another name, the re-keyed file is written to a
+/// temporary file next to it, synced, and renamed over it. a crash or failed write part way leaves the original
+/// whole under the old key, never a file that is half one key and half the other.
+/// a crc trailer is kept, with the crc of the new bytes taken as they are re-keyed.
+/// </summary>
+/// <param name="filename">encrypted file</param>
+/// <param name="output_filename">where to write the re-keyed file, empty or the same name to re-key in place</param>
+/// <param name="old_key">key the file is encrypted with now</param>
+/// <param name="new_key">key it is encrypted with afterwards</param>
+/// <param name="chunk_size">bytes re-keyed at a time</param>
+/// <returns>false if the file is not encrypted with old_key or cannot be read or written</returns>
+bool rekey_data_file(const std::string& filename, std::string output_filename, const std::string& old_key, const std::string& new_key, size_t chunk_size = default_chunk_size)
+{
+    // a link or another name for the input counts as in place too, writing it directly would cut off the input while
+    // it is being read. the temporary goes next to the real file, so the rename replaces the file and not a link to it
+    std::error_code error;
+    const bool in_place = output_filename.empty() || std::filesystem::equivalent(output_filename, filename, error);
+    if (in_place)
+    {
+        const std::filesystem::path target = std::filesystem::canonical(filename, error);
+        output_filename = error ? filename : target.string();
+    }
+
+    try
+    {
+        std::ifstream readFile(filename, std::ios::in | std::ios::binary);
+        if (!readFile)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << filename << std::endl;
+            return false;
+        }
+        readFile.seekg(0, std::ios::end);
+        const unsigned long long file_size = static_cast<unsigned long long>(readFile.tellg());
+        readFile.seekg(0, std::ios::beg);
+
+        char prefix[4096];
+        readFile.read(prefix, sizeof(prefix));
+        const size_t prefix_length = static_cast<size_t>(readFile.gcount());
+        readFile.close();
+
+        const Rekey rekey(old_key, new_key);
+        std::vector<char> buffer(chunk_size);
+        unsigned long long payload_offset = 0;
+        unsigned long long payload_length = 0;
+        std::string new_header;
+        // a text layout file marked as ending in a crc trailer, the trailer is taken again over the new bytes
+        bool text_crc = false;
+
+        container_header header;
+        const bool container = decode_container_header(prefix, prefix_length, header);
+        if (container)
+        {
+            if (header.payload_offset > file_size || header.payload_length > file_size - header.payload_offset)
+            {
+                std::cout << "Container payload is truncated: " << filename << std::endl;
+                return false;
+            }
+            if (header.cipher != cipher_id::xor_key || header.key_id != key_fingerprint(old_key, header.key_salt))
+            {
+                std::cout << "Only containers encrypted with the xor cipher and the old key can be re-keyed: " << filename << std::endl;
+                return false;
+            }
+            payload_offset = header.payload_offset;
+            payload_length = header.payload_length;
+            make_key_id_salt(header.key_salt);
+            header.key_id = key_fingerprint(new_key, header.key_salt);
+            new_header.resize(container_header_size);
+            encode_container_header(header, &new_header[0]);
+        }
+        else
+        {
+            // text layout: name, date and key lines, then the payload and a final newline
+            size_t line_starts[4] = { 0 };
+            for (int line = 0; line < 3; ++line)
+            {
+                const char* newline = static_cast<const char*>(std::memchr(prefix + line_starts[line], '\n', prefix_length - line_starts[line]));
+                if (newline == nullptr)
+                {
+                    std::cout << "Could not find the payload in: " << filename << std::endl;
+                    return false;
+                }
+                line_starts[line + 1] = static_cast<size_t>(newline - prefix) + 1;
+            }
+            if (std::string(prefix + line_starts[2], line_starts[3] - line_starts[2] - 1) != old_key)
+            {
+                std::cout << "File was not encrypted with the old key: " << filename << std::endl;
+                return false;
+            }
+            // the name and the date the content was first encrypted stay as they are
+            new_header.assign(prefix, line_starts[2]);
+            new_header += new_key + "\n";
+            payload_offset = line_starts[3];
+            payload_length = file_size > payload_offset ? file_size - payload_offset - 1 : 0;
+            if (crc32c_marked(prefix + line_starts[1], line_starts[2] - line_starts[1] - 1))
+            {
+                payload_length -= std::min<unsigned long long>(payload_length, crc32c_trailer_size);
+                text_crc = true;
+            }
+        }
+        unsigned int crc = crc32c(new_header.data(), new_header.length());
+
+        // streamed into a new file, a temporary one when it replaces the original
+        const std::string write_name = in_place ? output_filename + ".rekey" : output_filename;
+        std::ifstream input(filename, std::ios::in | std::ios::binary);
+        const native_file output = create_native_file(write_name);
+        if (output == invalid_native_file)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << write_name << std::endl;
+            return false;
+        }
+
+        write_piece piece(new_header.data(), new_header.length());
+        bool ok = write_gathered(output, &piece, 1);
+        if (container)
+        {
+            // the container's padding and metadata come across untouched, only the header changes
+            input.seekg(static_cast<std::streamoff>(container_header_size));
+            std::vector<char> between(static_cast<size_t>(payload_offset - container_header_size));
+            input.read(between.data(), static_cast<std::streamsize>(between.size()));
+            piece = write_piece(between.data(), between.size());
+            ok = ok && input && write_gathered(output, &piece, 1);
+        }
+        else
+        {
+            input.seekg(static_cast<std::streamoff>(payload_offset));
+        }
+        for (unsigned long long done = 0; ok && done < payload_length;)
+        {
+            const size_t length = static_cast<size_t>(std::min<unsigned long long>(chunk_size, payload_length - done));
+            input.read(buffer.data(), static_cast<std::streamsize>(length));
+            rekey.transform(buffer.data(), buffer.data(), length, done);
+            crc = text_crc ? crc32c(buffer.data(), length, crc) : crc;
+            piece = write_piece(buffer.data(), length);
+            ok = input && write_gathered(output, &piece, 1);
+            done += length;
+        }
+        if (!container)
+        {
+            // the payload's final newline, and the trailer after it
+            const std::string tail = text_crc ? "\n" + crc32c_trailer(crc32c("\n", 1, crc)) : std::string("\n");
+            piece = write_piece(tail.data(), tail.length());
+            ok = ok && write_gathered(output, &piece, 1);
+        }
+        // the new file has to be on the disk before it replaces the only copy of the data
+        ok = ok && (!in_place || sync_native_file(output));
+        close_native_file(output);
+        if (!ok)
+        {
+            std::cout << "Failed to re-key file: " << filename << std::endl;
+            std::remove(write_name.c_str());
+            return false;
+        }
+        if (in_place)
+        {
+            std::filesystem::permissions(write_name, std::filesystem::status(output_filename).permissions(), error);
+            std::filesystem::rename(write_name, output_filename);
+        }
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Failed to re-key file: " << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// open a file for writing at chosen offsets, creating it if needed but keeping what is already there
+/// </summary>
+native_file open_native_file_for_update(const std::string& filename)
+{
+#if defined(_WIN32)
+    return CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+    return open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+#endif
+}
+
+/// <summary>
+/// write a whole buffer at offset without moving through the file in between, pwrite on posix
+/// </summary>
+/// <returns>false if any byte could not be written</returns>
+bool write_native_file_at(native_file file, const char* data, size_t length, unsigned long long offset)
+{
+    while (length > 0)
+    {
+#if defined(_WIN32)
+        OVERLAPPED position = {};
+        position.Offset = static_cast<DWORD>(offset);
+        position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(file, data, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)), &written, &position))
+        {
+            return false;
+        }
+#else
+        const ssize_t written = pwrite(file, data, length, static_cast<off_t>(offset));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+#endif
+        data += written;
+        length -= static_cast<size_t>(written);
+        offset += static_cast<unsigned long long>(written);
+    }
+    return true;
+}
+
+// block size update_data_file hashes and rewrites in when none is given
+const size_t default_update_block_size = 64 * 1024;
+const char block_manifest_magic[4] = { 'X', 'B', 'L', 'K' };
+const unsigned short block_manifest_version = 2;
+// magic, version, block size, header length, key fingerprint, input length and the fingerprint's salt, then one hash per block
+const size_t block_manifest_header_size = 48;
+
+/// <summary>
+/// the sidecar update_data_file keeps next to an encrypted file: what the input looked like, block by block,
+/// when the encrypted file was last brought up to date
+/// </summary>
+struct block_manifest
+{
+    unsigned int block_size = 0;
+    // bytes ahead of the payload in the encrypted file, i.e. the name, date and key lines
+    unsigned int header_length = 0;
+    unsigned long long key_id = 0;
+    char key_salt[key_id_salt_size] = {};
+    unsigned long long input_length = 0;
+    // xxhash64 of every block of the input
+    std::vector<unsigned long long> hashes;
+};
+
+std::string block_manifest_filename(const std::string& output_filename)
+{
+    return output_filename + ".blocks";
+}
+
+/// <summary>
+/// read a block manifest
+/// </summary>
+/// <returns>false if there is none or it is not one this version understands</returns>
+bool read_block_manifest(const std::string& filename, block_manifest& manifest)
+{
+    std::ifstream readFile(filename, std::ios::in | std::ios::binary);
+    char header[block_manifest_header_size];
+    if (!readFile.read(header, sizeof(header)) || std::memcmp(header, block_manifest_magic, sizeof(block_manifest_magic)) != 0
+        || get_le(header + 4, 2) != block_manifest_version)
+    {
+        return false;
+    }
+    manifest.block_size = static_cast<unsigned int>(get_le(header + 8, 4));
+    manifest.header_length = static_cast<unsigned int>(get_le(header + 12, 4));
+    manifest.key_id = get_le(header + 16, 8);
+    manifest.input_length = get_le(header + 24, 8);
+    std::memcpy(manifest.key_salt, header + 32, key_id_salt_size);
+    if (manifest.block_size == 0)
+    {
+        return false;
+    }
+
+    const unsigned long long block_count = (manifest.input_length + manifest.block_size - 1) / manifest.block_size;
+    std::vector<char> hashes(static_cast<size_t>(block_count) * 8);
+    if (!readFile.read(hashes.data(), static_cast<std::streamsize>(hashes.size())))
+    {
+        return false;
+    }
+    manifest.hashes.resize(static_cast<size_t>(block_count));
+    for (size_t i = 0; i < manifest.hashes.size(); ++i)
+    {
+        manifest.hashes[i] = get_le(hashes.data() + i * 8, 8);
+    }
+    return true;
+}
+
+bool write_block_manifest(const std::string& filename, const block_manifest& manifest)
+{
+    std::string bytes(block_manifest_header_size + manifest.hashes.size() * 8, '\0');
+    std::memcpy(&bytes[0], block_manifest_magic, sizeof(block_manifest_magic));
+    put_le(&bytes[4], block_manifest_version, 2);
+    put_le(&bytes[8], manifest.block_size, 4);
+    put_le(&bytes[12], manifest.header_length, 4);
+    put_le(&bytes[16], manifest.key_id, 8);
+    put_le(&bytes[24], manifest.input_length, 8);
+    std::memcpy(&bytes[32], manifest.key_salt, key_id_salt_size);
+    for (size_t i = 0; i < manifest.hashes.size(); ++i)
+    {
+        put_le(&bytes[block_manifest_header_size + i * 8], manifest.hashes[i], 8);
+    }
+
+    std::ofstream writeFile(filename, std::ios::out | std::ios::binary);
+    writeFile.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(writeFile);
+}
+
+/// <summary>
+/// what update_data_file had to do
+/// </summary>
+struct update_stats
+{
+    size_t blocks = 0;
+    size_t blocks_written = 0;
+    unsigned long long bytes_written = 0;
+    // true if there was no usable manifest, or the header changed length, so every block was written
+    bool full = false;
+    double seconds = 0;
+};
+
+/// <summary>
+/// bring an encrypted file in the stream_data_file layout up to date with its input, rewriting only what changed.
+/// a sidecar manifest (output_filename + ".blocks") holds a hash of every block of the input as it was last
+/// encrypted. each block of the input is hashed again, and only blocks whose hash differs are encrypted at their own
+/// key phase and written in place at their offset in the payload, so a file with a few changed bytes costs a read
+/// and hash of the input plus one block write per change, not a rewrite of the whole file.
+/// the date line is refreshed each time. with no usable manifest, a different key or block size, a payload that
+/// does not match the manifest's length, or a first line that changes length, every block is written.
+/// the manifest is replaced only after every block has been written, so an update that is cut short is finished by
+/// the next one: the blocks it did write still differ from the old manifest and are simply written again.
+/// </summary>
+/// <param name="input_filename">file to encrypt</param>
+/// <param name="output_filename">encrypted file to create or bring up to date</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="block_size">bytes per hashed block</param>
+/// <param name="stats">optional, receives how much had to be written</param>
+/// <returns>true if the output matches the input</returns>
+bool update_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key,
+    size_t block_size = default_update_block_size, update_stats* stats = nullptr)
+{
+    assert(block_size > 0 && !key.empty());
+    const auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        std::ifstream readFile(input_filename, std::ios::in | std::ios::binary);
+        if (!readFile)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << input_filename << std::endl;
+            return false;
+        }
+        readFile.seekg(0, std::ios::end);
+        const unsigned long long input_length = static_cast<unsigned long long>(readFile.tellg());
+        readFile.seekg(0, std::ios::beg);
+
+        // the header is built exactly as stream_data_file builds it, so the output stays byte for byte the same
+        std::vector<char> buffer(std::max(block_size, default_chunk_size));
+        readFile.read(buffer.data(), static_cast<std::streamsize>(default_chunk_size));
+        const size_t first_length = static_cast<size_t>(readFile.gcount());
+        const char* first_newline = static_cast<const char*>(std::memchr(buffer.data(), '\n', first_length));
+        const std::string student_name = first_newline ? std::string(buffer.data(), static_cast<size_t>(first_newline - buffer.data())) : std::string();
+        std::ostringstream header_stream;
+        write_data_header(header_stream, student_name, key);
+        const std::string header = header_stream.str();
+        readFile.clear();
+        readFile.seekg(0, std::ios::beg);
+
+        block_manifest old_manifest;
+        std::error_code error;
+        const unsigned long long output_length = std::filesystem::file_size(output_filename, error);
+        const bool incremental = !error && read_block_manifest(block_manifest_filename(output_filename), old_manifest)
+            && old_manifest.block_size == block_size
+            && old_manifest.key_id == key_fingerprint(key, old_manifest.key_salt)
+            && old_manifest.header_length == header.length()
+            && output_length == old_manifest.header_length + old_manifest.input_length + 1;
+
+        block_manifest manifest;
+        manifest.block_size = static_cast<unsigned int>(block_size);
+        manifest.header_length = static_cast<unsigned int>(header.length());
+        make_key_id_salt(manifest.key_salt);
+        manifest.key_id = key_fingerprint(key, manifest.key_salt);
+        manifest.input_length = input_length;
+        manifest.hashes.reserve(static_cast<size_t>((input_length + block_size - 1) / block_size));
+
+        const native_file file = open_native_file_for_update(output_filename);
+        if (file == invalid_native_file)
+        {
+            // Failed to open the file
+            std::cout << "Failed to open file: " << output_filename << std::endl;
+            return false;
+        }
+
+        update_stats result;
+        result.full = !incremental;
+        bool ok = write_native_file_at(file, header.data(), header.length(), 0);
+        unsigned long long offset = 0;
+        while (ok && offset < input_length)
+        {
+            readFile.read(buffer.data(), static_cast<std::streamsize>(block_size));
+            const size_t length = static_cast<size_t>(readFile.gcount());
+            if (length == 0)
+            {
+                ok = false;
+                break;
+            }
+            const size_t block = manifest.hashes.size();
+            manifest.hashes.push_back(xxhash64(buffer.data(), length));
+            ++result.blocks;
+
+            if (!incremental || block >= old_manifest.hashes.size() || old_manifest.hashes[block] != manifest.hashes.back())
+            {
+                // the payload starts right after the header, and key phase offset lines up with this block
+                encrypt_decrypt(buffer.data(), buffer.data(), length, key, offset);
+                ok = write_native_file_at(file, buffer.data(), length, header.length() + offset);
+                ++result.blocks_written;
+                result.bytes_written += length;
+            }
+            offset += length;
+        }
+
+        // the final newline goes after the payload, and anything past it from a longer old input is cut off
+        const char newline = '\n';
+        ok = ok && offset == input_length
+            && write_native_file_at(file, &newline, 1, header.length() + input_length)
+            && truncate_native_file(file, header.length() + input_length + 1);
+        close_native_file(file);
+        ok = ok && write_block_manifest(block_manifest_filename(output_filename), manifest);
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (stats != nullptr)
+        {
+            *stats = result;
+        }
+        if (!ok)
+        {
+            std::cout << "Failed to update file: " << output_filename << std::endl;
+        }
+        return ok;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Failed to update file: " << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// thread pool for many small independent jobs. every worker has its own queue and takes its newest task first,
+/// when its queue runs dry it steals the oldest task from another worker instead of waiting.
+/// </summary>
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(size_t thread_count)
+    {
+        assert(thread_count > 0);
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            queues_.emplace_back(new WorkQueue());
+        }
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            workers_.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    size_t thread_count() const { return workers_.size(); }
+
+    /// <summary>
+    /// queue a task. tasks are dealt round robin, stealing evens out whatever imbalance that leaves.
+    /// a task that throws is abandoned without affecting any other task.
+    /// </summary>
+    void submit(std::function<void()> task)
+    {
+        ++pending_;
+        WorkQueue& queue = *queues_[next_queue_++ % queues_.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++queued_;
+        }
+        work_ready_.notify_one();
+    }
+
+    /// <summary>
+    /// block until every submitted task has finished
+    /// </summary>
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        all_done_.wait(lock, [this]() { return pending_ == 0; });
+    }
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool try_pop(size_t self, std::function<void()>& task)
+    {
+        // own queue first, newest task, its data is the most likely to still be in cache
+        {
+            WorkQueue& own = *queues_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --queued_;
+                return true;
+            }
+        }
+
+        // then steal the oldest task from the other workers in turn
+        for (size_t i = 1; i < queues_.size(); ++i)
+        {
+            WorkQueue& victim = *queues_[(self + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --queued_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(size_t self)
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            if (try_pop(self, task))
+            {
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    // tasks report their own failures, one bad task must not take the worker down
+                }
+
+                if (--pending_ == 0)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    all_done_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_ready_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+            if (stopping_ && queued_ == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable all_done_;
+    std::atomic<size_t> queued_{ 0 };
+    std::atomic<size_t> pending_{ 0 };
+    std::atomic<size_t> next_queue_{ 0 };
+    bool stopping_ = false;
+};
+
+/// <summary>
+/// name a file listed in a manifest gets under the output directory: its whole absolute path with the root taken
+/// off, so /a/x.txt and /b/x.txt stay apart as a/x.txt and b/x.txt. a windows drive or server becomes the first
+/// directory, so c:\x.txt and d:\x.txt stay apart too
+/// </summary>
+std::filesystem::path batch_output_name(const std::filesystem::path& full_path)
+{
+    std::string root = full_path.root_name().string();
+    root.erase(std::remove_if(root.begin(), root.end(), [](char c) { return c == ':' || c == '\\' || c == '/'; }), root.end());
+    return root.empty() ? full_path.relative_path() : std::filesystem::path(root) / full_path.relative_path();
+}
+
+/// <summary>
+/// files named by a batch job, either every regular file under a directory or the lines of a manifest file.
+/// a manifest that names the same file more than once gets it once, so no two tasks ever work on one file
+/// or write one output
+/// </summary>
+/// <param name="source">directory to walk, or a text file listing one path per line</param>
+/// <param name="relative_names">filled with the name each file gets under the output directory, distinct for
+/// distinct files</param>
+/// <returns>full paths of the files to process</returns>
+std::vector<std::filesystem::path> list_batch_files(const std::filesystem::path& source, std::vector<std::filesystem::path>& relative_names)
+{
+    std::vector<std::filesystem::path> files;
+    relative_names.clear();
+
+    std::error_code error;
+    if (std::filesystem::is_directory(source, error))
+    {
+        for (std::filesystem::recursive_directory_iterator it(source, error), end; !error && it != end; it.increment(error))
+        {
+            if (it->is_regular_file(error))
+            {
+                files.push_back(it->path());
+                relative_names.push_back(it->path().lexically_relative(source));
+            }
+        }
+        if (error)
+        {
+            std::cout << "Failed to list directory: " << source.string() << " " << error.message() << std::endl;
+        }
+        return files;
+    }
+
+    std::ifstream manifest(source);
+    if (!manifest)
+    {
+        std::cout << "Failed to open file: " << source.string() << std::endl;
+        return files;
+    }
+    std::string line;
+    std::map<std::filesystem::path, std::string> listed;
+    while (std::getline(manifest, line))
+    {
+        // tolerate manifests written with windows line endings
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+        // relative lines are taken from the working directory, and .. is resolved so it cannot climb out of the output
+        const std::filesystem::path full_path = std::filesystem::absolute(line, error).lexically_normal();
+        // symbolic links are followed so two names for one file are caught as well
+        std::filesystem::path identity = std::filesystem::weakly_canonical(full_path, error);
+        if (error)
+        {
+            identity = full_path;
+        }
+        const auto found = listed.emplace(identity, line);
+        if (!found.second)
+        {
+            std::cout << "Listed more than once, processed once: " << line << " (" << found.first->second << ")" << std::endl;
+            continue;
+        }
+        files.emplace_back(line);
+        relative_names.push_back(batch_output_name(full_path));
+    }
+    return files;
+}
+
+/// <summary>
+/// student name of one file from read_student_names
+/// </summary>
+struct student_name_result
+{
+    std::string student_name;
+    bool ok = false;
+};
+
+/// <summary>
+/// read_student_name for many files at once. the reads are small and independent, so they are spread over a
+/// work stealing pool a slice at a time and many opens are in flight at once.
+/// </summary>
+/// <param name="files">files to look in</param>
+/// <param name="thread_count">worker threads</param>
+/// <returns>one result per file, in the same order</returns>
+std::vector<student_name_result> read_student_names(const std::vector<std::filesystem::path>& files, size_t thread_count)
+{
+    std::vector<student_name_result> results(files.size());
+    // enough slices to keep every worker busy while keeping the per task cost well below one file open
+    const size_t slice = std::max<size_t>(1, files.size() / (thread_count * 16));
+
+    WorkStealingPool pool(thread_count);
+    for (size_t begin = 0; begin < files.size(); begin += slice)
+    {
+        const size_t end = std::min(files.size(), begin + slice);
+        pool.submit([&files, &results, begin, end]()
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                results[i].ok = read_student_name(files[i].string(), results[i].student_name);
+            }
+        });
+    }
+    pool.wait();
+    return results;
+}
+
+/// <summary>
+/// cpu time used by the whole process so far, user and kernel together
+/// </summary>
+double process_cpu_seconds()
+{
+#if defined(_WIN32)
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    {
+        return 0;
+    }
+    auto seconds = [](const FILETIME& time)
+    {
+        return ((static_cast<unsigned long long>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+/// <summary>
+/// counts from a finished batch job
+/// </summary>
+struct batch_result
+{
+    size_t files_ok = 0;
+    size_t files_failed = 0;
+    unsigned long long bytes = 0;
+    double seconds = 0;
+    double cpu_seconds = 0;
+};
+
+/// <summary>
+/// make destination a copy of source. on linux the copy first tries to share source's blocks (a reflink), which
+/// costs no data i/o at all on file systems that support it, then copy_file_range, which copies inside the kernel,
+/// and falls back to reading and writing the bytes otherwise.
+/// </summary>
+/// <param name="sync_batch">optional, the finished copy is synced with this batch instead of closed right away</param>
+/// <param name="reflinked">set to true if the blocks were shared rather than copied</param>
+/// <returns>false if the copy could not be made</returns>
+bool clone_file(const std::string& source, const std::string& destination, FileSyncBatch* sync_batch, bool& reflinked)
+{
+    reflinked = false;
+    const native_file input = open_native_file(source);
+    if (input == invalid_native_file)
+    {
+        std::cout << "Failed to open file: " << source << std::endl;
+        return false;
+    }
+    const native_file output = create_native_file(destination);
+    if (output == invalid_native_file)
+    {
+        close_native_file(input);
+        std::cout << "Failed to open file: " << destination << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    bool copied = false;
+#if defined(__linux__)
+    reflinked = ioctl(output, FICLONE, input) == 0;
+    if (!reflinked)
+    {
+        struct stat status;
+        unsigned long long remaining = fstat(input, &status) == 0 ? static_cast<unsigned long long>(status.st_size) : 0;
+        while (remaining > 0)
+        {
+            const ssize_t moved = copy_file_range(input, nullptr, output, nullptr, static_cast<size_t>(std::min<unsigned long long>(remaining, 1ull << 30)), 0);
+            if (moved <= 0)
+            {
+                break;
+            }
+            remaining -= static_cast<unsigned long long>(moved);
+        }
+        // whatever copy_file_range could not do is finished below, the file positions have moved past what it did
+        copied = remaining == 0;
+    }
+#endif
+    if (!reflinked && !copied)
+    {
+        std::vector<char> buffer(default_chunk_size);
+        for (;;)
+        {
+            const long long got = read_native_file(input, buffer.data(), buffer.size());
+            if (got <= 0)
+            {
+                ok = got == 0;
+                break;
+            }
+            write_piece piece(buffer.data(), static_cast<size_t>(got));
+            if (!write_gathered(output, &piece, 1))
+            {
+                ok = false;
+                break;
+            }
+        }
+    }
+    close_native_file(input);
+
+    if (ok && sync_batch != nullptr)
+    {
+        sync_batch->add(output);
+    }
+    else
+    {
+        close_native_file(output);
+    }
+    if (!ok)
+    {
+        std::remove(destination.c_str());
+    }
+    return ok;
+}
+
+/// <summary>
+/// what deduplication found and what it cost in an encrypt_batch
+/// </summary>
+struct dedup_stats
+{
+    size_t duplicate_files = 0;
+    size_t reflinked_files = 0;
+    unsigned long long input_bytes = 0;
+    unsigned long long duplicate_bytes = 0;
+    // finding the duplicates, encrypting the unique files, then copying their outputs for the duplicates
+    double hash_seconds = 0;
+    double encrypt_seconds = 0;
+    double copy_seconds = 0;
+
+    // total input over unique input, 1 with no duplicates
+    double ratio() const
+    {
+        const unsigned long long unique_bytes = input_bytes - duplicate_bytes;
+        return unique_bytes > 0 ? static_cast<double>(input_bytes) / unique_bytes : 1.0;
+    }
+
+    // estimate of the time saved: the duplicates encrypted at the rate the unique files were, less the extra hashing and copying
+    double seconds_saved() const
+    {
+        const unsigned long long unique_bytes = input_bytes - duplicate_bytes;
+        const double encrypt_all = unique_bytes > 0 ? encrypt_seconds * input_bytes / unique_bytes : encrypt_seconds;
+        return encrypt_all - encrypt_seconds - hash_seconds - copy_seconds;
+    }
+};
+
+/// <summary>
+/// find files with byte identical content. only files that share their size with another are read at all, those
+/// are hashed with xxhash64, and files whose fast hashes also match are confirmed with sha-256 so a collision of the
+/// non-cryptographic hash can never make two different files share an output.
+/// </summary>
+/// <param name="files">files to look through</param>
+/// <param name="pool">threads the files are read and hashed on</param>
+/// <param name="original">receives, for every file, the index of the first file with the same content, its own
+/// index if it is the first</param>
+/// <param name="stats">receives the input size and what was found</param>
+void find_duplicate_files(const std::vector<std::filesystem::path>& files, WorkStealingPool& pool, std::vector<size_t>& original, dedup_stats& stats)
+{
+    const auto start = std::chrono::steady_clock::now();
+    original.resize(files.size());
+    std::iota(original.begin(), original.end(), size_t(0));
+
+    std::vector<unsigned long long> sizes(files.size(), 0);
+    std::map<unsigned long long, std::vector<size_t>> by_size;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::error_code error;
+        const unsigned long long size = std::filesystem::file_size(files[i], error);
+        if (!error)
+        {
+            sizes[i] = size;
+            stats.input_bytes += size;
+            // empty files are refused by the batch anyway
+            if (size > 0)
+            {
+                by_size[size].push_back(i);
+            }
+        }
+    }
+
+    auto hash_files = [&](const std::vector<size_t>& which, std::vector<std::string>& hashes, bool strong)
+    {
+        for (const size_t i : which)
+        {
+            pool.submit([&, i, strong]()
+            {
+                // hashed straight from a mapping, nothing is copied. a file that cannot be mapped, or changed size since
+                // it was listed, is left without a hash and so stays unique
+                MappedFile mapping;
+                if (!mapping.map_input(files[i].string()) || mapping.size() != sizes[i])
+                {
+                    return;
+                }
+                if (strong)
+                {
+                    unsigned char digest[32];
+                    sha256(mapping.data(), mapping.size(), digest);
+                    hashes[i].assign(reinterpret_cast<const char*>(digest), sizeof(digest));
+                }
+                else
+                {
+                    hashes[i] = std::to_string(xxhash64(mapping.data(), mapping.size()));
+                }
+            });
+        }
+        pool.wait();
+    };
+
+    // fast hashes for every file that has a same sized partner, groups listed in index order
+    std::vector<size_t> candidates;
+    for (const auto& group : by_size)
+    {
+        if (group.second.size() > 1)
+        {
+            candidates.insert(candidates.end(), group.second.begin(), group.second.end());
+        }
+    }
+    std::vector<std::string> fast(files.size());
+    hash_files(candidates, fast, false);
+
+    std::map<std::pair<unsigned long long, std::string>, std::vector<size_t>> by_fast_hash;
+    for (const size_t i : candidates)
+    {
+        if (!fast[i].empty())
+        {
+            by_fast_hash[std::make_pair(sizes[i], fast[i])].push_back(i);
+        }
+    }
+
+    // the cryptographic hash is only paid for files the fast hash already says are the same
+    std::vector<size_t> confirm;
+    for (const auto& group : by_fast_hash)
+    {
+        if (group.second.size() > 1)
+        {
+            confirm.insert(confirm.end(), group.second.begin(), group.second.end());
+        }
+    }
+    std::sort(confirm.begin(), confirm.end());
+    std::vector<std::string> strong(files.size());
+    hash_files(confirm, strong, true);
+
+    std::map<std::string, size_t> first_with_digest;
+    for (const size_t i : confirm)
+    {
+        if (strong[i].empty())
+        {
+            continue;
+        }
+        const auto found = first_with_digest.emplace(strong[i], i);
+        if (!found.second)
+        {
+            original[i] = found.first->second;
+            ++stats.duplicate_files;
+            stats.duplicate_bytes += sizes[i];
+        }
+    }
+    stats.hash_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// <summary>
+/// encrypt every file of a directory or manifest with read_file -> encrypt_decrypt -> save_data_file,
+/// one file per task on a work stealing pool. a file that fails is reported and skipped, the rest carry on.
+/// any cipher other than xor needs a nonce per file, and compressed files need their block size recorded,
+/// those files are written as containers instead.
+/// with dedup, byte identical inputs are found first and each content is encrypted once, the other copies get a
+/// reflink or copy of that output. that also shows which outputs share content, and for the nonce based ciphers
+/// they share the nonce as well.
+/// </summary>
+/// <param name="source">directory to walk, or a text file listing one path per line</param>
+/// <param name="output_directory">where the encrypted files are written, keeping their relative names</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="thread_count">worker threads</param>
+/// <param name="sync_batch_size">if not zero, outputs are synced to disk this many files at a time</param>
+/// <param name="cipher">cipher to encrypt with</param>
+/// <param name="compression_block_size">if not zero, files are compressed in blocks of this size before they are encrypted</param>
+/// <param name="kdf">optional, key is then a password every file's key is derived from, through the job's cache,
+/// and the files record the derivation instead of the key</param>
+/// <param name="dedup">optional, encrypts identical inputs once and receives what that found and saved</param>
+/// <param name="crc_trailer">end text layout files with a crc-32c trailer, taken in the encryption pass. containers
+/// are left as they are</param>
+batch_result encrypt_batch(const std::filesystem::path& source, const std::filesystem::path& output_directory, const std::string& key, size_t thread_count, size_t sync_batch_size = 0,
+    cipher_id cipher = cipher_id::xor_key, size_t compression_block_size = 0, const key_derivation* kdf = nullptr, dedup_stats* dedup = nullptr, bool crc_trailer = false)
+{
+    std::vector<std::filesystem::path> relative_names;
+    const std::vector<std::filesystem::path> files = list_batch_files(source, relative_names);
+
+    std::atomic<size_t> files_ok{ 0 };
+    std::atomic<size_t> files_failed{ 0 };
+    std::atomic<unsigned long long> bytes{ 0 };
+    std::mutex report_mutex;
+
+    const double cpu_start = process_cpu_seconds();
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::unique_ptr<FileSyncBatch> sync_batch(sync_batch_size > 0 ? new FileSyncBatch(sync_batch_size) : nullptr);
+        WorkStealingPool pool(thread_count);
+        // payload bytes written for each file, 0 until it has been written
+        std::vector<unsigned long long> written(files.size(), 0);
+        auto encrypt_one = [&](size_t i)
+        {
+            const std::filesystem::path output_path = output_directory / relative_names[i];
+            bool ok = false;
+            try
+            {
+                std::string data = read_file(files[i].string());
+                if (!data.empty())
+                {
+                    const std::string student_name = get_student_name(data);
+                    const std::string file_key = kdf ? kdf->cache->get(kdf->password_id, key, kdf->salt, kdf->params) : key;
+                    const std::string descriptor = kdf ? kdf_descriptor(kdf->params, kdf->salt) : std::string();
+                    std::error_code error;
+                    std::filesystem::create_directories(output_path.parent_path(), error);
+
+                    if (cipher == cipher_id::xor_key && compression_block_size == 0)
+                    {
+                        // with a derived key the key line records the derivation, the key itself is never written
+                        unsigned int crc = 0;
+                        if (crc_trailer)
+                        {
+                            encrypt_decrypt_crc32c(data.data(), &data[0], data.length(), file_key, 0, crc);
+                        }
+                        else
+                        {
+                            encrypt_decrypt(&data[0], data.length(), file_key);
+                        }
+                        ok = save_data_file(output_path.string(), student_name, kdf ? descriptor : key, data, sync_batch.get(), crc_trailer ? &crc : nullptr);
+                    }
+                    else
+                    {
+                        const size_t plain_length = data.length();
+                        if (compression_block_size > 0)
+                        {
+                            data = compress_payload(data, compression_block_size);
+                        }
+                        const std::string nonce = make_nonce(cipher);
+                        encrypt_payload(data, file_key, cipher, nonce);
+                        ok = save_container_file(output_path.string(), student_name, file_key, data, cipher, nonce, sync_batch.get(), compression_block_size, plain_length, descriptor);
+                    }
+                    if (ok)
+                    {
+                        bytes += data.length();
+                        written[i] = data.length();
+                    }
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cout << "Failed to encrypt file: " << files[i].string() << " " << e.what() << std::endl;
+            }
+
+            if (ok)
+            {
+                ++files_ok;
+            }
+            else
+            {
+                ++files_failed;
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cout << "Skipped file: " << files[i].string() << std::endl;
+            }
+        };
+
+        // index of the file whose output each file can reuse, its own index when it has to be encrypted
+        std::vector<size_t> original(files.size());
+        std::iota(original.begin(), original.end(), size_t(0));
+        if (dedup != nullptr)
+        {
+            find_duplicate_files(files, pool, original, *dedup);
+        }
+
+        const auto encrypt_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (original[i] == i)
+            {
+                pool.submit([&, i]() { encrypt_one(i); });
+            }
+        }
+        pool.wait();
+
+        if (dedup != nullptr)
+        {
+            const auto copy_start = std::chrono::steady_clock::now();
+            dedup->encrypt_seconds = std::chrono::duration<double>(copy_start - encrypt_start).count();
+            std::atomic<size_t> reflinked_files{ 0 };
+            for (size_t i = 0; i < files.size(); ++i)
+            {
+                if (original[i] == i)
+                {
+                    continue;
+                }
+                pool.submit([&, i]()
+                {
+                    const size_t first = original[i];
+                    const std::filesystem::path output_path = output_directory / relative_names[i];
+                    std::error_code error;
+                    std::filesystem::create_directories(output_path.parent_path(), error);
+                    bool reflinked = false;
+                    // if the first copy failed this one is encrypted on its own and reports its own failure
+                    if (written[first] == 0 || !clone_file((output_directory / relative_names[first]).string(), output_path.string(), sync_batch.get(), reflinked))
+                    {
+                        encrypt_one(i);
+                        return;
+                    }
+                    ++files_ok;
+                    bytes += written[first];
+                    reflinked_files += reflinked ? 1 : 0;
+                });
+            }
+            pool.wait();
+            dedup->reflinked_files = reflinked_files;
+            dedup->copy_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - copy_start).count();
+        }
+
+        // the timing includes getting the last partial batch onto the disk
+        if (sync_batch && !sync_batch->flush())
+        {
+            std::cout << "Failed to sync some output files to disk" << std::endl;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    batch_result result;
+    result.files_ok = files_ok;
+    result.files_failed = files_failed;
+    result.bytes = bytes;
+    result.seconds = elapsed.count();
+    result.cpu_seconds = process_cpu_seconds() - cpu_start;
+    return result;
+}
+
+/// <summary>
+/// outcome of checking one file against its crc trailer
+/// </summary>
+enum class crc_check
+{
+    ok,
+    mismatch,
+    no_trailer,
+    unreadable,
+};
+
+/// <summary>
+/// check an encrypted file against its crc trailer without decrypting it, the crc covers the ciphertext as stored
+/// </summary>
+crc_check verify_data_file(const std::string& filename)
+{
+    MappedFile mapping;
+    if (!mapping.map_input(filename))
+    {
+        return crc_check::unreadable;
+    }
+    const char* data = mapping.data();
+    const size_t size = mapping.size();
+    container_header header;
+    if (size == 0 || decode_container_header(data, size, header))
+    {
+        return crc_check::no_trailer;
+    }
+
+    // only a file whose date line says so has a trailer, the end of the payload is never taken for one
+    const char* date_line = static_cast<const char*>(std::memchr(data, '\n', size));
+    const char* date_end = date_line ? static_cast<const char*>(std::memchr(date_line + 1, '\n', size - static_cast<size_t>(date_line + 1 - data))) : nullptr;
+    if (date_end == nullptr || !crc32c_marked(date_line + 1, static_cast<size_t>(date_end - date_line - 1)))
+    {
+        return crc_check::no_trailer;
+    }
+    // a marked file that does not end in a whole trailer was cut short or damaged
+    unsigned int recorded = 0;
+    if (!parse_crc32c_trailer(data, size, recorded))
+    {
+        return crc_check::mismatch;
+    }
+    return crc32c(data, size - crc32c_trailer_size) == recorded ? crc_check::ok : crc_check::mismatch;
+}
+
+/// <summary>
+/// check every file of a directory or manifest against its crc trailer, one file per task on a work stealing pool.
+/// files that fail the check are listed, files without a trailer are counted but not failed
+/// </summary>
+/// <param name="source">directory to walk, or a text file listing one path per line</param>
+/// <param name="thread_count">worker threads</param>
+/// <param name="unchecked">receives the number of files that have no trailer</param>
+batch_result verify_batch(const std::filesystem::path& source, size_t thread_count, size_t& unchecked)
+{
+    std::vector<std::filesystem::path> relative_names;
+    const std::vector<std::filesystem::path> files = list_batch_files(source, relative_names);
+
+    std::atomic<size_t> files_ok{ 0 };
+    std::atomic<size_t> files_failed{ 0 };
+    std::atomic<size_t> files_unchecked{ 0 };
+    std::atomic<unsigned long long> bytes{ 0 };
+    std::mutex report_mutex;
+
+    const double cpu_start = process_cpu_seconds();
+    const auto start = std::chrono::steady_clock::now();
+    {
+        WorkStealingPool pool(thread_count);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            pool.submit([&, i]()
+            {
+                const crc_check result = verify_data_file(files[i].string());
+                if (result == crc_check::ok || result == crc_check::no_trailer)
+                {
+                    ++(result == crc_check::ok ? files_ok : files_unchecked);
+                    std::error_code error;
+                    const unsigned long long size = std::filesystem::file_size(files[i], error);
+                    bytes += error ? 0 : size;
+                    return;
+                }
+                ++files_failed;
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cout << (result == crc_check::mismatch ? "Checksum mismatch: " : "Failed to read file: ") << files[i].string() << std::endl;
+            });
+        }
+        pool.wait();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    unchecked = files_unchecked;
+    batch_result result;
+    result.files_ok = files_ok;
+    result.files_failed = files_failed;
+    result.bytes = bytes;
+    result.seconds = elapsed.count();
+    result.cpu_seconds = process_cpu_seconds() - cpu_start;
+    return result;
+}
+
+#if defined(__linux__)
+
+/// <summary>
+/// minimal io_uring through the raw system calls, so nothing beyond the kernel headers is needed.
+/// one submission and one completion ring shared with the kernel, and optionally a set of registered buffers
+/// the kernel keeps pinned so fixed reads and writes skip mapping the pages on every call.
+/// </summary>
+class IoUring
+{
+public:
+    IoUring() = default;
+    ~IoUring() { close_ring(); }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    /// <summary>
+    /// set the rings up, and check the kernel can run every operation the caller is going to submit. kernels that
+    /// set a ring up but lack an operation fail each submission of it with EINVAL, too late to fall back.
+    /// </summary>
+    /// <param name="operations">IORING_OP_ values the caller submits</param>
+    /// <returns>false if the kernel has no io_uring, it is not allowed here, or an operation is missing</returns>
+    bool open(unsigned entries, const std::vector<unsigned char>& operations)
+    {
+        io_uring_params params = {};
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd_ < 0)
+        {
+            return false;
+        }
+        if (!supports(operations))
+        {
+            close_ring();
+            return false;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        single_mmap_ = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap_)
+        {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap_ ? sq_ring_ : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+        {
+            close_ring();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ring_);
+        char* cq = static_cast<char*>(cq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        local_tail_ = *sq_tail_;
+        return true;
+    }
+
+    /// <summary>
+    /// pin buffers so they can be used by the fixed read and write operations through their index
+    /// </summary>
+    /// <returns>false if the kernel refused, plain reads and writes still work then</returns>
+    bool register_buffers(const iovec* buffers, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+    /// <summary>
+    /// next free submission entry, cleared. nothing reaches the kernel until submit
+    /// </summary>
+    /// <returns>nullptr if the submission ring is full</returns>
+    io_uring_sqe* get_sqe()
+    {
+        const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (local_tail_ - head >= sq_entries_)
+        {
+            return nullptr;
+        }
+        const unsigned index = local_tail_ & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        ++local_tail_;
+        return sqe;
+    }
+
+    /// <summary>
+    /// hand every queued entry to the kernel in one system call, optionally waiting for completions
+    /// </summary>
+    /// <returns>false if the kernel rejected the call</returns>
+    bool submit(unsigned wait_for)
+    {
+        const unsigned to_submit = local_tail_ - *sq_tail_;
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        for (;;)
+        {
+            const long result = syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result >= 0)
+            {
+                return true;
+            }
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+
+    /// <summary>
+    /// call handle(user data, result) for every completion waiting in the ring
+    /// </summary>
+    /// <returns>completions handled</returns>
+    template <typename Handler>
+    unsigned for_each_completion(Handler handle)
+    {
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned handled = 0;
+        for (; head != tail; ++head, ++handled)
+        {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            const unsigned long long user_data = cqe.user_data;
+            const int result = cqe.res;
+            // free the slot before handling, the handler may queue new work
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            handle(user_data, result);
+        }
+        return handled;
+    }
+
+private:
+    /// <summary>
+    /// ask the kernel which operations it has. the probe itself only exists from linux 5.6, so older kernels
+    /// answer for nothing, which is right for the open and close operations that arrived in the same release.
+    /// </summary>
+    bool supports(const std::vector<unsigned char>& operations) const
+    {
+        const unsigned probe_ops = 256;
+        std::vector<char> memory(sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(memory.data());
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe, probe_ops) != 0)
+        {
+            return false;
+        }
+        for (const unsigned char operation : operations)
+        {
+            if (operation > probe->last_op || (probe->ops[operation].flags & IO_URING_OP_SUPPORTED) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void close_ring()
+    {
+        if (sqes_ != nullptr && sqes_ != MAP_FAILED)
+        {
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ != nullptr && cq_ring_ != MAP_FAILED && !single_mmap_)
+        {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sq_ring_ != nullptr && sq_ring_ != MAP_FAILED)
+        {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        if (ring_fd_ >= 0)
+        {
+            close(ring_fd_);
+        }
+        sqes_ = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        ring_fd_ = -1;
+    }
+
+    int ring_fd_ = -1;
+    bool single_mmap_ = false;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned local_tail_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+#endif
+
+// files in flight at once on the io_uring path when no depth is given
+const size_t default_uring_queue_depth = 16;
+// largest file the io_uring path handles in one registered buffer, bigger ones go through the blocking path
+const size_t uring_file_buffer_size = 1024 * 1024;
+// room left in front of the data for the header lines, so header, data and final newline go out in one write
+const size_t uring_header_room = 4096;
+
+/// <summary>
+/// re-key every file of a directory or manifest in place, one file per task on a work stealing pool
+/// </summary>
+/// <param name="source">directory to walk, or a text file listing one path per line</param>
+/// <param name="old_key">key the files are encrypted with now</param>
+/// <param name="new_key">key they are encrypted with afterwards</param>
+/// <param name="thread_count">worker threads</param>
+batch_result rekey_batch(const std::filesystem::path& source, const std::string& old_key, const std::string& new_key, size_t thread_count)
+{
+    std::vector<std::filesystem::path> relative_names;
+    const std::vector<std::filesystem::path> files = list_batch_files(source, relative_names);
+
+    std::atomic<size_t> files_ok{ 0 };
+    std::atomic<size_t> files_failed{ 0 };
+    std::atomic<unsigned long long> bytes{ 0 };
+
+    const double cpu_start = process_cpu_seconds();
+    const auto start = std::chrono::steady_clock::now();
+    {
+        WorkStealingPool pool(thread_count);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            pool.submit([&, i]()
+            {
+                std::error_code error;
+                const unsigned long long size = std::filesystem::file_size(files[i], error);
+                if (rekey_data_file(files[i].string(), std::string(), old_key, new_key))
+                {
+                    ++files_ok;
+                    bytes += error ? 0 : size;
+                }
+                else
+                {
+                    ++files_failed;
+                }
+            });
+        }
+        pool.wait();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    batch_result result;
+    result.files_ok = files_ok;
+    result.files_failed = files_failed;
+    result.bytes = bytes;
+    result.seconds = elapsed.count();
+    result.cpu_seconds = process_cpu_seconds() - cpu_start;
+    return result;
+}
+
+/// <summary>
+/// encrypt_batch on a single thread driving io_uring: every file is opened, read, encrypted, created, written and
+/// closed through the ring, with queue_depth files in flight and each one moving on as soon as its last step completes,
+/// in whatever order the kernel finishes them. every read and write uses a registered buffer when the kernel allows it.
+/// the output is the same save_data_file layout. without io_uring, outside linux, or for a file too big for one buffer,
+/// the blocking path does the work instead.
+/// </summary>
+/// <param name="source">directory to walk, or a text file listing one path per line</param>
+/// <param name="output_directory">where the encrypted files are written, keeping their relative names</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="queue_depth">files in flight</param>
+batch_result encrypt_batch_uring(const std::filesystem::path& source, const std::filesystem::path& output_directory, const std::string& key, size_t queue_depth = default_uring_queue_depth)
+{
+#if defined(__linux__)
+    enum class step { open_input, read, open_output, write, idle };
+    struct slot
+    {
+        step current = step::idle;
+        size_t file = 0;
+        int input = -1;
+        int output = -1;
+        size_t length = 0;
+        size_t header_begin = 0;
+        size_t write_begin = 0;
+        size_t write_end = 0;
+        // the kernel reads the names after the submission call returns, so they live here until the open completes
+        std::string input_path;
+        std::string output_path;
+    };
+    std::vector<slot> slots;
+    std::vector<char> memory;
+    std::vector<iovec> buffers;
+    // declared after everything the kernel reads and writes through it, so on every way out the ring is closed
+    // before any of that is freed
+    IoUring ring;
+    // every operation submitted below, opening and closing through the ring needs linux 5.6
+    const std::vector<unsigned char> operations =
+    {
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    };
+    // a file has one operation in flight at a time, plus the closes of the one before it
+    if (queue_depth > 0 && ring.open(static_cast<unsigned>(2 * queue_depth), operations))
+    {
+        std::vector<std::filesystem::path> relative_names;
+        const std::vector<std::filesystem::path> files = list_batch_files(source, relative_names);
+        const double cpu_start = process_cpu_seconds();
+        const auto start = std::chrono::steady_clock::now();
+
+        char date_line[32];
+        std::snprintf(date_line, sizeof(date_line), "\n%s\n", current_date().c_str());
+        const size_t fixed_header_length = std::strlen(date_line) + key.length() + 1;
+
+        slots.resize(queue_depth);
+        memory.resize(queue_depth * (uring_header_room + uring_file_buffer_size + 1));
+        buffers.resize(queue_depth);
+        for (size_t i = 0; i < queue_depth; ++i)
+        {
+            buffers[i].iov_base = memory.data() + i * (uring_header_room + uring_file_buffer_size + 1);
+            buffers[i].iov_len = uring_header_room + uring_file_buffer_size + 1;
+        }
+        const bool registered = ring.register_buffers(buffers.data(), static_cast<unsigned>(queue_depth));
+
+        // closes are never waited on, their completions only have to be collected before the end
+        const unsigned long long close_tag = 1ull << 63;
+        // operations handed to the ring whose completions have not been collected yet
+        size_t in_flight = 0;
+        bool ring_ok = true;
+        // set once the ring has failed, completions are then only collected, nothing new is started
+        bool draining = false;
+        size_t next_file = 0;
+        size_t files_ok = 0;
+        size_t files_failed = 0;
+        unsigned long long bytes = 0;
+        std::vector<size_t> too_big;
+
+        auto buffer_of = [&](size_t index) { return static_cast<char*>(buffers[index].iov_base); };
+        // a full submission ring is handed to the kernel to make room. an entry only fails to come if that fails too,
+        // the ring is then given up on
+        auto take_sqe = [&]() -> io_uring_sqe*
+        {
+            io_uring_sqe* sqe = ring_ok ? ring.get_sqe() : nullptr;
+            if (sqe == nullptr && ring_ok && ring.submit(0))
+            {
+                sqe = ring.get_sqe();
+            }
+            if (sqe == nullptr)
+            {
+                ring_ok = false;
+                return nullptr;
+            }
+            ++in_flight;
+            return sqe;
+        };
+        auto queue_close = [&](int fd)
+        {
+            io_uring_sqe* sqe = take_sqe();
+            if (sqe == nullptr)
+            {
+                // nothing of the ring uses the descriptor any more, it can be closed right here
+                close(fd);
+                return;
+            }
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fd;
+            sqe->user_data = close_tag;
+        };
+        // an open or transfer that cannot be queued leaves its file with nothing in flight, the loop then stops and
+        // the file is counted as failed
+        auto queue_open = [&](size_t index, const std::string& path, int flags)
+        {
+            io_uring_sqe* sqe = take_sqe();
+            if (sqe == nullptr)
+            {
+                return;
+            }
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<unsigned long long>(path.c_str());
+            sqe->open_flags = static_cast<unsigned>(flags);
+            sqe->len = 0644;
+            sqe->user_data = index;
+        };
+        auto queue_transfer = [&](size_t index, bool write, int fd, char* at, size_t length, unsigned long long offset)
+        {
+            io_uring_sqe* sqe = take_sqe();
+            if (sqe == nullptr)
+            {
+                return;
+            }
+            sqe->opcode = write ? (registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) : (registered ? IORING_OP_READ_FIXED : IORING_OP_READ);
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<unsigned long long>(at);
+            sqe->len = static_cast<unsigned>(length);
+            sqe->off = offset;
+            sqe->buf_index = static_cast<unsigned short>(index);
+            sqe->user_data = index;
+        };
+        auto start_next_file = [&](size_t index)
+        {
+            slot& s = slots[index];
+            if (next_file == files.size())
+            {
+                s.current = step::idle;
+                return;
+            }
+            s = slot();
+            s.file = next_file++;
+            s.current = step::open_input;
+            s.input_path = files[s.file].string();
+            queue_open(index, s.input_path, O_RDONLY | O_CLOEXEC);
+        };
+        auto finish_file = [&](size_t index, bool ok)
+        {
+            slot& s = slots[index];
+            for (int* fd : { &s.input, &s.output })
+            {
+                if (*fd >= 0)
+                {
+                    queue_close(*fd);
+                    *fd = -1;
+                }
+            }
+            if (ok)
+            {
+                ++files_ok;
+                bytes += s.length;
+            }
+            else
+            {
+                ++files_failed;
+                std::cout << "Skipped file: " << files[s.file].string() << std::endl;
+            }
+            start_next_file(index);
+        };
+
+        // output directories are made up front, the ring has no mkdir worth using for a handful of them
+        for (const std::filesystem::path& name : relative_names)
+        {
+            std::error_code error;
+            std::filesystem::create_directories((output_directory / name).parent_path(), error);
+        }
+
+        for (size_t i = 0; i < queue_depth; ++i)
+        {
+            start_next_file(i);
+        }
+
+        auto handle = [&](unsigned long long user_data, int result)
+        {
+            --in_flight;
+            if (user_data == close_tag)
+            {
+                return;
+            }
+            const size_t index = static_cast<size_t>(user_data);
+            slot& s = slots[index];
+            if (draining)
+            {
+                // an open that completes after the ring failed has still made a descriptor
+                if (result >= 0 && (s.current == step::open_input || s.current == step::open_output))
+                {
+                    close(result);
+                }
+                return;
+            }
+            char* buffer = buffer_of(index);
+            char* data = buffer + uring_header_room;
+            if (result < 0)
+            {
+                finish_file(index, false);
+                return;
+            }
+
+            switch (s.current)
+            {
+            case step::open_input:
+                s.input = result;
+                s.current = step::read;
+                queue_transfer(index, false, s.input, data, uring_file_buffer_size, 0);
+                break;
+
+            case step::read:
+                if (result > 0)
+                {
+                    s.length += static_cast<size_t>(result);
+                    if (s.length == uring_file_buffer_size)
+                    {
+                        // does not fit, left for the blocking path
+                        too_big.push_back(s.file);
+                        queue_close(s.input);
+                        s.input = -1;
+                        start_next_file(index);
+                        break;
+                    }
+                    // keep reading until the end of the file, short reads are allowed
+                    queue_transfer(index, false, s.input, data + s.length, uring_file_buffer_size - s.length, s.length);
+                    break;
+                }
+                {
+                    queue_close(s.input);
+                    s.input = -1;
+
+                    const char* newline = static_cast<const char*>(std::memchr(data, '\n', s.length));
+                    const size_t name_length = newline ? static_cast<size_t>(newline - data) : 0;
+                    if (s.length == 0 || name_length + fixed_header_length > uring_header_room)
+                    {
+                        // empty files fail as read_file does, and an oversized name line goes the blocking way
+                        if (s.length != 0)
+                        {
+                            too_big.push_back(s.file);
+                            start_next_file(index);
+                        }
+                        else
+                        {
+                            finish_file(index, false);
+                        }
+                        break;
+                    }
+
+                    // name, date line, key and newline go right in front of the encrypted data, the final newline after it
+                    const size_t header_length = name_length + fixed_header_length;
+                    char* header = data - header_length;
+                    std::memcpy(header, data, name_length);
+                    std::memcpy(header + name_length, date_line, std::strlen(date_line));
+                    std::memcpy(header + name_length + std::strlen(date_line), key.data(), key.length());
+                    data[-1] = '\n';
+                    encrypt_decrypt(data, s.length, key);
+                    data[s.length] = '\n';
+                    s.header_begin = static_cast<size_t>(header - buffer);
+                    s.write_begin = s.header_begin;
+                    s.write_end = uring_header_room + s.length + 1;
+
+                    s.output_path = (output_directory / relative_names[s.file]).string();
+                    s.current = step::open_output;
+                    queue_open(index, s.output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+                }
+                break;
+
+            case step::open_output:
+                s.output = result;
+                s.current = step::write;
+                queue_transfer(index, true, s.output, buffer + s.write_begin, s.write_end - s.write_begin, 0);
+                break;
+
+            case step::write:
+                s.write_begin += static_cast<size_t>(result);
+                if (result == 0)
+                {
+                    finish_file(index, false);
+                }
+                else if (s.write_begin < s.write_end)
+                {
+                    queue_transfer(index, true, s.output, buffer + s.write_begin, s.write_end - s.write_begin, s.write_begin - s.header_begin);
+                }
+                else
+                {
+                    finish_file(index, true);
+                }
+                break;
+
+            case step::idle:
+                break;
+            }
+        };
+
+        // every busy file has an operation in flight, so the batch is done when nothing is
+        while (ring_ok && in_flight > 0)
+        {
+            if (!ring.submit(1))
+            {
+                ring_ok = false;
+                break;
+            }
+            ring.for_each_completion(handle);
+        }
+
+        if (!ring_ok)
+        {
+            // what the kernel already has still reads and writes the buffers and names, it is collected before
+            // anything moves on. if even waiting fails, the ring is closed before the buffers on the way out
+            draining = true;
+            for (int attempt = 0; in_flight > 0 && attempt < 1000; ++attempt)
+            {
+                ring.for_each_completion(handle);
+                if (in_flight > 0 && !ring.submit(1) && errno != EBUSY)
+                {
+                    break;
+                }
+            }
+            ring.for_each_completion(handle);
+            for (slot& s : slots)
+            {
+                for (int* fd : { &s.input, &s.output })
+                {
+                    if (*fd >= 0)
+                    {
+                        close(*fd);
+                        *fd = -1;
+                    }
+                }
+            }
+            std::cout << "io_uring failed part way, the files not finished are counted as failed" << std::endl;
+        }
+
+        // whatever could not go through the ring is done the ordinary way
+        for (const size_t file : too_big)
+        {
+            const std::string data = read_file(files[file].string());
+            if (!data.empty() && save_data_file((output_directory / relative_names[file]).string(), get_student_name(data), key, encrypt_decrypt(data, key)))
+            {
+                ++files_ok;
+                bytes += data.length();
+            }
+            else
+            {
+                ++files_failed;
+                std::cout << "Skipped file: " << files[file].string() << std::endl;
+            }
+        }
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        batch_result result;
+        result.files_ok = files_ok;
+        result.files_failed = ring_ok ? files_failed : files.size() - files_ok;
+        result.bytes = bytes;
+        result.seconds = elapsed.count();
+        result.cpu_seconds = process_cpu_seconds() - cpu_start;
+        return result;
+    }
+    std::cout << "io_uring is not available, using the blocking path" << std::endl;
+#else
+    (void)queue_depth;
+#endif
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    return encrypt_batch(source, output_directory, key, hardware_threads);
+}
+
+/// <summary>
+/// time the original byte-at-a-time loop against every xor kernel this machine supports
+/// </summary>
+/// <param name="payload_size">number of bytes to transform per run</param>
+void run_kernel_benchmark(size_t payload_size)
+{
+    // awkward lengths on purpose: primes, "password", and lengths either side of the vector widths
+    const size_t key_lengths[] = { 1, 3, 7, 8, 13, 16, 31, 32, 61, 64, 97, 127, 251, 1021 };
+    const int runs = 5;
+
+    std::string source(payload_size, '\0');
+    for (size_t i = 0; i < payload_size; ++i)
+    {
+        source[i] = static_cast<char>((i * 131) ^ (i >> 7));
+    }
+    std::string output(payload_size, '\0');
+    std::string expected(payload_size, '\0');
+
+    // best of several runs in MB/s
+    auto time_runs = [&](const std::function<void()>& transform)
+    {
+        double best_seconds = 0;
+        for (int run = 0; run < runs; ++run)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            transform();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (run == 0 || elapsed.count() < best_seconds)
+            {
+                best_seconds = elapsed.count();
+            }
+        }
+        return payload_size / best_seconds / (1024.0 * 1024.0);
+    };
+
+    const std::vector<named_xor_kernel> kernels = supported_xor_kernels();
+
+    std::cout << "xor throughput in MB/s over " << payload_size / (1024 * 1024) << " MB, best of " << runs << " runs" << std::endl;
+    std::cout << std::setw(8) << "key len" << std::setw(12) << "original";
+    for (const auto& kernel : kernels)
+    {
+        std::cout << std::setw(12) << kernel.first;
+    }
+    std::cout << std::endl;
+
+    for (const size_t key_length : key_lengths)
+    {
+        std::string key = key_length == 8 ? std::string("password") : std::string(key_length, '\0');
+        for (size_t i = 0; key_length != 8 && i < key_length; ++i)
+        {
+            key[i] = static_cast<char>('a' + (i * 7) % 26);
+        }
+
+        // the loop encrypt_decrypt used before the kernels, kept here as the reference output
+        const double original = time_runs([&]()
+        {
+            for (size_t i = 0; i < payload_size; ++i)
+            {
+                expected[i] = source[i] ^ key[i % key_length];
+            }
+        });
+        std::cout << std::setw(8) << key_length << std::setw(12) << std::fixed << std::setprecision(0) << original;
+
+        const TiledKey tiled_key(key);
+        for (const auto& kernel : kernels)
+        {
+            const double throughput = time_runs([&]()
+            {
+                kernel.second(source.data(), &output[0], payload_size, tiled_key.data(), key_length, 0);
+            });
+            std::cout << std::setw(12) << throughput;
+
+            // every kernel has to produce exactly what the original loop did
+            if (output != expected)
+            {
+                std::cout << " <- MISMATCH";
+            }
+        }
+        std::cout << std::endl;
+    }
+    std::cout << "encrypt_decrypt uses: " << active_xor_kernel().first << std::endl;
+}
+
+/// <summary>
+/// throughput of encrypt_decrypt_parallel from one thread up to max_threads, over buffers from 1 MB up to max_size
+/// </summary>
+void run_parallel_benchmark(size_t max_size, size_t max_threads, size_t min_chunk_size)
+{
+    const std::string key = "password";
+    const int runs = 3;
+
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cout << "parallel xor throughput in GB/s, best of " << runs << " runs, min chunk " << min_chunk_size / 1024 << " KB" << std::endl;
+    std::cout << std::setw(10) << "size MB";
+    for (const size_t threads : thread_counts)
+    {
+        std::cout << std::setw(8) << threads << "t";
+    }
+    std::cout << std::endl;
+
+    // one set of pools reused for every size, as a long running job would
+    std::vector<std::unique_ptr<ThreadPool>> pools;
+    for (const size_t threads : thread_counts)
+    {
+        pools.emplace_back(new ThreadPool(threads));
+    }
+
+    for (size_t size = 1024 * 1024; size <= max_size; size *= 8)
+    {
+        std::vector<char> source(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            source[i] = static_cast<char>(i * 31);
+        }
+        std::vector<char> output(size);
+        std::vector<char> expected(size);
+        encrypt_decrypt(source.data(), expected.data(), size, key);
+
+        std::cout << std::setw(10) << size / (1024 * 1024);
+        for (auto& pool : pools)
+        {
+            double best_seconds = 0;
+            for (int run = 0; run < runs; ++run)
+            {
+                const auto start = std::chrono::steady_clock::now();
+                encrypt_decrypt_parallel(source.data(), output.data(), size, key, *pool, min_chunk_size);
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                if (run == 0 || elapsed.count() < best_seconds)
+                {
+                    best_seconds = elapsed.count();
+                }
+            }
+            std::cout << std::setw(9) << std::fixed << std::setprecision(2) << size / best_seconds / (1024.0 * 1024.0 * 1024.0);
+
+            // the parallel output has to match the serial function exactly
+            if (output != expected)
+            {
+                std::cout << " <- MISMATCH";
+            }
+        }
+        std::cout << std::endl;
+    }
+}
+
+/// <summary>
+/// files/s writing the text layout with the original ofstream writer against save_data_file's gathered write
+/// </summary>
+void run_write_benchmark(const std::string& directory, size_t file_count, size_t file_size, size_t sync_batch_size)
+{
+    const std::string student_name = "Sam Student";
+    const std::string key = "password";
+    const std::string data(file_size, 'x');
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    auto report = [&](const char* name, const std::function<void(const std::string&)>& write_one)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < file_count; ++i)
+        {
+            write_one(directory + "/bench" + std::to_string(i) + ".txt");
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::setw(24) << name << std::setw(12) << std::fixed << std::setprecision(0) << file_count / elapsed.count() << " files/s" << std::endl;
+
+        // every writer starts from an empty directory rather than truncating the previous writer's files
+        for (size_t i = 0; i < file_count; ++i)
+        {
+            std::filesystem::remove(directory + "/bench" + std::to_string(i) + ".txt", error);
+        }
+    };
+
+    std::cout << file_count << " files of " << file_size << " bytes" << std::endl;
+
+    // the writer save_data_file used before, four endl flushes and the payload through operator<<
+    report("ofstream", [&](const std::string& filename)
+    {
+        std::ofstream writeFile(filename, std::ios::out);
+        writeFile << student_name << std::endl;
+        writeFile << current_date() << std::endl;
+        writeFile << key << std::endl;
+        writeFile << data << std::endl;
+    });
+
+    report("gathered", [&](const std::string& filename)
+    {
+        save_data_file(filename, student_name, key, data);
+    });
+
+    if (sync_batch_size > 0)
+    {
+        report("gathered + sync each", [&](const std::string& filename)
+        {
+            FileSyncBatch sync_one(1);
+            save_data_file(filename, student_name, key, data, &sync_one);
+        });
+
+        FileSyncBatch sync_batch(sync_batch_size);
+        size_t written = 0;
+        report("gathered + sync batch", [&](const std::string& filename)
+        {
+            save_data_file(filename, student_name, key, data, &sync_batch);
+
+            // the last partial batch is part of the cost
+            if (++written == file_count)
+            {
+                sync_batch.flush();
+            }
+        });
+    }
+}
+
+// bytes the filter moves per system call, also the pipe capacity it asks the kernel for
+const size_t filter_chunk_size = 1024 * 1024;
+
+/// <summary>
+/// what filter_stream moved and how
+/// </summary>
+struct filter_stats
+{
+    unsigned long long bytes = 0;
+    double seconds = 0;
+    // true if the output went out through vmsplice rather than write
+    bool spliced = false;
+};
+
+#if defined(__linux__)
+
+/// <summary>
+/// grow a pipe towards filter_chunk_size so each system call moves more. the kernel may cap it lower
+/// </summary>
+/// <returns>the pipe's capacity, or 0 if the file is not a pipe</returns>
+size_t grow_pipe(native_file file)
+{
+    fcntl(file, F_SETPIPE_SZ, static_cast<int>(filter_chunk_size));
+    const int capacity = fcntl(file, F_GETPIPE_SZ);
+    return capacity > 0 ? static_cast<size_t>(capacity) : 0;
+}
+
+/// <summary>
+/// hand buffer pages to a pipe with vmsplice instead of copying them in with write. the pipe keeps references to
+/// the pages themselves, not copies, see filter_stream for when they may be written again
+/// </summary>
+/// <returns>bytes handed over, less than length if the pipe refused the rest</returns>
+size_t vmsplice_all(native_file pipe, const char* data, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        iovec vector = { const_cast<char*>(data + done), length - done };
+        const ssize_t moved = vmsplice(pipe, &vector, 1, 0);
+        if (moved < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += static_cast<size_t>(moved);
+    }
+    return done;
+}
+
+#endif
+
+/// <summary>
+/// encrypt or decrypt everything arriving on input and write it to output, for use as a filter in a shell pipeline.
+/// neither end has to be seekable or a named file. the key phase carries on across reads of any size, so the
+/// output is the same however the input arrives, and running it twice gives the input back.
+/// on linux, with splice asked for and output a pipe, the transformed pages are handed over with vmsplice rather
+/// than copied. the buffer is two pipe capacities long and the halves alternate: once a whole half has gone into the
+/// pipe, the pipe can no longer hold any page of the other half, so that half is refilled.
+/// that is only safe when the reader copies out of the pipe with read. a reader that splices out of it, into a
+/// socket say (socat, some nc builds, pv with splice), keeps references to the pages after they have left the pipe,
+/// and refilling them changes data it has not sent yet. so splicing is never chosen on its own, only asked for.
+/// </summary>
+/// <param name="input">file, pipe or console to read until it ends</param>
+/// <param name="output">file, pipe or console to write</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="stats">optional, receives how much moved and how</param>
+/// <param name="splice">hand pages to an output pipe with vmsplice, only for a reader known to read() from it</param>
+/// <returns>false if a read or write failed</returns>
+bool filter_stream(native_file input, native_file output, const std::string& key, filter_stats* stats = nullptr, bool splice = false)
+{
+    size_t half_size = filter_chunk_size;
+    bool splice_output = false;
+#if defined(__linux__)
+    grow_pipe(input);
+    const size_t output_capacity = grow_pipe(output);
+    if (splice && output_capacity > 0)
+    {
+        half_size = output_capacity;
+        splice_output = true;
+    }
+#else
+    (void)splice;
+#endif
+
+    const auto start = std::chrono::steady_clock::now();
+    AlignedBuffer buffer(2 * half_size);
+    unsigned long long key_offset = 0;
+    bool ok = true;
+    for (size_t half = 0;; half ^= 1)
+    {
+        char* const data = buffer.data() + half * half_size;
+        // a whole half is read before it is handed on, which is what makes reusing the other half safe
+        const long long got = read_native_file(input, data, half_size);
+        if (got <= 0)
+        {
+            ok = got == 0;
+            break;
+        }
+        const size_t length = static_cast<size_t>(got);
+        encrypt_decrypt(data, data, length, key, key_offset);
+        key_offset += length;
+
+        size_t written = 0;
+#if defined(__linux__)
+        if (splice_output)
+        {
+            written = vmsplice_all(output, data, length);
+            if (written < length && errno != EINVAL && errno != ENOSYS)
+            {
+                ok = false;
+                break;
+            }
+            // a pipe that does not take spliced pages gets the rest, and everything after, through write
+            splice_output = written == length;
+        }
+#endif
+        if (written < length)
+        {
+            write_piece piece(data + written, length - written);
+            ok = write_gathered(output, &piece, 1);
+        }
+        if (!ok || length < half_size)
+        {
+            break;
+        }
+    }
+
+    if (stats != nullptr)
+    {
+        stats->bytes = key_offset;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stats->spliced = splice_output;
+    }
+    return ok;
+}
+
+// how long a spool file has to go without another write before watch_directory encrypts it, so a burst of writes
+// and closes on one file costs one encryption
+const unsigned int default_watch_settle_ms = 5;
+// drop to encrypted latencies watch_stats keeps for its percentiles, the most recent ones
+const size_t watch_latency_window = 4096;
+// seconds between the progress lines and stats file updates of watch_directory
+const double watch_report_seconds = 10;
+
+/// <summary>
+/// what watch_directory has done so far
+/// </summary>
+struct watch_stats
+{
+    size_t files_ok = 0;
+    size_t files_failed = 0;
+    // events folded into an encryption that was already waiting
+    size_t events_coalesced = 0;
+    unsigned long long bytes = 0;
+    // seconds from a file's first event to its output being in place, a ring of the most recent ones
+    std::vector<double> latencies;
+    size_t next_latency = 0;
+
+    void add_latency(double seconds)
+    {
+        if (latencies.size() < watch_latency_window)
+        {
+            latencies.push_back(seconds);
+            return;
+        }
+        latencies[next_latency] = seconds;
+        next_latency = (next_latency + 1) % watch_latency_window;
+    }
+
+    // latency below which the given fraction of the recent files were encrypted, 0 before any were
+    double percentile(double fraction) const
+    {
+        if (latencies.empty())
+        {
+            return 0;
+        }
+        std::vector<double> sorted(latencies);
+        const size_t rank = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+};
+
+/// <summary>
+/// reports the names of files in one directory that have been written, with inotify on linux (closed after writing,
+/// or moved in) and ReadDirectoryChangesW on windows. windows has no close event, a file is reported there each time
+/// it changes and is held back by the caller until its writer lets go of it
+/// </summary>
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher() = default;
+    ~DirectoryWatcher() { close(); }
+
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+    /// <summary>
+    /// start watching a directory, not its subdirectories
+    /// </summary>
+    /// <returns>false if it cannot be watched, or the os has no way to</returns>
+    bool open(const std::string& directory)
+    {
+#if defined(_WIN32)
+        directory_ = CreateFileA(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        changed_ = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        woken_ = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        // FILE_NOTIFY_INFORMATION records have to be dword aligned
+        buffer_.resize(16 * 1024);
+        if (directory_ == INVALID_HANDLE_VALUE || changed_ == nullptr || woken_ == nullptr || !arm())
+        {
+            close();
+            return false;
+        }
+        return true;
+#elif defined(__linux__)
+        inotify_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        woken_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        buffer_.resize(64 * 1024);
+        if (inotify_ < 0 || woken_ < 0 || inotify_add_watch(inotify_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+#else
+        (void)directory;
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// wait for files to be written, for wake, or for a signal
+    /// </summary>
+    /// <param name="timeout_ms">longest to wait, -1 for no limit</param>
+    /// <param name="names">the names of the files written, appended to</param>
+    /// <param name="rescan">set to true if the os dropped events, the caller has to look through the directory itself</param>
+    /// <returns>false if the watch broke, e.g. the directory was removed</returns>
+    bool wait(int timeout_ms, std::vector<std::string>& names, bool& rescan)
+    {
+#if defined(_WIN32)
+        const HANDLE handles[2] = { changed_, woken_ };
+        const DWORD woke = WaitForMultipleObjects(2, handles, FALSE, timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms));
+        if (woke == WAIT_FAILED)
+        {
+            return false;
+        }
+        if (woke != WAIT_OBJECT_0)
+        {
+            return true;
+        }
+
+        DWORD got = 0;
+        if (!GetOverlappedResult(directory_, &overlapped_, &got, FALSE))
+        {
+            if (GetLastError() != ERROR_NOTIFY_ENUM_DIR)
+            {
+                return false;
+            }
+            got = 0;
+        }
+        // nothing returned means the changes did not fit in the buffer
+        rescan = rescan || got == 0;
+        for (DWORD offset = 0; got > 0;)
+        {
+            const FILE_NOTIFY_INFORMATION* change = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const char*>(buffer_.data()) + offset);
+            if (change->Action == FILE_ACTION_ADDED || change->Action == FILE_ACTION_MODIFIED || change->Action == FILE_ACTION_RENAMED_NEW_NAME)
+            {
+                const int wide_length = static_cast<int>(change->FileNameLength / sizeof(WCHAR));
+                const int length = WideCharToMultiByte(CP_ACP, 0, change->FileName, wide_length, nullptr, 0, nullptr, nullptr);
+                std::string name(static_cast<size_t>(length), '\0');
+                WideCharToMultiByte(CP_ACP, 0, change->FileName, wide_length, &name[0], length, nullptr, nullptr);
+                names.push_back(name);
+            }
+            if (change->NextEntryOffset == 0)
+            {
+                break;
+            }
+            offset += change->NextEntryOffset;
+        }
+        return arm();
+#elif defined(__linux__)
+        pollfd files[2] = { { inotify_, POLLIN, 0 }, { woken_, POLLIN, 0 } };
+        if (poll(files, 2, timeout_ms) < 0)
+        {
+            return errno == EINTR;
+        }
+        if (files[1].revents & POLLIN)
+        {
+            unsigned long long count = 0;
+            (void)!read(woken_, &count, sizeof(count));
+        }
+        if (!(files[0].revents & POLLIN))
+        {
+            return true;
+        }
+
+        for (;;)
+        {
+            const ssize_t got = read(inotify_, buffer_.data(), buffer_.size());
+            if (got <= 0)
+            {
+                return got < 0 && (errno == EAGAIN || errno == EINTR);
+            }
+            for (size_t offset = 0; offset < static_cast<size_t>(got);)
+            {
+                // the buffer is bytes, the fixed part of each event is copied out rather than cast in place
+                inotify_event event;
+                std::memcpy(&event, buffer_.data() + offset, sizeof(event));
+                if (event.mask & IN_Q_OVERFLOW)
+                {
+                    rescan = true;
+                }
+                if (event.mask & IN_IGNORED)
+                {
+                    return false;
+                }
+                if (event.len > 0 && !(event.mask & IN_ISDIR))
+                {
+                    names.push_back(std::string(buffer_.data() + offset + sizeof(event)));
+                }
+                offset += sizeof(event) + event.len;
+            }
+        }
+#else
+        (void)timeout_ms;
+        (void)names;
+        (void)rescan;
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// make a wait in progress on another thread, or the next one, return straight away
+    /// </summary>
+    void wake()
+    {
+#if defined(_WIN32)
+        SetEvent(woken_);
+#elif defined(__linux__)
+        const unsigned long long count = 1;
+        (void)!write(woken_, &count, sizeof(count));
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    // start the next ReadDirectoryChangesW
+    bool arm()
+    {
+        ResetEvent(changed_);
+        overlapped_ = {};
+        overlapped_.hEvent = changed_;
+        armed_ = ReadDirectoryChangesW(directory_, buffer_.data(), static_cast<DWORD>(buffer_.size() * sizeof(DWORD)), FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE, nullptr, &overlapped_, nullptr) != 0;
+        return armed_;
+    }
+#endif
+
+    void close()
+    {
+#if defined(_WIN32)
+        if (armed_)
+        {
+            DWORD got = 0;
+            CancelIoEx(directory_, &overlapped_);
+            GetOverlappedResult(directory_, &overlapped_, &got, TRUE);
+            armed_ = false;
+        }
+        if (directory_ != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(directory_);
+            directory_ = INVALID_HANDLE_VALUE;
+        }
+        for (HANDLE* event : { &changed_, &woken_ })
+        {
+            if (*event != nullptr)
+            {
+                CloseHandle(*event);
+                *event = nullptr;
+            }
+        }
+#elif defined(__linux__)
+        for (int* file : { &inotify_, &woken_ })
+        {
+            if (*file >= 0)
+            {
+                ::close(*file);
+                *file = -1;
+            }
+        }
+#endif
+    }
+
+#if defined(_WIN32)
+    HANDLE directory_ = INVALID_HANDLE_VALUE;
+    HANDLE changed_ = nullptr;
+    HANDLE woken_ = nullptr;
+    OVERLAPPED overlapped_ = {};
+    bool armed_ = false;
+    std::vector<DWORD> buffer_;
+#elif defined(__linux__)
+    int inotify_ = -1;
+    // eventfd that wake writes to
+    int woken_ = -1;
+    std::vector<char> buffer_;
+#endif
+};
+
+/// <summary>
+/// whether a spool file is still held open by whoever is writing it. windows can tell by refusing to share it,
+/// linux only reports a file once it is closed so there is nothing to ask
+/// </summary>
+bool spool_file_busy(const std::filesystem::path& filename)
+{
+#if defined(_WIN32)
+    const HANDLE file = CreateFileA(filename.string().c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError() == ERROR_SHARING_VIOLATION;
+    }
+    CloseHandle(file);
+    return false;
+#else
+    (void)filename;
+    return false;
+#endif
+}
+
+/// <summary>
+/// whether a spool file has been encrypted since it last changed, so a restart does not redo the whole spool
+/// </summary>
+bool spool_file_current(const std::filesystem::path& input, const std::filesystem::path& output)
+{
+    std::error_code input_error;
+    std::error_code output_error;
+    const auto input_time = std::filesystem::last_write_time(input, input_error);
+    const auto output_time = std::filesystem::last_write_time(output, output_error);
+    return !input_error && !output_error && output_time >= input_time;
+}
+
+/// <summary>
+/// encrypt one spool file with read_file -> encrypt_decrypt -> save_data_file, as encrypt_batch writes the text
+/// layout. the output is written under a temporary name and renamed into place, so whatever picks the encrypted
+/// files up never sees half of one
+/// </summary>
+/// <param name="bytes">receives the payload size</param>
+/// <returns>1 if encrypted, 0 if the file is empty or gone and there is nothing to do yet, -1 if it failed</returns>
+int encrypt_spool_file(const std::filesystem::path& input, const std::filesystem::path& output, const std::string& key, bool crc_trailer, unsigned long long& bytes)
+{
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(input, error) || std::filesystem::file_size(input, error) == 0)
+    {
+        return 0;
+    }
+
+    const std::string partial = output.string() + ".part";
+    try
+    {
+        std::string data = read_file(input.string());
+        if (data.empty())
+        {
+            return 0;
+        }
+        const std::string student_name = get_student_name(data);
+        unsigned int crc = 0;
+        if (crc_trailer)
+        {
+            encrypt_decrypt_crc32c(data.data(), &data[0], data.length(), key, 0, crc);
+        }
+        else
+        {
+            encrypt_decrypt(&data[0], data.length(), key);
+        }
+        if (!save_data_file(partial, student_name, key, data, nullptr, crc_trailer ? &crc : nullptr))
+        {
+            std::remove(partial.c_str());
+            return -1;
+        }
+        std::filesystem::rename(partial, output);
+        bytes = data.length();
+        return 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Failed to encrypt file: " << input.string() << " " << e.what() << std::endl;
+    }
+    std::remove(partial.c_str());
+    return -1;
+}
+
+/// <summary>
+/// write the watch counters and latency percentiles in the prometheus text format, for a node exporter's textfile
+/// collector to pick up. written under a temporary name and renamed so a scrape never reads half of it
+/// </summary>
+bool write_watch_stats(const std::string& filename, const watch_stats& stats)
+{
+    const std::string partial = filename + ".part";
+    {
+        std::ofstream writeFile(partial, std::ios::out | std::ios::binary);
+        writeFile << "encryption_watch_files_total " << stats.files_ok << "\n"
+            << "encryption_watch_failures_total " << stats.files_failed << "\n"
+            << "encryption_watch_coalesced_events_total " << stats.events_coalesced << "\n"
+            << "encryption_watch_bytes_total " << stats.bytes << "\n"
+            << std::setprecision(6)
+            << "encryption_watch_latency_seconds{quantile=\"0.5\"} " << stats.percentile(0.5) << "\n"
+            << "encryption_watch_latency_seconds{quantile=\"0.99\"} " << stats.percentile(0.99) << "\n";
+        if (!writeFile)
+        {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(partial, filename, error);
+    return !error;
+}
+
+void print_watch_report(const watch_stats& stats)
+{
+    std::cout << "Encrypted " << stats.files_ok << " files, " << stats.files_failed << " failed, " << stats.events_coalesced << " events coalesced, "
+        << "drop to encrypted p50 " << std::fixed << std::setprecision(2) << stats.percentile(0.5) * 1000 << " ms, p99 "
+        << stats.percentile(0.99) * 1000 << " ms" << std::endl;
+}
+
+/// <summary>
+/// encrypt files as soon as they are dropped into a spool directory, until stop is set. files already there that
+/// are newer than their output are encrypted first. each file is encrypted once it has been closed after writing
+/// and has had no further event for settle_ms, so a burst of events on one file, or a file written again while it
+/// waits, is one encryption. a file written again while it is being encrypted is encrypted again afterwards.
+/// at most thread_count files are read and encrypted at once, the rest wait by name only, so a flood of drops costs
+/// no more memory than a few files.
+/// latency is counted from the first event of a file, when the watcher learns of it, to its output being in place.
+/// </summary>
+/// <param name="spool">directory files are dropped into, subdirectories are not watched</param>
+/// <param name="output_directory">where the encrypted files are written under the same names, not the spool itself</param>
+/// <param name="key">key to use in encryption / decryption</param>
+/// <param name="thread_count">files encrypted at once</param>
+/// <param name="settle_ms">quiet time a file needs before it is encrypted</param>
+/// <param name="crc_trailer">end the files with a crc-32c trailer</param>
+/// <param name="stats_filename">if not empty, the counters and latency percentiles are exported here every report</param>
+/// <param name="stop">set, e.g. from a signal handler, to finish the files in flight and return</param>
+/// <param name="stats">receives what was done</param>
+/// <returns>false if the spool could not be watched or the watch broke</returns>
+bool watch_directory(const std::filesystem::path& spool, const std::filesystem::path& output_directory, const std::string& key, size_t thread_count,
+    unsigned int settle_ms, bool crc_trailer, const std::string& stats_filename, const volatile std::sig_atomic_t& stop, watch_stats& stats)
+{
+    assert(thread_count > 0);
+    std::error_code error;
+    std::filesystem::create_directories(output_directory, error);
+    if (std::filesystem::equivalent(spool, output_directory, error))
+    {
+        std::cout << "The output directory cannot be the spool directory" << std::endl;
+        return false;
+    }
+
+    DirectoryWatcher watcher;
+    if (!watcher.open(spool.string()))
+    {
+        std::cout << "Failed to watch directory: " << spool.string() << std::endl;
+        return false;
+    }
+
+    using clock = std::chrono::steady_clock;
+    struct waiting_file
+    {
+        clock::time_point first_event;
+        clock::time_point last_event;
+    };
+    // files to encrypt by name, and the ones being encrypted, both guarded by state_mutex along with stats
+    std::map<std::string, waiting_file> waiting;
+    std::map<std::string, bool> running;
+    std::mutex state_mutex;
+
+    auto note_event = [&](const std::string& name, clock::time_point now)
+    {
+        const auto found = waiting.find(name);
+        if (found == waiting.end())
+        {
+            waiting.emplace(name, waiting_file{ now, now });
+            return;
+        }
+        found->second.last_event = now;
+        ++stats.events_coalesced;
+    };
+    // at the start, and whenever the os lost events, the directory itself says what still needs doing
+    auto scan_spool = [&](clock::time_point now)
+    {
+        for (const auto& entry : std::filesystem::directory_iterator(spool, error))
+        {
+            const std::string name = entry.path().filename().string();
+            if (entry.is_regular_file(error) && !spool_file_current(entry.path(), output_directory / name))
+            {
+                note_event(name, now);
+            }
+        }
+    };
+    scan_spool(clock::now());
+
+    bool ok = true;
+    WorkStealingPool pool(thread_count);
+    auto last_report = clock::now();
+    std::vector<std::string> names;
+    while (!stop)
+    {
+        const auto now = clock::now();
+        // with nothing due the wait still ends now and then, for reports and for a stop set where no signal interrupts it
+        auto next_due = now + std::chrono::milliseconds(250);
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            for (auto it = waiting.begin(); it != waiting.end() && running.size() < thread_count;)
+            {
+                const auto due = it->second.last_event + std::chrono::milliseconds(settle_ms);
+                if (due > now || running.count(it->first) != 0)
+                {
+                    // a file still being encrypted comes round again when its worker wakes the watcher
+                    next_due = std::min(next_due, due > now ? due : next_due);
+                    ++it;
+                    continue;
+                }
+                if (spool_file_busy(spool / it->first))
+                {
+                    it->second.last_event = now;
+                    next_due = std::min(next_due, now + std::chrono::milliseconds(std::max(settle_ms, 1u)));
+                    ++it;
+                    continue;
+                }
+
+                const std::string name = it->first;
+                const clock::time_point first_event = it->second.first_event;
+                it = waiting.erase(it);
+                running[name] = true;
+                pool.submit([&, name, first_event]()
+                {
+                    unsigned long long bytes = 0;
+                    const int result = encrypt_spool_file(spool / name, output_directory / name, key, crc_trailer, bytes);
+                    const double latency = std::chrono::duration<double>(clock::now() - first_event).count();
+                    {
+                        std::lock_guard<std::mutex> lock(state_mutex);
+                        running.erase(name);
+                        if (result > 0)
+                        {
+                            ++stats.files_ok;
+                            stats.bytes += bytes;
+                            stats.add_latency(latency);
+                        }
+                        else if (result < 0)
+                        {
+                            ++stats.files_failed;
+                            std::cout << "Skipped file: " << (spool / name).string() << std::endl;
+                        }
+                    }
+                    watcher.wake();
+                });
+            }
+
+            if (now - last_report >= std::chrono::duration<double>(watch_report_seconds))
+            {
+                last_report = now;
+                print_watch_report(stats);
+                if (!stats_filename.empty() && !write_watch_stats(stats_filename, stats))
+                {
+                    std::cout << "Failed to write file: " << stats_filename << std::endl;
+                }
+            }
+        }
+
+        names.clear();
+        bool rescan = false;
+        const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(next_due - now).count();
+        if (!watcher.wait(static_cast<int>(std::max<long long>(timeout, 0)), names, rescan))
+        {
+            std::cout << "Stopped watching directory: " << spool.string() << std::endl;
+            ok = false;
+            break;
+        }
+
+        const auto woke = clock::now();
+        std::lock_guard<std::mutex> lock(state_mutex);
+        for (const std::string& name : names)
+        {
+            note_event(name, woke);
+        }
+        if (rescan)
+        {
+            scan_spool(woke);
+        }
+    }
+
+    // the files in flight are finished, the ones still waiting are left for the next start to find
+    pool.wait();
+    if (!stats_filename.empty())
+    {
+        write_watch_stats(stats_filename, stats);
+    }
+    return ok;
+}
+
+// set by the signal handler --watch installs, watch_directory finishes what it is doing and returns
+volatile std::sig_atomic_t watch_stop_requested = 0;
+
+void request_watch_stop(int)
+{
+    watch_stop_requested = 1;
+}
+
+/// <summary>
+/// share of a file's pages currently held in the page cache
+/// </summary>
+/// <returns>0 to 1, or -1 where the os does not say</returns>
+double cached_fraction(const std::string& filename)
+{
+#if defined(_WIN32)
+    (void)filename;
+    return -1;
+#else
+    const int file = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return -1;
+    }
+    struct stat info;
+    double fraction = -1;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+    {
+        const size_t length = static_cast<size_t>(info.st_size);
+        void* view = mmap(nullptr, length, PROT_READ, MAP_SHARED, file, 0);
+        if (view != MAP_FAILED)
+        {
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            std::vector<unsigned char> resident((length + page - 1) / page);
+#if defined(__APPLE__)
+            const int result = mincore(view, length, reinterpret_cast<char*>(resident.data()));
+#else
+            const int result = mincore(view, length, resident.data());
+#endif
+            if (result == 0)
+            {
+                size_t cached = 0;
+                for (const unsigned char r : resident)
+                {
+                    cached += r & 1;
+                }
+                fraction = static_cast<double>(cached) / resident.size();
+            }
+            munmap(view, length);
+        }
+    }
+    close(file);
+    return fraction;
+#endif
+}
+
+/// <summary>
+/// time stream_data_file against direct_data_file on one file, and show how much of the output each leaves in the page cache
+/// </summary>
+/// <returns>false if either path failed or they wrote different files</returns>
+bool run_direct_benchmark(const std::string& input_filename, const std::string& output_filename, size_t chunk_size)
+{
+    typedef bool (*file_transform)(const std::string&, const std::string&, const std::string&, size_t);
+    // stream_data_file's optional trailer argument does not fit the pointer type, so it goes through a lambda
+    const file_transform buffered = [](const std::string& input, const std::string& output, const std::string& key, size_t chunk)
+    {
+        return stream_data_file(input, output, key, chunk);
+    };
+    const std::pair<const char*, file_transform> paths[] = { { "buffered", buffered }, { "direct", &direct_data_file } };
+    const std::string outputs[] = { output_filename + ".buffered", output_filename };
+
+    bool ok = true;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const bool written = paths[i].second(input_filename, outputs[i], "password", chunk_size);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ok = ok && written;
+
+        std::error_code error;
+        const double megabytes = std::filesystem::file_size(input_filename, error) / (1024.0 * 1024.0);
+        const double cached = cached_fraction(outputs[i]);
+        std::cout << std::left << std::setw(10) << paths[i].first << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << megabytes / std::max(elapsed.count(), 1e-9) << " MB/s, output in page cache: ";
+        if (cached < 0)
+        {
+            std::cout << "n/a" << std::endl;
+        }
+        else
+        {
+            std::cout << std::setprecision(0) << 100 * cached << "%" << std::endl;
+        }
+    }
+
+    // compared a chunk at a time, the files may well be bigger than memory
+    bool same = ok;
+    std::ifstream first(outputs[0], std::ios::in | std::ios::binary);
+    std::ifstream second(outputs[1], std::ios::in | std::ios::binary);
+    std::vector<char> first_chunk(default_chunk_size), second_chunk(default_chunk_size);
+    while (same && first && second)
+    {
+        first.read(first_chunk.data(), static_cast<std::streamsize>(first_chunk.size()));
+        second.read(second_chunk.data(), static_cast<std::streamsize>(second_chunk.size()));
+        same = first.gcount() == second.gcount() && std::memcmp(first_chunk.data(), second_chunk.data(), static_cast<size_t>(first.gcount())) == 0;
+    }
+    same = same && first.eof() && second.eof();
+    std::cout << "outputs " << (same ? "match" : "DIFFER") << std::endl;
+    std::filesystem::remove(outputs[0]);
+    return same;
+}
+
+/// <summary>
+/// compress one file at a given block size, then show the ratio and the compression and decompression speeds
+/// </summary>
+/// <returns>false if the file cannot be read or does not decompress back to itself</returns>
+bool run_compression_benchmark(const std::string& filename, size_t block_size)
+{
+    const std::string data = read_file(filename);
+    if (data.empty())
+    {
+        return false;
+    }
+    // small inputs are compressed many times over so the timings are not all noise
+    const size_t runs = std::max<size_t>(1, (256 * 1024 * 1024) / data.length());
+
+    std::string compressed;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t run = 0; run < runs; ++run)
+    {
+        compressed = compress_payload(data, block_size);
+    }
+    const std::chrono::duration<double> compress_time = std::chrono::steady_clock::now() - start;
+
+    // the output is sized up front and rewritten each run, so the timing is not about growing a string
+    std::ostringstream plain(std::string(data.length(), '\0'));
+    bool ok = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t run = 0; run < runs; ++run)
+    {
+        plain.seekp(0);
+        DecompressingBuffer decompressor(plain, block_size, data.length());
+        std::ostream decompressed(&decompressor);
+        decompressed.write(compressed.data(), static_cast<std::streamsize>(compressed.length()));
+        ok = ok && decompressor.finish();
+    }
+    const std::chrono::duration<double> decompress_time = std::chrono::steady_clock::now() - start;
+    ok = ok && plain.str() == data;
+
+    const double megabytes = static_cast<double>(data.length()) * runs / (1024.0 * 1024.0);
+    std::cout << std::fixed << std::setprecision(1) << data.length() << " -> " << compressed.length() << " bytes ("
+        << 100.0 * compressed.length() / data.length() << "%) in " << block_size / 1024 << " KB blocks, compress "
+        << megabytes / std::max(compress_time.count(), 1e-9) << " MB/s, decompress "
+        << megabytes / std::max(decompress_time.count(), 1e-9) << " MB/s, round trip " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+/// <summary>
+/// show what one key derivation costs and what it costs per file once a batch job shares it through a DerivedKeyCache
+/// </summary>
+/// <param name="file_count">files the simulated job encrypts</param>
+/// <param name="thread_count">threads asking the cache at once</param>
+void run_kdf_benchmark(size_t file_count, size_t thread_count)
+{
+    for (const char* preset : { "pbkdf2", "scrypt" })
+    {
+        kdf_params params;
+        parse_kdf_params(preset, params);
+        const std::string salt = make_salt();
+
+        auto start = std::chrono::steady_clock::now();
+        derive_key("password", salt, params);
+        const double derive_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // every file of the job asks for its key, as encrypt_batch does
+        DerivedKeyCache cache;
+        start = std::chrono::steady_clock::now();
+        {
+            WorkStealingPool pool(thread_count);
+            for (size_t i = 0; i < file_count; ++i)
+            {
+                pool.submit([&]() { cache.get("default", "password", salt, params); });
+            }
+            pool.wait();
+        }
+        const double cached_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // a lookup on its own, once the key is in the cache
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < file_count; ++i)
+        {
+            cache.get("default", "password", salt, params);
+        }
+        const double hit_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::left << std::setw(16) << kdf_descriptor(params, std::string()) << std::right << std::fixed << std::setprecision(3)
+            << " derive " << 1000 * derive_seconds << " ms, per file over " << file_count << " files: uncached "
+            << 1000 * derive_seconds << " ms, cached " << 1000 * cached_seconds / file_count << " ms ("
+            << cache.misses() << " derived), a cache hit alone " << std::setprecision(2) << 1e6 * hit_seconds / file_count << " us" << std::endl;
+    }
+}
+
+/// <summary>
+/// time the original byte loop and the repeating key xor against every aes-256-ctr and chacha20 kernel, and sealing
+/// with chacha20-poly1305 in one pass against encrypting and hashing in two
+/// </summary>
+/// <param name="payload_size">number of bytes to transform per run</param>
+void run_cipher_benchmark(size_t payload_size)
+{
+    std::string source(payload_size, '\0');
+    for (size_t i = 0; i < payload_size; ++i)
+    {
+        source[i] = static_cast<char>((i * 131) ^ (i >> 7));
+    }
+    std::string output(payload_size, '\0');
+    const std::string key = "password";
+    const std::string nonce = make_nonce(cipher_id::aes256_ctr);
+
+    unsigned char aes_key[cipher_key_size];
+    cipher_key_from_string(key, aes_key);
+    aes256_key expanded;
+    aes256_set_key(aes_key, expanded);
+
+    std::vector<named_aes_kernel> aes_kernels;
+    if (host_cpu_features().aesni)
+    {
+        aes_kernels.emplace_back("aes-ni", aes256_ctr_blocks_aesni);
+    }
+    aes_kernels.emplace_back("software", aes256_ctr_blocks_soft);
+
+    const std::vector<named_chacha_kernel> chacha_kernels = supported_chacha_kernels();
+    chacha_state chacha;
+    chacha_initial_state(aes_key, reinterpret_cast<const unsigned char*>(nonce.data()), chacha);
+
+    auto time_runs = [&](const std::function<void()>& transform)
+    {
+        double best_seconds = 0;
+        for (int run = 0; run < 3; ++run)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            transform();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (run == 0 || elapsed.count() < best_seconds)
+            {
+                best_seconds = elapsed.count();
+            }
+        }
+        return payload_size / best_seconds / (1024.0 * 1024.0);
+    };
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "xor (original byte loop): " << time_runs([&]()
+    {
+        for (size_t i = 0; i < payload_size; ++i)
+        {
+            output[i] = source[i] ^ key[i % key.length()];
+        }
+    }) << " MB/s" << std::endl;
+    std::cout << "xor (" << active_xor_kernel().first << "): "
+        << time_runs([&]() { encrypt_decrypt(source.data(), &output[0], payload_size, key, 0); }) << " MB/s" << std::endl;
+    for (const named_aes_kernel& kernel : aes_kernels)
+    {
+        std::cout << "aes-256-ctr (" << kernel.first << "): "
+            << time_runs([&]() { aes256_ctr_transform(expanded, reinterpret_cast<const unsigned char*>(nonce.data()), source.data(), &output[0], payload_size, 0, kernel.second); })
+            << " MB/s" << std::endl;
+    }
+    for (const named_chacha_kernel& kernel : chacha_kernels)
+    {
+        std::cout << "chacha20 (" << kernel.first << "): "
+            << time_runs([&]() { chacha20_transform(chacha, source.data(), &output[0], payload_size, 0, kernel.second); })
+            << " MB/s" << std::endl;
+    }
+
+    // sealing hashes each piece while it is still in cache, against encrypting everything and then hashing it again
+    std::string sealed(static_cast<size_t>(sealed_length(payload_size)), '\0');
+    std::cout << "chacha20-poly1305 (one pass): "
+        << time_runs([&]() { seal_segments(chacha, active_chacha_kernel().second, source.data(), payload_size, &sealed[0]); }) << " MB/s" << std::endl;
+    std::cout << "chacha20 then poly1305 (two passes): " << time_runs([&]()
+    {
+        chacha20_transform(chacha, source.data(), &output[0], payload_size, 0, active_chacha_kernel().second);
+        Poly1305 mac(aes_key);
+        mac.update(output.data(), output.length());
+        unsigned char tag[Poly1305::tag_size];
+        mac.finish(tag);
+    }) << " MB/s" << std::endl;
+}
+
+/// <summary>
+/// time key rotation the old way, decrypting with one key and encrypting with the other, against the fused
+/// single pass, for key length pairs with short, long and too long to build combined periods
+/// </summary>
+/// <param name="payload_size">number of bytes to re-key per run</param>
+void run_rekey_benchmark(size_t payload_size)
+{
+    std::vector<char> original(payload_size);
+    std::mt19937 random(12345);
+    for (char& c : original)
+    {
+        c = static_cast<char>(random());
+    }
+    std::vector<char> two_pass(payload_size);
+    std::vector<char> fused(payload_size);
+
+    auto make_key = [&](size_t length)
+    {
+        std::string key(length, '\0');
+        for (char& c : key)
+        {
+            c = static_cast<char>(random());
+        }
+        return key;
+    };
+
+    const std::pair<size_t, size_t> key_lengths[] = { { 8, 8 }, { 8, 13 }, { 61, 64 }, { 509, 503 }, { 1021, 1019 } };
+    for (const auto& lengths : key_lengths)
+    {
+        const std::string old_key = make_key(lengths.first);
+        const std::string new_key = make_key(lengths.second);
+
+        auto start = std::chrono::steady_clock::now();
+        encrypt_decrypt(original.data(), two_pass.data(), payload_size, old_key, 0);
+        encrypt_decrypt(two_pass.data(), two_pass.data(), payload_size, new_key, 0);
+        const double two_pass_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        const Rekey rekey(old_key, new_key);
+        rekey.transform(original.data(), fused.data(), payload_size, 0);
+        const double fused_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const double megabytes = payload_size / (1024.0 * 1024.0);
+        std::cout << "keys " << std::setw(4) << lengths.first << " -> " << std::setw(4) << lengths.second << ", period "
+            << std::setw(8) << (rekey.period() ? std::to_string(rekey.period()) : std::string("pieces")) << ": "
+            << std::fixed << std::setprecision(1) << "decrypt + encrypt " << std::setw(8) << megabytes / std::max(two_pass_seconds, 1e-9) << " MB/s, fused "
+            << std::setw(8) << megabytes / std::max(fused_seconds, 1e-9) << " MB/s" << std::endl;
+    }
+}
 
 /// <summary>
-/// encrypt or decrypt a source string using the provided key
+/// encrypt a scratch copy of a file with update_data_file, change a few bytes of the copy, and time bringing the
+/// output up to date against encrypting it all again with stream_data_file
 /// </summary>
-/// <param name="source">input string to process</param>
-/// <param name="key">key to use in encryption / decryption</param>
-/// <returns>transformed string</returns>
-std::string encrypt_decrypt(const std::string& source, const std::string& key)
+/// <param name="input_filename">file to copy and encrypt</param>
+/// <param name="output_filename">encrypted output, the scratch copy and the full rewrite go next to it</param>
+/// <param name="changes">number of single bytes changed at random places</param>
+/// <returns>false if either the update or the rewrite failed</returns>
+bool run_update_benchmark(const std::string& input_filename, const std::string& output_filename, size_t changes)
 {
-    // get lengths now instead of calling the function every time.
-    // this would have most likely been inlined by the compiler, but design for perfomance.
-    const auto key_length = key.length();
-    const auto source_length = source.length();
+    const std::string scratch_filename = output_filename + ".source";
+    const std::string full_filename = output_filename + ".full";
+    std::filesystem::copy_file(input_filename, scratch_filename, std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::remove(block_manifest_filename(output_filename));
 
-    // assert that our input data is good
-    assert(key_length > 0);
-    assert(source_length > 0);
+    update_stats first;
+    if (!update_data_file(scratch_filename, output_filename, "password", default_update_block_size, &first))
+    {
+        return false;
+    }
+    const unsigned long long length = std::filesystem::file_size(scratch_filename);
+    std::cout << "First run: " << first.blocks_written << " of " << first.blocks << " blocks written in "
+        << std::fixed << std::setprecision(3) << first.seconds << " s" << std::endl;
+
+    // a few scattered edits, the way a small change to a large document lands
+    {
+        std::fstream scratch(scratch_filename, std::ios::in | std::ios::out | std::ios::binary);
+        std::mt19937_64 random(12345);
+        for (size_t i = 0; i < changes && length > 0; ++i)
+        {
+            const std::streamoff at = static_cast<std::streamoff>(random() % length);
+            char c = 0;
+            scratch.seekg(at);
+            scratch.get(c);
+            scratch.seekp(at);
+            scratch.put(static_cast<char>(c ^ 0x5a));
+        }
+    }
+
+    update_stats second;
+    const bool updated = update_data_file(scratch_filename, output_filename, "password", default_update_block_size, &second);
 
-    std::string output = source;
+    auto start = std::chrono::steady_clock::now();
+    const bool rewritten = stream_data_file(scratch_filename, full_filename, "password");
+    const double full_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    // loop through the source string char by char
-    for (size_t i = 0; i < source_length; ++i)
+    std::cout << "After " << changes << " changed bytes: " << second.blocks_written << " of " << second.blocks << " blocks, "
+        << second.bytes_written << " bytes written in " << std::setprecision(3) << second.seconds << " s, full rewrite "
+        << full_seconds << " s" << std::endl;
+
+    std::filesystem::remove(scratch_filename);
+    std::filesystem::remove(full_filename);
+    return updated && rewritten;
+}
+
+/// <summary>
+/// time the crc-32c paths, and encrypting with the crc taken in the same pass against encrypting and then checking
+/// </summary>
+/// <param name="payload_size">number of bytes per run</param>
+void run_crc_benchmark(size_t payload_size)
+{
+    std::vector<char> source(payload_size);
+    std::mt19937 random(12345);
+    for (char& c : source)
     {
-      // transform each character based on an xor of the key modded constrained to key length using a mod
-        output[i] = source[i] ^ key[i % key_length];
+        c = static_cast<char>(random());
     }
+    std::vector<char> destination(payload_size);
+    const std::string key = "password";
+    const double megabytes = payload_size / (1024.0 * 1024.0);
 
-    // our output length must equal our source length
-    assert(output.length() == source_length);
+    auto time_run = [&](const char* name, const std::function<unsigned int()>& run)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << megabytes / seconds << " MB/s" << std::endl;
+    };
 
-    // return the transformed string
-    return output;
+    time_run("crc32c table", [&]() { return ~crc32c_update_table(~0u, source.data(), payload_size); });
+    if (host_cpu_features().sse42)
+    {
+        time_run("crc32c sse4.2, 3 lanes", [&]() { return crc32c(source.data(), payload_size); });
+    }
+    time_run("encrypt_decrypt", [&]() { encrypt_decrypt(source.data(), destination.data(), payload_size, key, 0); return 0u; });
+    time_run("encrypt_decrypt then crc32c", [&]()
+    {
+        encrypt_decrypt(source.data(), destination.data(), payload_size, key, 0);
+        return crc32c(destination.data(), payload_size);
+    });
+    time_run("encrypt_decrypt_crc32c", [&]()
+    {
+        unsigned int crc = 0;
+        encrypt_decrypt_crc32c(source.data(), destination.data(), payload_size, key, 0, crc);
+        return crc;
+    });
 }
 
-std::string read_file(const std::string& filename)
+/// <summary>
+/// time random range reads of length bytes from one open encrypted file, the way a reader seeking around it would
+/// </summary>
+/// <param name="filename">encrypted file to read from</param>
+/// <param name="reads">number of reads to time</param>
+/// <param name="length">bytes per read</param>
+/// <returns>false if the file cannot be opened or has no payload</returns>
+bool run_range_benchmark(const std::string& filename, size_t reads, size_t length)
 {
-    std::string file_text;
+    RangeReader reader;
+    if (!reader.open(filename) || reader.payload_length() == 0)
+    {
+        return false;
+    }
 
-    try
+    std::string plain_text;
+    unsigned long long position = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < reads; ++i)
     {
-        std::ifstream readFile(filename, std::ios::in | std::ios::binary);
-        if (readFile)
-        {
-            // Seek to the end of the file to get its size
-            readFile.seekg(0, std::ios::end);
-            std::streamsize file_size = readFile.tellg();
-            readFile.seekg(0, std::ios::beg);
+        // cheap deterministic jumps around the payload
+        position = (position * 6364136223846793005ull + 1442695040888963407ull);
+        reader.read((position >> 11) % reader.payload_length(), length, "password", plain_text);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << reads << " reads of " << length << " bytes in " << std::fixed << std::setprecision(3) << elapsed.count() << " s: "
+        << std::setprecision(0) << reads / elapsed.count() << " reads/s" << std::endl;
+    return true;
+}
 
-            // Resize the file_text string to accommodate the file's content
-            file_text.resize(static_cast<size_t>(file_size));
+/// <summary>
+/// run one of the Encryption.exe --*-benchmark modes, which time a part of the program instead of running it
+/// </summary>
+/// <param name="ok">set to false if the benchmark could not run</param>
+/// <returns>false if argv[1] is not a benchmark mode</returns>
+bool run_benchmark_command(int argc, char* argv[], bool& ok)
+{
+    ok = true;
 
-            // Read the entire file into the file_text string
-            if (readFile.read(&file_text[0], file_size))
-            {
-                // File reading successful
-                readFile.close();
-                return file_text;
-            }
-        }
-        else
+    // Encryption.exe --crc-benchmark [MB] compares the crc-32c paths, and taking the crc in the encryption pass against after it
+    if (argc > 1 && std::string(argv[1]) == "--crc-benchmark")
+    {
+        const size_t megabytes = argc > 2 ? std::stoul(argv[2]) : 64;
+        run_crc_benchmark(megabytes * 1024 * 1024);
+        return true;
+    }
+
+    // Encryption.exe --kdf-benchmark [files] [threads] shows what key derivation costs per file with and without the cache
+    if (argc > 1 && std::string(argv[1]) == "--kdf-benchmark")
+    {
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t file_count = argc > 2 ? std::max<size_t>(1, std::stoul(argv[2])) : 10000;
+        const size_t threads = argc > 3 ? std::max<size_t>(1, std::stoul(argv[3])) : hardware_threads;
+        run_kdf_benchmark(file_count, threads);
+        return true;
+    }
+
+    // Encryption.exe --compress-benchmark <file> [block KB] shows how well and how fast a file compresses
+    if (argc > 2 && std::string(argv[1]) == "--compress-benchmark")
+    {
+        const size_t block_size = argc > 3 ? std::stoul(argv[3]) * 1024 : default_compression_block_size;
+        if (block_size == 0 || block_size > max_compression_block_size)
         {
-            // Failed to open the file
-            std::cout << "Failed to open file: " << filename << std::endl;
+            std::cout << "Compression block size must be between 1 and " << max_compression_block_size / 1024 << " KB" << std::endl;
+            ok = false;
+            return true;
         }
+        ok = run_compression_benchmark(argv[2], block_size);
+        return true;
     }
-    catch (const std::exception& e)
+
+    // Encryption.exe --rekey-benchmark [MB] compares decrypt then encrypt with the fused re-key pass
+    if (argc > 1 && std::string(argv[1]) == "--rekey-benchmark")
     {
-        // Exception occurred during file reading
-        std::cout << "Failed to read file: " << e.what() << std::endl;
+        const size_t megabytes = argc > 2 ? std::stoul(argv[2]) : 64;
+        run_rekey_benchmark(megabytes * 1024 * 1024);
+        return true;
     }
 
-    return std::string(); // Return an empty string in case of failure
-}
+    // Encryption.exe --cipher-benchmark [MB] compares aes-256-ctr and chacha20 with the xor cipher
+    if (argc > 1 && std::string(argv[1]) == "--cipher-benchmark")
+    {
+        const size_t megabytes = argc > 2 ? std::stoul(argv[2]) : 64;
+        run_cipher_benchmark(megabytes * 1024 * 1024);
+        return true;
+    }
 
-std::string get_student_name(const std::string& string_data)
-{
-    std::string student_name;
+    // Encryption.exe --write-benchmark <directory> [files] [bytes] [sync batch] compares the save_data_file writers
+    if (argc > 2 && std::string(argv[1]) == "--write-benchmark")
+    {
+        const size_t file_count = argc > 3 ? std::stoul(argv[3]) : 10000;
+        const size_t file_size = argc > 4 ? std::stoul(argv[4]) : 1024;
+        const size_t sync_batch_size = argc > 5 ? std::stoul(argv[5]) : 0;
+        run_write_benchmark(argv[2], file_count, file_size, sync_batch_size);
+        return true;
+    }
 
-    // find the first newline
-    size_t pos = string_data.find('\n');
-    // did we find a newline
-    if (pos != std::string::npos)
-    { // we did, so copy that substring as the student name
-        student_name = string_data.substr(0, pos);
+    // Encryption.exe --parallel-benchmark [max MB] [threads] [min chunk KB] shows how encrypt_decrypt_parallel scales
+    if (argc > 1 && std::string(argv[1]) == "--parallel-benchmark")
+    {
+        const size_t max_megabytes = argc > 2 ? std::stoul(argv[2]) : 1024;
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 3 ? std::stoul(argv[3]) : hardware_threads;
+        const size_t min_chunk_size = argc > 4 ? std::stoul(argv[4]) * 1024 : default_min_parallel_chunk;
+        run_parallel_benchmark(max_megabytes * 1024 * 1024, std::max<size_t>(1, threads), min_chunk_size);
+        return true;
     }
 
-    return student_name;
+    // Encryption.exe --benchmark [MB] compares the xor kernels instead of running the file test
+    if (argc > 1 && std::string(argv[1]) == "--benchmark")
+    {
+        const size_t megabytes = argc > 2 ? std::stoul(argv[2]) : 64;
+        run_kernel_benchmark(megabytes * 1024 * 1024);
+        return true;
+    }
+
+    // Encryption.exe --update-benchmark <input> <output> [changed bytes] compares an incremental update with a full rewrite
+    if (argc > 3 && std::string(argv[1]) == "--update-benchmark")
+    {
+        const size_t changes = argc > 4 ? std::stoul(argv[4]) : 3;
+        ok = run_update_benchmark(argv[2], argv[3], changes);
+        return true;
+    }
+
+    // Encryption.exe --direct-benchmark <input> <output> [chunk KB] compares buffered and unbuffered streaming of one file
+    if (argc > 3 && std::string(argv[1]) == "--direct-benchmark")
+    {
+        const size_t chunk_size = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) * 1024 : default_chunk_size;
+        ok = run_direct_benchmark(argv[2], argv[3], chunk_size);
+        return true;
+    }
+
+    // Encryption.exe --range-benchmark <encrypted file> [reads] [length] times random range reads from one open file
+    if (argc > 2 && std::string(argv[1]) == "--range-benchmark")
+    {
+        const size_t reads = argc > 3 ? std::stoul(argv[3]) : 100000;
+        const size_t length = argc > 4 ? std::stoul(argv[4]) : 4096;
+        ok = run_range_benchmark(argv[2], reads, length);
+        return true;
+    }
+
+    return false;
 }
 
-void save_data_file(const std::string& filename, const std::string& student_name, const std::string& key, const std::string& data)
+// the benchmark project builds this file with ENCRYPTION_NO_MAIN and supplies its own main
+#if !defined(ENCRYPTION_NO_MAIN)
+
+int main(int argc, char* argv[])
 {
-    try
+    // Encryption.exe --cipher <xor|aes256-ctr|chacha20|chacha20-poly1305> <mode> ... picks the cipher for the --batch and --container modes
+    cipher_id cipher = cipher_id::xor_key;
+    if (argc > 2 && std::string(argv[1]) == "--cipher")
     {
-        std::ofstream writeFile(filename, std::ios::out);
-        if (writeFile)
+        if (!parse_cipher_name(argv[2], cipher))
+        {
+            std::cout << "Unknown cipher: " << argv[2] << std::endl;
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Encryption.exe [--cipher ...] --io <blocking|uring|direct> <mode> ... picks how --batch (uring) or --stream (direct) does its file i/o
+    std::string io_backend = "blocking";
+    if (argc > 2 && std::string(argv[1]) == "--io")
+    {
+        io_backend = argv[2];
+        if (io_backend != "blocking" && io_backend != "uring" && io_backend != "direct")
+        {
+            std::cout << "Unknown i/o backend: " << io_backend << std::endl;
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Encryption.exe [--cipher ...] [--io ...] --compress <block KB> <mode> ... compresses before encrypting in the --batch and --container modes
+    size_t compression_block_size = 0;
+    if (argc > 2 && std::string(argv[1]) == "--compress")
+    {
+        compression_block_size = std::stoul(argv[2]) * 1024;
+        if (compression_block_size == 0 || compression_block_size > max_compression_block_size)
+        {
+            std::cout << "Compression block size must be between 1 and " << max_compression_block_size / 1024 << " KB" << std::endl;
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Encryption.exe [--cipher ...] [--io ...] [--compress ...] --kdf <pbkdf2[:iterations]|scrypt[:log2 n[:r[:p]]]> <mode> ...
+    // derives the --batch and --container keys from the password with a fresh salt per job
+    const bool use_kdf = argc > 2 && std::string(argv[1]) == "--kdf";
+    DerivedKeyCache key_cache;
+    key_derivation derivation;
+    if (use_kdf)
+    {
+        if (!parse_kdf_params(argv[2], derivation.params))
         {
-            // Write Student Name
-            writeFile << student_name << std::endl;
+            std::cout << "Unknown key derivation: " << argv[2] << std::endl;
+            return 1;
+        }
+        derivation.password_id = "default";
+        derivation.salt = make_salt();
+        derivation.cache = &key_cache;
+        argc -= 2;
+        argv += 2;
+    }
 
-            // Get the current timestamp
-            std::time_t now = std::time(nullptr);
-            std::tm localTime;
-            localtime_s(&localTime, &now);
+    // Encryption.exe [--cipher ...] [--io ...] [--compress ...] [--kdf ...] --dedup --batch ... encrypts identical input files once
+    const bool use_dedup = argc > 1 && std::string(argv[1]) == "--dedup";
+    if (use_dedup)
+    {
+        argc -= 1;
+        argv += 1;
+    }
 
-            // Write timestamp (yyyy-mm-dd)
-            char buffer[80];
-            std::strftime(buffer, sizeof(buffer), "%Y-%m-%d", &localTime);
-            writeFile << buffer << std::endl;
+    // Encryption.exe [--cipher ...] [--io ...] [--compress ...] [--kdf ...] [--dedup] --crc <--batch|--stream> ... ends text layout files with a crc-32c trailer
+    const bool use_crc = argc > 1 && std::string(argv[1]) == "--crc";
+    if (use_crc)
+    {
+        argc -= 1;
+        argv += 1;
+    }
 
-            // Write key
-            writeFile << key << std::endl;
+    // Encryption.exe --verify <directory|manifest> [threads] checks every file against its crc trailer without decrypting
+    if (argc > 2 && std::string(argv[1]) == "--verify")
+    {
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 3 ? std::max<size_t>(1, std::stoul(argv[3])) : hardware_threads;
+        size_t unchecked = 0;
+        const batch_result result = verify_batch(argv[2], threads, unchecked);
 
-            // Write data
-            writeFile << data << std::endl;
+        const double seconds = std::max(result.seconds, 1e-9);
+        std::cout << "Verified " << result.files_ok << " files, " << result.files_failed << " failed, " << unchecked << " without a trailer, in "
+            << std::fixed << std::setprecision(3) << seconds << " s: " << std::setprecision(0) << (result.files_ok + result.files_failed + unchecked) / seconds << " files/s, "
+            << std::setprecision(1) << result.bytes / seconds / (1024.0 * 1024.0) << " MB/s" << std::endl;
+        return result.files_failed == 0 ? 0 : 1;
+    }
 
-            // Close file
-            writeFile.close();
+    // Encryption.exe --<name>-benchmark ... times one part of the program, see run_benchmark_command for the modes
+    bool benchmark_ok = true;
+    if (run_benchmark_command(argc, argv, benchmark_ok))
+    {
+        return benchmark_ok ? 0 : 1;
+    }
+
+    // Encryption.exe [--io direct] --stream <input> <output> [chunk KB] encrypts a file of any size in bounded memory
+    if (argc > 3 && std::string(argv[1]) == "--stream")
+    {
+        const size_t chunk_size = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) * 1024 : default_chunk_size;
+        if (io_backend == "direct" && use_crc)
+        {
+            std::cout << "O_DIRECT does not write crc trailers, using the buffered path" << std::endl;
+        }
+        else if (io_backend == "direct")
+        {
+            return direct_data_file(argv[2], argv[3], "password", chunk_size) ? 0 : 1;
+        }
+        return stream_data_file(argv[2], argv[3], "password", chunk_size, use_crc) ? 0 : 1;
+    }
+
+    // Encryption.exe [--crc] --watch <spool directory> <output directory> [threads] [settle ms] [stats file] encrypts files as they are
+    // dropped into the spool until interrupted, reporting drop to encrypted latency as it goes
+    if (argc > 3 && std::string(argv[1]) == "--watch")
+    {
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) : hardware_threads;
+        const unsigned int settle_ms = argc > 5 ? static_cast<unsigned int>(std::stoul(argv[5])) : default_watch_settle_ms;
+        const std::string stats_filename = argc > 6 ? argv[6] : std::string();
+        if (cipher != cipher_id::xor_key || compression_block_size != 0 || use_kdf || use_dedup)
+        {
+            std::cout << "--watch writes the text layout with the key as given, the cipher, compression, key derivation and deduplication options are ignored" << std::endl;
+        }
+
+        std::signal(SIGINT, request_watch_stop);
+        std::signal(SIGTERM, request_watch_stop);
+        watch_stats stats;
+        const bool ok = watch_directory(argv[2], argv[3], "password", threads, settle_ms, use_crc, stats_filename, watch_stop_requested, stats);
+        print_watch_report(stats);
+        return ok ? 0 : 1;
+    }
+
+    // Encryption.exe --filter [--splice] [--stats] encrypts or decrypts stdin to stdout, e.g. tar -c dir | Encryption.exe --filter | ssh host ...
+    // --splice hands the output pages to the pipe with vmsplice, only safe when the next command read()s the pipe
+    // rather than splicing out of it
+    if (argc > 1 && std::string(argv[1]) == "--filter")
+    {
+        bool splice = false;
+        bool show_stats = false;
+        for (int i = 2; i < argc; ++i)
+        {
+            splice = splice || std::string(argv[i]) == "--splice";
+            show_stats = show_stats || std::string(argv[i]) == "--stats";
+        }
+#if defined(_WIN32)
+        // the handles bypass the c runtime, so nothing is translated as text
+        const native_file input = GetStdHandle(STD_INPUT_HANDLE);
+        const native_file output = GetStdHandle(STD_OUTPUT_HANDLE);
+#else
+        const native_file input = STDIN_FILENO;
+        const native_file output = STDOUT_FILENO;
+#endif
+        filter_stats stats;
+        const bool ok = filter_stream(input, output, "password", &stats, splice);
+        if (show_stats)
+        {
+            // stdout carries the data, the report goes to stderr
+            const double seconds = std::max(stats.seconds, 1e-9);
+            std::cerr << "Filtered " << stats.bytes << " bytes in " << std::fixed << std::setprecision(3) << seconds << " s: "
+                << std::setprecision(1) << stats.bytes / seconds / (1024.0 * 1024.0) << " MB/s, output " << (stats.spliced ? "spliced" : "written") << std::endl;
+        }
+        return ok ? 0 : 1;
+    }
+
+    // Encryption.exe --update <input> <output> [block KB] re-encrypts only the blocks of input that changed since the last --update
+    if (argc > 3 && std::string(argv[1]) == "--update")
+    {
+        const size_t block_size = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) * 1024 : default_update_block_size;
+        update_stats stats;
+        if (!update_data_file(argv[2], argv[3], "password", block_size, &stats))
+        {
+            return 1;
+        }
+        std::cout << "Wrote " << stats.blocks_written << " of " << stats.blocks << " blocks, " << stats.bytes_written << " bytes"
+            << (stats.full ? " (full rewrite)" : "") << ", in " << std::fixed << std::setprecision(3) << stats.seconds << " s" << std::endl;
+        return 0;
+    }
+
+    // Encryption.exe --pipeline <input> <output> [chunk KB] [buffers] overlaps reading, encrypting and writing
+    if (argc > 3 && std::string(argv[1]) == "--pipeline")
+    {
+        const size_t chunk_size = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) * 1024 : default_chunk_size;
+        const size_t buffers = argc > 5 ? std::max<size_t>(1, std::stoul(argv[5])) : default_pipeline_buffers;
+        pipeline_stats stats;
+        const bool ok = pipeline_data_file(argv[2], argv[3], "password", chunk_size, buffers, &stats);
+
+        const double seconds = std::max(stats.seconds, 1e-9);
+        std::cout << std::fixed << std::setprecision(1) << stats.bytes / seconds / (1024.0 * 1024.0) << " MB/s over " << std::setprecision(3) << seconds << " s, stage busy: "
+            << std::setprecision(0) << "read " << 100 * stats.read_seconds / seconds << "%, "
+            << "transform " << 100 * stats.transform_seconds / seconds << "%, "
+            << "write " << 100 * stats.write_seconds / seconds << "%" << std::endl;
+        return ok ? 0 : 1;
+    }
+
+    // Encryption.exe --mmap <input> <output> encrypts through memory mappings without copying through stream buffers
+    if (argc > 3 && std::string(argv[1]) == "--mmap")
+    {
+        return map_or_stream_data_file(argv[2], argv[3], "password") ? 0 : 1;
+    }
+
+    // Encryption.exe [--io uring] --batch <directory|manifest> <output directory> [threads] [sync batch] encrypts many files at once
+    if (argc > 3 && std::string(argv[1]) == "--batch")
+    {
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 4 ? std::max<size_t>(1, std::stoul(argv[4])) : hardware_threads;
+        const size_t sync_batch_size = argc > 5 ? std::stoul(argv[5]) : 0;
+        // the io_uring path writes plain save_data_file output without syncing, so the other combinations stay blocking.
+        // with --io uring the thread count is the number of files in flight instead
+        const bool uring = io_backend == "uring" && cipher == cipher_id::xor_key && sync_batch_size == 0 && compression_block_size == 0 && !use_kdf && !use_dedup && !use_crc;
+        if (io_backend == "uring" && !uring)
+        {
+            std::cout << "io_uring only handles the xor cipher without a sync batch, compression, key derivation, deduplication or crc trailers, using the blocking path" << std::endl;
+        }
+        if (use_crc && (cipher != cipher_id::xor_key || compression_block_size != 0))
+        {
+            std::cout << "crc trailers are only written in the text layout, containers are written without them" << std::endl;
+        }
+        dedup_stats dedup;
+        const batch_result result = uring ? encrypt_batch_uring(argv[2], argv[3], "password", argc > 4 ? threads : default_uring_queue_depth)
+            : encrypt_batch(argv[2], argv[3], "password", threads, sync_batch_size, cipher, compression_block_size, use_kdf ? &derivation : nullptr, use_dedup ? &dedup : nullptr, use_crc);
+
+        const double seconds = std::max(result.seconds, 1e-9);
+        const double gigabytes = std::max(result.bytes / (1024.0 * 1024.0 * 1024.0), 1e-12);
+        std::cout << "Encrypted " << result.files_ok << " files, " << result.files_failed << " failed, in " << std::fixed << std::setprecision(3) << seconds << " s: "
+            << std::setprecision(0) << result.files_ok / seconds << " files/s, "
+            << std::setprecision(1) << result.bytes / seconds / (1024.0 * 1024.0) << " MB/s, "
+            << std::setprecision(2) << result.cpu_seconds / gigabytes << " CPU s/GB" << std::endl;
+        if (use_dedup)
+        {
+            std::cout << "Deduplicated " << dedup.duplicate_files << " files (" << dedup.reflinked_files << " reflinked), ratio "
+                << std::setprecision(2) << dedup.ratio() << ": hashing " << std::setprecision(3) << dedup.hash_seconds << " s, encrypting "
+                << dedup.encrypt_seconds << " s, copying " << dedup.copy_seconds << " s, about " << dedup.seconds_saved() << " s saved" << std::endl;
+        }
+        return result.files_failed == 0 ? 0 : 1;
+    }
+
+    // Encryption.exe --rekey <encrypted file> <old key> <new key> [output] moves a file to a new key without decrypting it
+    if (argc > 4 && std::string(argv[1]) == "--rekey")
+    {
+        if (std::string(argv[3]).empty() || std::string(argv[4]).empty())
+        {
+            std::cout << "Keys must not be empty" << std::endl;
+            return 1;
+        }
+        return rekey_data_file(argv[2], argc > 5 ? argv[5] : std::string(), argv[3], argv[4]) ? 0 : 1;
+    }
+
+    // Encryption.exe --rekey-batch <directory|manifest> <old key> <new key> [threads] re-keys every file in place
+    if (argc > 4 && std::string(argv[1]) == "--rekey-batch")
+    {
+        if (std::string(argv[3]).empty() || std::string(argv[4]).empty())
+        {
+            std::cout << "Keys must not be empty" << std::endl;
+            return 1;
+        }
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 5 ? std::max<size_t>(1, std::stoul(argv[5])) : hardware_threads;
+        const batch_result result = rekey_batch(argv[2], argv[3], argv[4], threads);
+
+        const double seconds = std::max(result.seconds, 1e-9);
+        std::cout << "Re-keyed " << result.files_ok << " files, " << result.files_failed << " failed, in " << std::fixed << std::setprecision(3) << seconds << " s: "
+            << std::setprecision(0) << result.files_ok / seconds << " files/s, "
+            << std::setprecision(1) << result.bytes / seconds / (1024.0 * 1024.0) << " MB/s" << std::endl;
+        return result.files_failed == 0 ? 0 : 1;
+    }
+
+    // Encryption.exe --names <directory|manifest> [threads] lists every file's student name without reading the payloads
+    if (argc > 2 && std::string(argv[1]) == "--names")
+    {
+        const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = argc > 3 ? std::max<size_t>(1, std::stoul(argv[3])) : hardware_threads;
+        std::vector<std::filesystem::path> relative_names;
+        const std::vector<std::filesystem::path> files = list_batch_files(argv[2], relative_names);
+
+        const auto start = std::chrono::steady_clock::now();
+        const std::vector<student_name_result> results = read_student_names(files, threads);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        size_t failed = 0;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (results[i].ok)
+            {
+                std::cout << files[i].string() << "\t" << results[i].student_name << "\n";
+            }
+            else
+            {
+                ++failed;
+            }
+        }
+        const double seconds = std::max(elapsed.count(), 1e-9);
+        std::cout << "Read " << files.size() - failed << " names, " << failed << " failed, in " << std::fixed << std::setprecision(3) << seconds << " s: "
+            << std::setprecision(0) << files.size() / seconds << " files/s" << std::endl;
+        return failed == 0 ? 0 : 1;
+    }
+
+    // Encryption.exe --container <input> <output> encrypts a file into the binary container layout
+    if (argc > 3 && std::string(argv[1]) == "--container")
+    {
+        const std::string key = use_kdf ? key_cache.get(derivation.password_id, "password", derivation.salt, derivation.params) : "password";
+        const std::string descriptor = use_kdf ? kdf_descriptor(derivation.params, derivation.salt) : std::string();
+        std::string data = read_file(argv[2]);
+        if (data.empty())
+        {
+            return 1;
+        }
+        const std::string student_name = get_student_name(data);
+        const size_t plain_length = data.length();
+        if (compression_block_size > 0)
+        {
+            data = compress_payload(data, compression_block_size);
+        }
+        const std::string nonce = make_nonce(cipher);
+        encrypt_payload(data, key, cipher, nonce);
+        return save_container_file(argv[3], student_name, key, data, cipher, nonce, nullptr, compression_block_size, plain_length, descriptor) ? 0 : 1;
+    }
+
+    // Encryption.exe --open-container <container> <output> decrypts a container's payload back to the original file
+    if (argc > 3 && std::string(argv[1]) == "--open-container")
+    {
+        std::string key = "password";
+        container_header header;
+        std::string student_name;
+        std::string date;
+        std::string descriptor;
+        std::ifstream readFile(argv[2], std::ios::in | std::ios::binary);
+        if (!readFile || !read_container_header(readFile, header, student_name, date, &descriptor))
+        {
+            std::cout << "Not a valid container file: " << argv[2] << std::endl;
+            return 1;
+        }
+        if (!descriptor.empty())
+        {
+            // the key was derived from the password, the container says how
+            kdf_params params;
+            std::string salt;
+            if (!parse_kdf_descriptor(descriptor, params, salt))
+            {
+                std::cout << "Unknown key derivation in container: " << argv[2] << std::endl;
+                return 1;
+            }
+            key = derive_key(key, salt, params);
+        }
+        if (header.key_id != key_fingerprint(key, header.key_salt))
+        {
+            std::cout << "Container was encrypted with a different key: " << argv[2] << std::endl;
+            return 1;
+        }
+
+        const std::string nonce(header.nonce, cipher_nonce_size(header.cipher));
+        std::ofstream writeFile(argv[3], std::ios::out | std::ios::binary);
+
+        // a compressed payload is decompressed block by block as it comes out of decryption, never held whole
+        const bool compressed = (header.flags & container_flag_compressed) != 0;
+        DecompressingBuffer decompressor(writeFile, compressed ? header.compression_block_size : 1, header.plain_length);
+        std::ostream decompressed(&decompressor);
+        std::ostream& plain = compressed ? decompressed : writeFile;
+
+        if (cipher_is_sealed(header.cipher))
+        {
+            // verified segment by segment on the way through, a bad one stops the copy and the partial output is removed
+            unsigned long long failed_segment = 0;
+            if (!open_sealed_stream(readFile, header.payload_length, plain, key, nonce, failed_segment))
+            {
+                std::cout << "Authentication failed at segment " << failed_segment << ": " << argv[2] << std::endl;
+                writeFile.close();
+                std::remove(argv[3]);
+                return 1;
+            }
         }
         else
         {
-            // Failed to open the file
-            std::cout << "Failed to open file: " << filename << std::endl;
+            const std::unique_ptr<CipherEngine> engine = make_cipher_engine(header.cipher, key, nonce);
+            std::vector<char> chunk(sealed_segment_size);
+            for (unsigned long long offset = 0; offset < header.payload_length; offset += chunk.size())
+            {
+                const size_t length = static_cast<size_t>(std::min<unsigned long long>(chunk.size(), header.payload_length - offset));
+                if (!readFile.read(chunk.data(), static_cast<std::streamsize>(length)))
+                {
+                    std::cout << "Container payload is truncated: " << argv[2] << std::endl;
+                    writeFile.close();
+                    std::remove(argv[3]);
+                    return 1;
+                }
+                engine->transform(chunk.data(), chunk.data(), length, offset);
+                plain.write(chunk.data(), static_cast<std::streamsize>(length));
+            }
         }
+        if (compressed && !decompressor.finish())
+        {
+            std::cout << "Container payload does not decompress: " << argv[2] << std::endl;
+            writeFile.close();
+            std::remove(argv[3]);
+            return 1;
+        }
+        std::cout << "Student: " << student_name << ", encrypted on " << date << std::endl;
+        return writeFile ? 0 : 1;
     }
-    catch (const std::exception& e)
+
+    // Encryption.exe --range <encrypted file> <offset> <length> writes just that part of the plain text to stdout
+    if (argc > 4 && std::string(argv[1]) == "--range")
     {
-        // Exception occurred during file writing
-        std::cout << "Failed to write file: " << e.what() << std::endl;
+        std::string plain_text;
+        if (!decrypt_range(argv[2], "password", std::stoull(argv[3]), std::stoul(argv[4]), plain_text))
+        {
+            return 1;
+        }
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        std::cout.write(plain_text.data(), static_cast<std::streamsize>(plain_text.length()));
+        std::cout.flush();
+        return 0;
     }
-}
 
-int main()
-{
     std::cout << "Encyption Decryption Test!" << std::endl;
 
     // input file format
@@ -154,29 +7068,32 @@ int main()
     const std::string encrypted_file_name = "encrypteddatafile.txt";
     const std::string decrypted_file_name = "decrypteddatafile.txt";
 
-    // Read the content of the data file
-    const std::string source_string = read_file(file_name);
+    // Read the content of the data file. this is the only copy of the file held in memory,
+    // it is encrypted and then decrypted in place rather than keeping source, cipher and plain text alive together.
+    std::string data = read_file(file_name);
 
     // Get the student name from the data file
-    const std::string student_name = get_student_name(source_string);
+    const std::string student_name = get_student_name(data);
 
-    // Encrypt source_string with the specified key
+    // Encrypt the data in place with the specified key
     const std::string key = "password";
-    const std::string encrypted_string = encrypt_decrypt(source_string, key);
+    encrypt_decrypt(&data[0], data.length(), key);
 
-    // Save the encrypted string to a file
-    save_data_file(encrypted_file_name, student_name, key, encrypted_string);
+    // Save the encrypted data to a file
+    save_data_file(encrypted_file_name, student_name, key, data);
 
-    // Decrypt the encrypted_string using the same key
-    const std::string decrypted_string = encrypt_decrypt(encrypted_string, key);
+    // Decrypt the encrypted data in place using the same key
+    encrypt_decrypt(&data[0], data.length(), key);
 
-    // Save the decrypted string to a file
-    save_data_file(decrypted_file_name, student_name, key, decrypted_string);
+    // Save the decrypted data to a file
+    save_data_file(decrypted_file_name, student_name, key, data);
 
     // Output the file names for reference
     std::cout << "Reading file: " << file_name << "\n" << "Encrypted file output: " << encrypted_file_name << "\n" << "Decrypted file output: " << decrypted_file_name << std::endl;
 
 }
 
+#endif // !ENCRYPTION_NO_MAIN
+
 // Run program: Ctrl + F5 or Debug > Start Without Debugging menu
 // Debug program: F5 or Debug > Start Debugging menu
@@ -0,0 +1,269 @@
+// Encryption.h : functions shared between the Encryption program and the EncryptionBenchmark and EncryptionTest projects.
+//
+
+#pragma once
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+class FileSyncBatch;
+struct update_stats;
+
+// widest load any xor kernel makes from the tiled key
+const size_t max_xor_vector_width = 64;
+
+/// <summary>
+/// copy of the key repeated far enough that a full vector can be loaded starting at any key position
+/// </summary>
+class TiledKey
+{
+public:
+    explicit TiledKey(const std::string& key);
+
+    // copying would leave data_ pointing into the other object's inline buffer
+    TiledKey(const TiledKey&) = delete;
+    TiledKey& operator=(const TiledKey&) = delete;
+
+    const char* data() const { return data_; }
+    size_t key_length() const { return key_length_; }
+
+private:
+    size_t key_length_;
+    const char* data_ = nullptr;
+    char inline_[256];
+    std::vector<char> heap_;
+};
+
+// every kernel xors length bytes of source into destination, starting at key position phase.
+// source and destination may be the same buffer.
+typedef void (*xor_kernel)(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase);
+
+void xor_kernel_scalar(const char* source, char* destination, size_t length, const char* tiled_key, size_t key_length, size_t phase);
+
+typedef std::pair<const char*, xor_kernel> named_xor_kernel;
+
+// every xor kernel this machine can run, narrowest first, the widest is the one encrypt_decrypt uses
+std::vector<named_xor_kernel> supported_xor_kernels();
+
+// encrypt or decrypt length bytes from source into destination, source[0] sits at key_offset in the whole stream
+void encrypt_decrypt(const char* source, char* destination, size_t length, const std::string& key, unsigned long long key_offset = 0);
+
+// encrypt or decrypt a caller owned buffer in place
+void encrypt_decrypt(char* data, size_t length, const std::string& key);
+
+// encrypt or decrypt a source string into a new string
+std::string encrypt_decrypt(const std::string& source, const std::string& key);
+
+// read a whole file, an empty string on failure
+std::string read_file(const std::string& filename);
+
+// the first line of the data
+std::string get_student_name(const std::string& string_data);
+
+// a file's student name from its first few KB only, false if it cannot be read or the name line runs past them
+bool read_student_name(const std::string& filename, std::string& student_name);
+
+// write the student name, date, key and data in the text layout, with a crc-32c trailer when the data's crc is given
+bool save_data_file(const std::string& filename, const std::string& student_name, const std::string& key, const std::string& data, FileSyncBatch* sync_batch = nullptr,
+    const unsigned int* data_crc = nullptr);
+
+// encrypt_decrypt that also carries a crc-32c over what it writes, crc is the crc of the output so far
+void encrypt_decrypt_crc32c(const char* source, char* destination, size_t length, const std::string& key, unsigned long long key_offset, unsigned int& crc);
+
+/// <summary>
+/// turns data encrypted with one repeating key into data encrypted with another in a single xor pass, without the
+/// plain text ever existing. byte i is xored with old_key[i % old length] ^ new_key[i % new length], a key that
+/// itself repeats every lcm(old length, new length) bytes, so it is built and tiled once and handed to the
+/// ordinary xor kernels like any other key. when that period is too long to be worth building the same combined keystream is
+/// made a cache sized piece at a time instead.
+/// </summary>
+class Rekey
+{
+public:
+    Rekey(const std::string& old_key, const std::string& new_key);
+
+    // re-key length bytes from source into destination, which may be the same buffer, source[0] sits at offset in the stream
+    void transform(const char* source, char* destination, size_t length, unsigned long long offset) const;
+
+    // bytes after which the combined keystream repeats, 0 if it was too long to build
+    size_t period() const { return period_; }
+
+private:
+    std::string old_key_;
+    std::string new_key_;
+    size_t period_ = 0;
+    std::vector<char> combined_;
+};
+
+// encrypt or decrypt a file of any size into the save_data_file layout chunk_size bytes at a time
+bool stream_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key, size_t chunk_size, bool crc_trailer);
+
+// bring an encrypted file in the stream_data_file layout up to date with its input, rewriting only the blocks that changed
+bool update_data_file(const std::string& input_filename, const std::string& output_filename, const std::string& key, size_t block_size, update_stats* stats);
+
+// ciphers a file can be encrypted with, the value is what a container records
+enum class cipher_id : unsigned char
+{
+    xor_key = 0,
+    aes256_ctr = 1,
+    chacha20 = 2,
+    // chacha20 with a poly1305 tag per segment, see seal_data
+    chacha20_poly1305 = 3,
+};
+
+// binary container layout, all integers little endian:
+//   [0, 128)                  fixed header, see container_header, bytes 64-79 hold the cipher nonce,
+//                             80-83 the compression block size, 88-95 the plain text length of a compressed payload
+//                             and 96-111 the salt of the key fingerprint
+//   [128, 128 + metadata)     metadata: u32 length + student name, u32 length + date (yyyy-mm-dd),
+//                             and when the key was derived from a password, u32 length + kdf_descriptor
+//   zero padding up to payload_offset, a multiple of container_payload_alignment
+//   [payload_offset, + payload_length)  encrypted payload, byte for byte, never newline translated
+const char container_magic[4] = { 'X', 'E', 'N', 'C' };
+const unsigned short container_version = 2;
+const size_t container_header_size = 128;
+// page sized so a reader can map the payload on its own
+const size_t container_payload_alignment = 4096;
+// room for the largest nonce any cipher needs
+const size_t container_nonce_size = 16;
+// salt the key fingerprint is taken with, fresh for every file
+const size_t key_id_salt_size = 16;
+// header flag: the payload was compressed with compress_payload before it was encrypted
+const unsigned int container_flag_compressed = 1;
+// far more than a student name, a date and a kdf descriptor need, so a reader never allocates what a bad header says
+const size_t max_container_metadata_size = 64 * 1024;
+// offsets are handed to seekg, so every byte of the file has to sit below the largest signed 64 bit offset
+const unsigned long long max_container_offset = 0x7fffffffffffffffull;
+
+/// <summary>
+/// fixed size header at the start of every container file
+/// </summary>
+struct container_header
+{
+    unsigned short version = container_version;
+    unsigned short header_size = static_cast<unsigned short>(container_header_size);
+    unsigned int flags = 0;
+    unsigned long long metadata_offset = 0;
+    unsigned long long metadata_length = 0;
+    // identifies which key the payload was encrypted with, the key itself is never stored, see key_fingerprint
+    unsigned long long key_id = 0;
+    char key_salt[key_id_salt_size] = {};
+    unsigned long long payload_offset = 0;
+    unsigned long long payload_length = 0;
+    long long created = 0;
+    // cipher the payload is encrypted with and its nonce, the first cipher_nonce_size bytes are used
+    cipher_id cipher = cipher_id::xor_key;
+    char nonce[container_nonce_size] = {};
+    // with container_flag_compressed, the block size compress_payload used and the length before compression
+    unsigned int compression_block_size = 0;
+    unsigned long long plain_length = 0;
+};
+
+void encode_container_header(const container_header& header, char* out);
+
+// parse and sanity check a container header, false if the bytes are not a container header this version understands
+bool decode_container_header(const char* in, size_t length, container_header& header);
+
+// the metadata block: each field is a u32 length followed by its bytes, the kdf field only when it is not empty
+std::string encode_container_metadata(const std::string& student_name, const std::string& date, const std::string& kdf);
+
+// split a metadata block back into its fields, false if a field runs past the end of the block
+bool decode_container_metadata(const std::string& metadata, std::string& student_name, std::string& date, std::string* kdf);
+
+// read a container's header and metadata, leaving the stream positioned at the start of the payload
+bool read_container_header(std::istream& readFile, container_header& header, std::string& student_name, std::string& date, std::string* kdf);
+
+enum class kdf_id : unsigned char
+{
+    pbkdf2_sha256,
+    scrypt,
+};
+
+// most scrypt table entries a job or a container may ask for is 2^24, checked before the table size is worked out by shifting
+const unsigned int max_scrypt_log2_n = 24;
+
+/// <summary>
+/// which derivation a job uses and how expensive it is made. the defaults follow current guidance for interactive
+/// logins: 600000 pbkdf2 iterations, or scrypt with a 32 MB table
+/// </summary>
+struct kdf_params
+{
+    kdf_id kind = kdf_id::scrypt;
+    unsigned int iterations = 600000;
+    unsigned int scrypt_log2_n = 15;
+    unsigned int scrypt_r = 8;
+    unsigned int scrypt_p = 1;
+};
+
+// parse a job's derivation from "pbkdf2[:iterations]" or "scrypt[:log2 n[:r[:p]]]", false if a cost is out of range
+bool parse_kdf_params(const std::string& text, kdf_params& params);
+
+// the inverse of kdf_descriptor, false if the text is not a descriptor or its costs are out of range
+bool parse_kdf_descriptor(const std::string& descriptor, kdf_params& params, std::string& salt);
+
+// compressed payloads are cut into blocks that are compressed on their own, so a reader only ever needs one block in
+// memory and can decompress each one as soon as it is decrypted. the block size is recorded in the container header
+const size_t default_compression_block_size = 64 * 1024;
+const size_t max_compression_block_size = 4 * 1024 * 1024;
+// each block starts with a u32: the stored length, with the top bit set if the block did not compress and is stored as is
+const unsigned int compressed_block_stored = 0x80000000u;
+
+// most bytes compressing length bytes can take, incompressible input grows by one byte per 255.
+// the extra room lets the compressor copy short literal runs 16 bytes at a time without checking the end
+size_t lz_compress_bound(size_t length);
+
+// compress one block in the lz4 block format into at least lz_compress_bound(length) bytes, returns the compressed length
+size_t lz_compress_block(const char* source, size_t length, char* destination);
+
+// decompress one lz4 block, false if it is malformed or does not decompress to exactly plain_length bytes
+bool lz_decompress_block(const char* source, size_t length, char* destination, size_t plain_length);
+
+// compress a payload block by block ahead of encryption into u32 length words each followed by its block
+std::string compress_payload(const std::string& data, size_t block_size);
+
+/// <summary>
+/// stream buffer that takes compressed payload bytes as they come out of decryption, in pieces of any size, and writes
+/// each block decompressed to output as soon as it is complete. a block that arrives whole in one write is
+/// decompressed straight from there, still hot in cache from being decrypted, only blocks split across writes are copied.
+/// </summary>
+class DecompressingBuffer : public std::streambuf
+{
+public:
+    /// <param name="output">where the plain text goes</param>
+    /// <param name="block_size">block size from the container header</param>
+    /// <param name="plain_length">total plain text length from the container header</param>
+    DecompressingBuffer(std::ostream& output, size_t block_size, unsigned long long plain_length)
+        : output_(output), block_size_(block_size), remaining_(plain_length), plain_(block_size)
+    {
+    }
+
+    // call after the last compressed byte has been written, false if a block was malformed, the payload stopped part
+    // way through a block, or the plain text came out the wrong length
+    bool finish() const
+    {
+        return !failed_ && remaining_ == 0 && word_bytes_ == 0 && output_.good();
+    }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize count) override;
+    int_type overflow(int_type c) override;
+
+private:
+    bool start_block();
+    bool finish_block(const char* block);
+
+    std::ostream& output_;
+    const size_t block_size_;
+    unsigned long long remaining_;
+    std::vector<char> plain_;
+    std::vector<char> block_;
+    char word_[4] = {};
+    size_t word_bytes_ = 0;
+    bool stored_ = false;
+    size_t stored_length_ = 0;
+    size_t plain_length_ = 0;
+    bool failed_ = false;
+};
@@ -0,0 +1,334 @@
+// EncryptionBenchmark.cpp : Google Benchmark suite for the Encryption module.
+//
+// Run with --benchmark_format=json (or --benchmark_out=results.json --benchmark_out_format=json) to keep results
+// for comparing releases. --max_size_mb=N caps the largest payload, the default goes up to 4 GB.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "Encryption.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// every heap allocation in the process is counted so each benchmark can report allocations per call
+static std::atomic<unsigned long long> allocation_count{ 0 };
+
+void* operator new(size_t size)
+{
+    ++allocation_count;
+    if (void* memory = std::malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+// largest payload registered, set from --max_size_mb before the benchmarks are registered
+static int64_t max_payload_size = int64_t{ 4 } * 1024 * 1024 * 1024;
+
+// key lengths covering a single byte, "password", a prime, a full avx-512 vector and a long prime
+static const std::vector<int64_t> key_lengths = { 1, 8, 13, 64, 251 };
+
+std::string make_key(size_t length)
+{
+    if (length == 8)
+    {
+        return "password";
+    }
+    std::string key(length, '\0');
+    for (size_t i = 0; i < length; ++i)
+    {
+        key[i] = static_cast<char>('a' + (i * 7) % 26);
+    }
+    return key;
+}
+
+std::string make_payload(size_t length)
+{
+    std::string payload(length, '\0');
+    for (size_t i = 0; i < length; ++i)
+    {
+        payload[i] = static_cast<char>((i * 131) ^ (i >> 7));
+    }
+    // a first line for get_student_name to find
+    const char name[] = "Sam Student\n";
+    std::memcpy(&payload[0], name, std::min(length, sizeof(name) - 1));
+    return payload;
+}
+
+// record bytes/s and the allocations made per iteration
+void report(benchmark::State& state, unsigned long long allocations_before, size_t bytes_per_call)
+{
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(bytes_per_call));
+    state.counters["allocs_per_call"] = benchmark::Counter(static_cast<double>(allocation_count - allocations_before) / static_cast<double>(state.iterations()));
+}
+
+/// <summary>
+/// drop a file's cached pages so the next read has to go to the device
+/// </summary>
+void evict_from_page_cache(const std::string& filename)
+{
+#if defined(_WIN32)
+    // opening a file without buffering purges its pages from the system cache
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+#else
+    const int file = open(filename.c_str(), O_RDONLY);
+    if (file >= 0)
+    {
+        fdatasync(file);
+        posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+        close(file);
+    }
+#endif
+}
+
+std::string bench_file_name(const char* name)
+{
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// in place transform, args: payload size, key length
+static void BM_encrypt_decrypt_in_place(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const std::string key = make_key(static_cast<size_t>(state.range(1)));
+    std::string data = make_payload(size);
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        encrypt_decrypt(&data[0], data.length(), key);
+        benchmark::DoNotOptimize(data.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, allocations_before, size);
+}
+
+// string to new string, args: payload size, key length
+static void BM_encrypt_decrypt_string(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const std::string key = make_key(static_cast<size_t>(state.range(1)));
+    const std::string data = make_payload(size);
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        std::string output = encrypt_decrypt(data, key);
+        benchmark::DoNotOptimize(output.data());
+    }
+    report(state, allocations_before, size);
+}
+
+// args: payload size
+static void BM_get_student_name(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const std::string data = make_payload(size);
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        std::string name = get_student_name(data);
+        benchmark::DoNotOptimize(name.data());
+    }
+    report(state, allocations_before, size);
+}
+
+// args: payload size, 0 for a warm page cache or 1 for a cold one
+static void BM_read_file(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const bool cold = state.range(1) != 0;
+    const std::string filename = bench_file_name("encryption_bench_read.txt");
+    {
+        const std::string payload = make_payload(size);
+        std::ofstream writeFile(filename, std::ios::out | std::ios::binary);
+        writeFile.write(payload.data(), static_cast<std::streamsize>(payload.length()));
+    }
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        if (cold)
+        {
+            state.PauseTiming();
+            evict_from_page_cache(filename);
+            state.ResumeTiming();
+        }
+        std::string data = read_file(filename);
+        benchmark::DoNotOptimize(data.data());
+    }
+    report(state, allocations_before, size);
+    std::remove(filename.c_str());
+}
+
+// args: payload size, 0 for a warm page cache or 1 for a cold one
+static void BM_student_name_from_file(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const bool cold = state.range(1) != 0;
+    const std::string filename = bench_file_name("encryption_bench_name.txt");
+    {
+        const std::string payload = make_payload(size);
+        std::ofstream writeFile(filename, std::ios::out | std::ios::binary);
+        writeFile.write(payload.data(), static_cast<std::streamsize>(payload.length()));
+    }
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        if (cold)
+        {
+            state.PauseTiming();
+            evict_from_page_cache(filename);
+            state.ResumeTiming();
+        }
+        std::string name;
+        benchmark::DoNotOptimize(read_student_name(filename, name));
+        benchmark::DoNotOptimize(name.data());
+    }
+    report(state, allocations_before, size);
+    std::remove(filename.c_str());
+}
+
+// the same through read_file and get_student_name, which reads the whole file first
+static void BM_student_name_from_whole_file(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const bool cold = state.range(1) != 0;
+    const std::string filename = bench_file_name("encryption_bench_name.txt");
+    {
+        const std::string payload = make_payload(size);
+        std::ofstream writeFile(filename, std::ios::out | std::ios::binary);
+        writeFile.write(payload.data(), static_cast<std::streamsize>(payload.length()));
+    }
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        if (cold)
+        {
+            state.PauseTiming();
+            evict_from_page_cache(filename);
+            state.ResumeTiming();
+        }
+        std::string name = get_student_name(read_file(filename));
+        benchmark::DoNotOptimize(name.data());
+    }
+    report(state, allocations_before, size);
+    std::remove(filename.c_str());
+}
+
+// args: payload size, 0 to overwrite a cached file or 1 to write a new file each time
+static void BM_save_data_file(benchmark::State& state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const bool cold = state.range(1) != 0;
+    const std::string filename = bench_file_name("encryption_bench_save.txt");
+    const std::string data = make_payload(size);
+    const std::string key = "password";
+
+    const unsigned long long allocations_before = allocation_count;
+    for (auto _ : state)
+    {
+        if (cold)
+        {
+            state.PauseTiming();
+            evict_from_page_cache(filename);
+            std::remove(filename.c_str());
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(save_data_file(filename, "Sam Student", key, data));
+    }
+    report(state, allocations_before, size);
+    std::remove(filename.c_str());
+}
+
+// 64 B up to the maximum in steps of 16x, plus the maximum itself
+std::vector<int64_t> payload_sizes(int64_t largest)
+{
+    std::vector<int64_t> sizes;
+    for (int64_t size = 64; size < largest; size *= 16)
+    {
+        sizes.push_back(size);
+    }
+    sizes.push_back(largest);
+    return sizes;
+}
+
+void register_benchmarks()
+{
+    const std::vector<int64_t> sizes = payload_sizes(max_payload_size);
+    // the string overload holds two copies and the file benchmarks also need the disk space, so they stop sooner
+    const std::vector<int64_t> copy_sizes = payload_sizes(std::min<int64_t>(max_payload_size, int64_t{ 1024 } * 1024 * 1024));
+
+    benchmark::RegisterBenchmark("encrypt_decrypt/in_place", BM_encrypt_decrypt_in_place)->ArgsProduct({ sizes, key_lengths })->ArgNames({ "bytes", "key" });
+    benchmark::RegisterBenchmark("encrypt_decrypt/string", BM_encrypt_decrypt_string)->ArgsProduct({ copy_sizes, key_lengths })->ArgNames({ "bytes", "key" });
+    benchmark::RegisterBenchmark("get_student_name", BM_get_student_name)->ArgsProduct({ copy_sizes })->ArgNames({ "bytes" });
+    benchmark::RegisterBenchmark("student_name/prefix", BM_student_name_from_file)->ArgsProduct({ copy_sizes, { 0, 1 } })->ArgNames({ "bytes", "cold" })->UseRealTime();
+    benchmark::RegisterBenchmark("student_name/whole_file", BM_student_name_from_whole_file)->ArgsProduct({ copy_sizes, { 0, 1 } })->ArgNames({ "bytes", "cold" })->UseRealTime();
+    benchmark::RegisterBenchmark("read_file", BM_read_file)->ArgsProduct({ copy_sizes, { 0, 1 } })->ArgNames({ "bytes", "cold" })->UseRealTime();
+    benchmark::RegisterBenchmark("save_data_file", BM_save_data_file)->ArgsProduct({ copy_sizes, { 0, 1 } })->ArgNames({ "bytes", "cold" })->UseRealTime();
+}
+
+int main(int argc, char** argv)
+{
+    // pull out our own option before google benchmark sees the arguments
+    std::vector<char*> arguments;
+    const std::string max_size_option = "--max_size_mb=";
+    for (int i = 0; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], max_size_option.c_str(), max_size_option.length()) == 0)
+        {
+            max_payload_size = std::max<int64_t>(64, std::atoll(argv[i] + max_size_option.length()) * 1024 * 1024);
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
+    }
+    int argument_count = static_cast<int>(arguments.size());
+
+    register_benchmarks();
+    benchmark::Initialize(&argument_count, arguments.data());
+    if (benchmark::ReportUnrecognizedArguments(argument_count, arguments.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
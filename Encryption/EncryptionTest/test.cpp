@@ -0,0 +1,896 @@
+// test.cpp : tests for the Encryption program, known answers for its ciphers and hashes and its fast paths checked
+// against the plain ones they replace.
+//
+
+#include "pch.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Crypto.h"
+#include "Encryption.h"
+
+// lower case hex of a byte string, so digests compare against the published vectors as written
+std::string hex(const void* data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    std::string text;
+    for (size_t i = 0; i < length; ++i)
+    {
+        text += digits[bytes[i] >> 4];
+        text += digits[bytes[i] & 0x0f];
+    }
+    return text;
+}
+
+std::string hex(const std::string& bytes)
+{
+    return hex(bytes.data(), bytes.length());
+}
+
+// the same pseudo random bytes every run, so a failure can be reproduced
+std::string random_bytes(size_t length, unsigned int seed)
+{
+    std::mt19937 random(seed);
+    std::string bytes(length, '\0');
+    for (char& c : bytes)
+    {
+        c = static_cast<char>(random());
+    }
+    return bytes;
+}
+
+// the loop encrypt_decrypt ran before the vector kernels, every xor path must give exactly its bytes
+std::string xor_reference(const std::string& source, const std::string& key, unsigned long long key_offset)
+{
+    std::string output(source.length(), '\0');
+    for (size_t i = 0; i < source.length(); ++i)
+    {
+        output[i] = source[i] ^ key[(key_offset + i) % key.length()];
+    }
+    return output;
+}
+
+// key lengths either side of each vector width, and of the longest key TiledKey keeps on the stack
+const size_t xor_key_lengths[] = { 1, 2, 3, 7, 8, 13, 15, 16, 17, 31, 32, 33, 63, 64, 65, 193, 194, 255, 256, 257, 1000 };
+
+// the tiled key repeats the key far enough for the widest vector load from its last position
+TEST(TiledKeyTest, RepeatsKey)
+{
+    for (const size_t key_length : xor_key_lengths)
+    {
+        const std::string key = random_bytes(key_length, 20);
+        const TiledKey tiled(key);
+        ASSERT_EQ(tiled.key_length(), key_length);
+        for (size_t i = 0; i < key_length + max_xor_vector_width - 1; ++i)
+        {
+            ASSERT_EQ(tiled.data()[i], key[i % key_length]) << "key length " << key_length << " at " << i;
+        }
+    }
+}
+
+// every kernel must match the byte loop from any key position, with lengths that leave a tail after the last vector
+TEST(XorKernelTest, KernelsMatchByteLoop)
+{
+    const std::string source = random_bytes(1000, 21);
+    for (const size_t key_length : xor_key_lengths)
+    {
+        const std::string key = random_bytes(key_length, 22);
+        const TiledKey tiled(key);
+        for (const size_t phase : { size_t(0), 1 % key_length, key_length / 2, key_length - 1 })
+        {
+            const std::string expected = xor_reference(source, key, phase);
+            for (const named_xor_kernel& kernel : supported_xor_kernels())
+            {
+                for (const size_t length : { size_t(0), size_t(1), size_t(15), size_t(16), size_t(17), size_t(63), size_t(64), size_t(65),
+                    size_t(127), source.length() })
+                {
+                    std::string output(length, '\0');
+                    kernel.second(source.data(), &output[0], length, tiled.data(), key_length, phase);
+                    ASSERT_EQ(output, expected.substr(0, length))
+                        << kernel.first << ", key length " << key_length << ", phase " << phase << ", length " << length;
+                }
+            }
+        }
+    }
+}
+
+// source and destination may be the same buffer
+TEST(XorKernelTest, InPlace)
+{
+    const std::string source = random_bytes(1000, 23);
+    const std::string key = random_bytes(13, 24);
+    const TiledKey tiled(key);
+    const std::string expected = xor_reference(source, key, 5);
+    for (const named_xor_kernel& kernel : supported_xor_kernels())
+    {
+        std::string data = source;
+        kernel.second(data.data(), &data[0], data.length(), tiled.data(), key.length(), 5);
+        ASSERT_EQ(data, expected) << kernel.first;
+    }
+}
+
+// encrypt_decrypt takes the widest kernel, or the byte loop below one vector, and both must start at key_offset
+TEST(XorKernelTest, EncryptDecryptAtOffsets)
+{
+    const std::string source = random_bytes(1000, 25);
+    for (const std::string& key : { std::string("password"), random_bytes(13, 26), random_bytes(300, 27) })
+    {
+        for (const unsigned long long key_offset : { 0ull, 5ull, 12345678901ull })
+        {
+            for (const size_t length : { size_t(1), max_xor_vector_width - 1, max_xor_vector_width, source.length() })
+            {
+                std::string output(length, '\0');
+                encrypt_decrypt(source.data(), &output[0], length, key, key_offset);
+                ASSERT_EQ(output, xor_reference(source.substr(0, length), key, key_offset))
+                    << "key length " << key.length() << ", offset " << key_offset << ", length " << length;
+            }
+        }
+    }
+}
+
+// a header for a container with a 40 byte metadata block and a 1000 byte payload on the next page
+container_header valid_container_header()
+{
+    container_header header;
+    header.metadata_offset = container_header_size;
+    header.metadata_length = 40;
+    header.payload_offset = container_payload_alignment;
+    header.payload_length = 1000;
+    return header;
+}
+
+// decode a header with one 64 bit field overwritten, as a damaged or hostile file would have it
+bool decode_with_field(unsigned long long value, size_t at)
+{
+    char raw[container_header_size];
+    encode_container_header(valid_container_header(), raw);
+    put_le(raw + at, value, 8);
+    container_header header;
+    return decode_container_header(raw, sizeof(raw), header);
+}
+
+// byte offsets of the header fields the bound checks look at
+const size_t metadata_offset_at = 16;
+const size_t metadata_length_at = 24;
+const size_t payload_offset_at = 40;
+const size_t payload_length_at = 48;
+
+// every field comes back as it was written
+TEST(ContainerTest, HeaderRoundTrip)
+{
+    container_header written = valid_container_header();
+    written.flags = container_flag_compressed;
+    written.key_id = 0x0123456789abcdefull;
+    written.created = 1700000000;
+    written.cipher = cipher_id::chacha20_poly1305;
+    written.compression_block_size = 64 * 1024;
+    written.plain_length = 123456789;
+    for (size_t i = 0; i < container_nonce_size; ++i)
+    {
+        written.nonce[i] = static_cast<char>(i + 1);
+    }
+    for (size_t i = 0; i < key_id_salt_size; ++i)
+    {
+        written.key_salt[i] = static_cast<char>(0xf0 - i);
+    }
+
+    char raw[container_header_size];
+    encode_container_header(written, raw);
+    container_header read;
+    ASSERT_TRUE(decode_container_header(raw, sizeof(raw), read));
+    ASSERT_EQ(read.version, written.version);
+    ASSERT_EQ(read.header_size, written.header_size);
+    ASSERT_EQ(read.flags, written.flags);
+    ASSERT_EQ(read.metadata_offset, written.metadata_offset);
+    ASSERT_EQ(read.metadata_length, written.metadata_length);
+    ASSERT_EQ(read.key_id, written.key_id);
+    ASSERT_EQ(read.payload_offset, written.payload_offset);
+    ASSERT_EQ(read.payload_length, written.payload_length);
+    ASSERT_EQ(read.created, written.created);
+    ASSERT_EQ(read.cipher, written.cipher);
+    ASSERT_EQ(read.compression_block_size, written.compression_block_size);
+    ASSERT_EQ(read.plain_length, written.plain_length);
+    ASSERT_EQ(std::memcmp(read.nonce, written.nonce, container_nonce_size), 0);
+    ASSERT_EQ(std::memcmp(read.key_salt, written.key_salt, key_id_salt_size), 0);
+}
+
+// fewer bytes than a whole header, or the wrong magic, is not a container
+TEST(ContainerTest, HeaderTruncatedOrNotAContainer)
+{
+    char raw[container_header_size];
+    encode_container_header(valid_container_header(), raw);
+    container_header header;
+    ASSERT_FALSE(decode_container_header(raw, container_header_size - 1, header));
+    raw[0] = 'Y';
+    ASSERT_FALSE(decode_container_header(raw, sizeof(raw), header));
+}
+
+// offsets and lengths whose sums wrap past 2^64 must not slip through the bound checks
+TEST(ContainerTest, HeaderWrappingOffsets)
+{
+    char raw[container_header_size];
+    container_header header = valid_container_header();
+    header.metadata_offset = 0 - 0x80ull;
+    header.metadata_length = 0x100;
+    header.payload_offset = 0x80;
+    encode_container_header(header, raw);
+    ASSERT_FALSE(decode_container_header(raw, sizeof(raw), header));
+
+    ASSERT_FALSE(decode_with_field(0 - 100ull, payload_length_at));
+    ASSERT_FALSE(decode_with_field(0 - 4096ull, payload_offset_at));
+    ASSERT_FALSE(decode_with_field(container_payload_alignment + 1, metadata_offset_at));
+    ASSERT_FALSE(decode_with_field(container_payload_alignment, metadata_length_at));
+}
+
+// a metadata block far bigger than any real one is refused before anything is allocated for it
+TEST(ContainerTest, HeaderOversizedLengths)
+{
+    char raw[container_header_size];
+    container_header header = valid_container_header();
+    header.payload_offset = 1ull << 41;
+    header.metadata_length = max_container_metadata_size;
+    encode_container_header(header, raw);
+    ASSERT_TRUE(decode_container_header(raw, sizeof(raw), header));
+
+    put_le(raw + metadata_length_at, max_container_metadata_size + 1, 8);
+    ASSERT_FALSE(decode_container_header(raw, sizeof(raw), header));
+    put_le(raw + metadata_length_at, 1ull << 40, 8);
+    ASSERT_FALSE(decode_container_header(raw, sizeof(raw), header));
+
+    ASSERT_TRUE(decode_with_field(max_container_offset - container_payload_alignment, payload_length_at));
+    ASSERT_FALSE(decode_with_field(max_container_offset - container_payload_alignment + 1, payload_length_at));
+}
+
+// the metadata fields come back as they were written, with and without a kdf descriptor
+TEST(ContainerTest, MetadataRoundTrip)
+{
+    for (const std::string& kdf : { std::string(), std::string("scrypt:15:8:1:salt") })
+    {
+        const std::string metadata = encode_container_metadata("Sam Student", "2024-01-31", kdf);
+        std::string student_name;
+        std::string date;
+        std::string read_kdf = "left over";
+        ASSERT_TRUE(decode_container_metadata(metadata, student_name, date, &read_kdf));
+        ASSERT_EQ(student_name, "Sam Student");
+        ASSERT_EQ(date, "2024-01-31");
+        ASSERT_EQ(read_kdf, kdf);
+    }
+}
+
+// a block cut short anywhere inside a field is refused, only a cut right after the date is a block without a kdf field
+TEST(ContainerTest, MetadataTruncated)
+{
+    const std::string metadata = encode_container_metadata("Sam Student", "2024-01-31", "pbkdf2:600000:salt");
+    const size_t date_end = 4 + 11 + 4 + 10;
+    for (size_t length = 0; length < metadata.length(); ++length)
+    {
+        std::string student_name;
+        std::string date;
+        std::string kdf;
+        ASSERT_EQ(decode_container_metadata(metadata.substr(0, length), student_name, date, &kdf), length == date_end) << "length " << length;
+    }
+}
+
+// the whole file as save_container_file lays it out: header, metadata, padding, payload
+std::string container_bytes(const container_header& header, const std::string& metadata, const std::string& payload)
+{
+    std::string bytes(static_cast<size_t>(header.payload_offset), '\0');
+    encode_container_header(header, &bytes[0]);
+    bytes.replace(static_cast<size_t>(header.metadata_offset), metadata.length(), metadata);
+    return bytes + payload;
+}
+
+// reading the header and metadata leaves the stream at the payload
+TEST(ContainerTest, ReadHeaderFindsPayload)
+{
+    const std::string metadata = encode_container_metadata("Sam Student", "2024-01-31", "");
+    container_header written = valid_container_header();
+    written.metadata_length = metadata.length();
+    const std::string payload = random_bytes(1000, 30);
+    std::istringstream input(container_bytes(written, metadata, payload));
+
+    container_header header;
+    std::string student_name;
+    std::string date;
+    ASSERT_TRUE(read_container_header(input, header, student_name, date, nullptr));
+    ASSERT_EQ(student_name, "Sam Student");
+    ASSERT_EQ(date, "2024-01-31");
+    ASSERT_EQ(static_cast<unsigned long long>(input.tellg()), written.payload_offset);
+    std::string read_payload(payload.length(), '\0');
+    ASSERT_TRUE(input.read(&read_payload[0], static_cast<std::streamsize>(read_payload.length())));
+    ASSERT_EQ(read_payload, payload);
+}
+
+// a file cut off inside the header or the metadata, or with metadata that does not parse, is refused
+TEST(ContainerTest, ReadHeaderMalformed)
+{
+    const std::string metadata = encode_container_metadata("Sam Student", "2024-01-31", "");
+    container_header written = valid_container_header();
+    written.metadata_length = metadata.length();
+    const std::string bytes = container_bytes(written, metadata, random_bytes(1000, 31));
+
+    container_header header;
+    std::string student_name;
+    std::string date;
+    for (const size_t length : { size_t(0), container_header_size - 1, container_header_size + metadata.length() - 1 })
+    {
+        std::istringstream input(bytes.substr(0, length));
+        ASSERT_FALSE(read_container_header(input, header, student_name, date, nullptr)) << "length " << length;
+    }
+
+    // a metadata length three bytes past the date takes in part of the padding, half a length prefix
+    written.metadata_length = metadata.length() + 3;
+    std::istringstream short_field(container_bytes(written, metadata, ""));
+    ASSERT_FALSE(read_container_header(short_field, header, student_name, date, nullptr));
+}
+
+// FIPS 197 appendix C.3
+TEST(AesTest, KnownAnswer)
+{
+    unsigned char key[32];
+    unsigned char blocks[64] = {};
+    for (int i = 0; i < 32; ++i)
+    {
+        key[i] = static_cast<unsigned char>(i);
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        blocks[i] = static_cast<unsigned char>(i * 0x11);
+    }
+    aes256_key expanded;
+    aes256_set_key(key, expanded);
+    aes256_encrypt_4_blocks_soft(expanded.planes, blocks);
+    ASSERT_EQ(hex(blocks, 16), "8ea2b7ca516745bfeafc49904b496089");
+}
+
+// the same appendix C.3 block through each counter mode kernel: nonce 0011..77 at block 8899..ff is the plaintext
+// block, so one block of keystream is its ciphertext
+TEST(AesTest, CounterKernelsKnownAnswer)
+{
+    unsigned char key[32];
+    for (int i = 0; i < 32; ++i)
+    {
+        key[i] = static_cast<unsigned char>(i);
+    }
+    aes256_key expanded;
+    aes256_set_key(key, expanded);
+    const unsigned char nonce[aes_ctr_nonce_size] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 };
+
+    std::vector<named_aes_kernel> kernels = { named_aes_kernel("software", aes256_ctr_blocks_soft) };
+    if (host_cpu_features().aesni)
+    {
+        kernels.emplace_back("aes-ni", aes256_ctr_blocks_aesni);
+    }
+    for (const named_aes_kernel& kernel : kernels)
+    {
+        const char zeros[aes_block_size] = {};
+        char keystream[aes_block_size];
+        kernel.second(expanded, nonce, 0x8899aabbccddeeffull, zeros, keystream, 1);
+        ASSERT_EQ(hex(keystream, sizeof(keystream)), "8ea2b7ca516745bfeafc49904b496089") << kernel.first;
+    }
+}
+
+// aes-ni must agree with the software rounds, starting part way through a block
+TEST(AesTest, KernelsAgree)
+{
+    if (!host_cpu_features().aesni)
+    {
+        return;
+    }
+    const unsigned char key[32] =
+    {
+        0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+        0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+    };
+    aes256_key expanded;
+    aes256_set_key(key, expanded);
+    const unsigned char nonce[aes_ctr_nonce_size] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    const std::string source = random_bytes(100003, 5);
+    std::string software(source.length(), '\0');
+    std::string aesni(source.length(), '\0');
+    aes256_ctr_transform(expanded, nonce, source.data(), &software[0], source.length(), 5, aes256_ctr_blocks_soft);
+    aes256_ctr_transform(expanded, nonce, source.data(), &aesni[0], source.length(), 5, aes256_ctr_blocks_aesni);
+    ASSERT_EQ(aesni, software);
+}
+
+// RFC 8439 section 2.4.2: its 96 bit nonce 00000000 0000004a 00000000 with counter 1 is
+// block 1 of the 64 bit counter layout with nonce 0000004a 00000000
+TEST(ChaCha20Test, KnownAnswer)
+{
+    unsigned char key[32];
+    for (int i = 0; i < 32; ++i)
+    {
+        key[i] = static_cast<unsigned char>(i);
+    }
+    const unsigned char nonce[chacha_nonce_size] = { 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+    chacha_state state;
+    chacha_initial_state(key, nonce, state);
+    const std::string sunscreen = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    const std::string expected =
+        "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+        "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d";
+
+    for (const named_chacha_kernel& kernel : supported_chacha_kernels())
+    {
+        std::string output(sunscreen.length(), '\0');
+        chacha20_transform(state, sunscreen.data(), &output[0], sunscreen.length(), chacha_block_size, kernel.second);
+        ASSERT_EQ(hex(output), expected) << kernel.first;
+    }
+}
+
+// the vector kernels must match the scalar one, from an odd offset and with a counter that carries into its high word
+TEST(ChaCha20Test, KernelsAgree)
+{
+    unsigned char key[cipher_key_size];
+    cipher_key_from_string("password", key);
+    const unsigned char nonce[chacha_nonce_size] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    chacha_state state;
+    chacha_initial_state(key, nonce, state);
+    const std::string source = random_bytes(100003, 6);
+    const unsigned long long offset = 0xfffffffcull * chacha_block_size + 5;
+
+    std::string expected(source.length(), '\0');
+    chacha20_transform(state, source.data(), &expected[0], source.length(), offset, chacha_blocks_scalar);
+    for (const named_chacha_kernel& kernel : supported_chacha_kernels())
+    {
+        std::string output(source.length(), '\0');
+        chacha20_transform(state, source.data(), &output[0], source.length(), offset, kernel.second);
+        ASSERT_EQ(output, expected) << kernel.first;
+    }
+}
+
+// RFC 8439 section 2.5.2, fed in two uneven pieces
+TEST(Poly1305Test, KnownAnswer)
+{
+    const unsigned char key[32] =
+    {
+        0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+        0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+    };
+    const std::string message = "Cryptographic Forum Research Group";
+    Poly1305 poly(key);
+    poly.update(message.data(), 5);
+    poly.update(message.data() + 5, message.length() - 5);
+    unsigned char tag[Poly1305::tag_size];
+    poly.finish(tag);
+    ASSERT_EQ(hex(tag, sizeof(tag)), "a8061dc1305136c6c22b8baf0c0127a9");
+}
+
+// shared data for the chacha20-poly1305 tests: a payload of a little over three segments, sealed once
+class SealedTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        plain = random_bytes(3 * sealed_segment_size + 1000, 7);
+        sealed = seal_data(plain, key, nonce);
+    }
+
+    // open a sealed payload, the plain text that was let through goes to opened
+    bool open(const std::string& payload, std::string& opened, unsigned long long& failed_segment)
+    {
+        std::istringstream input(payload);
+        std::ostringstream output;
+        const bool ok = open_sealed_stream(input, payload.length(), output, key, nonce, failed_segment);
+        opened = output.str();
+        return ok;
+    }
+
+    const std::string key = "password";
+    const std::string nonce = std::string("\x01\x02\x03\x04\x05\x06\x07\x08", chacha_nonce_size);
+    std::string plain;
+    std::string sealed;
+};
+
+// a sealed payload opens back to what was sealed
+TEST_F(SealedTest, RoundTrip)
+{
+    ASSERT_EQ(sealed.length(), sealed_length(plain.length()));
+    std::string opened;
+    unsigned long long failed_segment = 0;
+    ASSERT_TRUE(open(sealed, opened, failed_segment));
+    ASSERT_EQ(opened, plain);
+}
+
+// one flipped bit in the second segment stops the read there, with only the first segment let through
+TEST_F(SealedTest, TamperStopsAtSegment)
+{
+    sealed[sealed_segment_size + Poly1305::tag_size + 7] ^= 1;
+    std::string opened;
+    unsigned long long failed_segment = 0;
+    ASSERT_FALSE(open(sealed, opened, failed_segment));
+    ASSERT_EQ(failed_segment, 1u);
+    ASSERT_EQ(opened, plain.substr(0, sealed_segment_size));
+}
+
+// dropping the last segment leaves a payload of a valid length, but the new last segment was not sealed as the last
+TEST_F(SealedTest, TruncationFails)
+{
+    const std::string truncated = sealed.substr(0, 3 * (sealed_segment_size + Poly1305::tag_size));
+    std::string opened;
+    unsigned long long failed_segment = 0;
+    ASSERT_FALSE(open(truncated, opened, failed_segment));
+    ASSERT_EQ(failed_segment, 2u);
+}
+
+// decompress a compressed payload through DecompressingBuffer, written in pieces of piece bytes, 0 for one write
+bool decompress_payload(const std::string& compressed, size_t block_size, unsigned long long plain_length, size_t piece, std::string& plain)
+{
+    std::ostringstream output;
+    DecompressingBuffer buffer(output, block_size, plain_length);
+    std::ostream stream(&buffer);
+    for (size_t done = 0; done < compressed.length();)
+    {
+        const size_t length = piece == 0 ? compressed.length() : std::min(piece, compressed.length() - done);
+        stream.write(compressed.data() + done, static_cast<std::streamsize>(length));
+        done += length;
+    }
+    plain = output.str();
+    return buffer.finish();
+}
+
+// text that compresses well, with matches near and far and runs that overlap themselves
+std::string compressible_bytes(size_t length)
+{
+    static const char* const words[] = { "student ", "name ", "encryption ", "aaaaaaaaaaaaaaaaaaaa", "2024-01-31\n", "key " };
+    std::mt19937 random(40);
+    std::string text;
+    while (text.length() < length)
+    {
+        text += words[random() % (sizeof(words) / sizeof(words[0]))];
+    }
+    text.resize(length);
+    return text;
+}
+
+// blocks of every length around the format's end of block limits come back as they went in
+TEST(CompressionTest, BlockRoundTrip)
+{
+    for (const size_t length : { size_t(0), size_t(1), size_t(4), size_t(12), size_t(13), size_t(17), size_t(100), size_t(4096), size_t(70000) })
+    {
+        for (const std::string& data : { compressible_bytes(length), random_bytes(length, 41), std::string(length, 'x') })
+        {
+            std::vector<char> compressed(lz_compress_bound(length));
+            const size_t compressed_length = lz_compress_block(data.data(), length, compressed.data());
+            ASSERT_LE(compressed_length, compressed.size());
+            std::string plain(length, '\0');
+            ASSERT_TRUE(lz_decompress_block(compressed.data(), compressed_length, &plain[0], length)) << "length " << length;
+            ASSERT_EQ(plain, data) << "length " << length;
+        }
+    }
+}
+
+// whole payloads come back through DecompressingBuffer however the decrypted bytes are cut into writes
+TEST(CompressionTest, PayloadRoundTrip)
+{
+    const std::string text = compressible_bytes(300000);
+    const std::string noise = random_bytes(100000, 42);
+    for (const std::string& data : { std::string(), text, noise, text.substr(0, 5000) + noise + text })
+    {
+        for (const size_t block_size : { size_t(1024), default_compression_block_size })
+        {
+            const std::string compressed = compress_payload(data, block_size);
+            for (const size_t piece : { size_t(0), size_t(1), size_t(3), size_t(1000), size_t(70000) })
+            {
+                std::string plain;
+                ASSERT_TRUE(decompress_payload(compressed, block_size, data.length(), piece, plain))
+                    << "length " << data.length() << ", block size " << block_size << ", piece " << piece;
+                ASSERT_EQ(plain, data);
+            }
+        }
+    }
+}
+
+// a block that does not get smaller is stored as it is, behind its length word
+TEST(CompressionTest, IncompressibleBlocksAreStored)
+{
+    const std::string noise = random_bytes(10000, 43);
+    const std::string compressed = compress_payload(noise, 4096);
+    ASSERT_EQ(compressed.length(), noise.length() + 3 * 4);
+    ASSERT_EQ(get_le(compressed.data(), 4), 4096u | compressed_block_stored);
+}
+
+// hand made blocks that break the format in each way a decoder has to check, none may decode
+TEST(CompressionTest, MalformedBlocksFail)
+{
+    struct malformed
+    {
+        const char* what;
+        std::string block;
+        size_t plain_length;
+    };
+    const malformed blocks[] =
+    {
+        { "match offset before the block start", std::string("\x10" "a" "\x02\x00", 4) + std::string(1, '\0'), 6 },
+        { "match offset of zero", std::string("\x10" "a" "\x00\x00", 4) + std::string(1, '\0'), 6 },
+        { "literals past plain_length", std::string("\x50" "abcde", 6), 3 },
+        { "match past plain_length", std::string("\x1f" "a" "\x01\x00" "\x10", 5), 10 },
+        { "literals past the end of the block", std::string("\x50" "ab", 3), 5 },
+        { "extended length cut off", std::string("\xf0", 1), 20 },
+        { "extended length cut off after a 255", std::string("\xf0\xff", 2), 300 },
+        { "offset cut off", std::string("\x10" "a" "\x01", 3), 6 },
+        { "fewer bytes than plain_length", std::string("\x30" "abc", 4), 5 },
+    };
+    for (const malformed& bad : blocks)
+    {
+        // room for a few bytes more than plain_length, none of which may be touched
+        std::string plain(bad.plain_length + 16, '\x7e');
+        ASSERT_FALSE(lz_decompress_block(bad.block.data(), bad.block.length(), &plain[0], bad.plain_length)) << bad.what;
+        ASSERT_EQ(plain.substr(bad.plain_length), std::string(16, '\x7e')) << bad.what;
+    }
+}
+
+// every block cut short of its end is refused
+TEST(CompressionTest, TruncatedBlocksFail)
+{
+    const std::string data = compressible_bytes(5000);
+    std::vector<char> compressed(lz_compress_bound(data.length()));
+    const size_t compressed_length = lz_compress_block(data.data(), data.length(), compressed.data());
+    std::string plain(data.length(), '\0');
+    for (size_t length = 0; length < compressed_length; ++length)
+    {
+        ASSERT_FALSE(lz_decompress_block(compressed.data(), length, &plain[0], data.length())) << "length " << length;
+    }
+}
+
+// length words that do not fit the blocks they announce, and payloads that end early or run on, are refused
+TEST(CompressionTest, MalformedPayloadsFail)
+{
+    const size_t block_size = 4096;
+    const std::string data = compressible_bytes(10000);
+    const std::string compressed = compress_payload(data, block_size);
+    std::string plain;
+
+    std::string oversized = compressed;
+    put_le(&oversized[0], lz_compress_bound(block_size) + 1, 4);
+    ASSERT_FALSE(decompress_payload(oversized, block_size, data.length(), 0, plain));
+
+    std::string stored_wrong_length = compressed;
+    put_le(&stored_wrong_length[0], (block_size - 1) | compressed_block_stored, 4);
+    ASSERT_FALSE(decompress_payload(stored_wrong_length, block_size, data.length(), 0, plain));
+
+    ASSERT_FALSE(decompress_payload(compressed.substr(0, compressed.length() - 1), block_size, data.length(), 0, plain));
+    ASSERT_FALSE(decompress_payload(compressed.substr(0, compressed.length() - 1), block_size, data.length(), 1, plain));
+    ASSERT_FALSE(decompress_payload(compressed, block_size, data.length() + 1, 0, plain));
+    ASSERT_FALSE(decompress_payload(compressed, block_size, data.length() - 1, 0, plain));
+    ASSERT_FALSE(decompress_payload(compressed + std::string("\x01\x00\x00\x00" "a", 5), block_size, data.length(), 0, plain));
+}
+
+// FIPS 180-4 examples
+TEST(Sha256Test, KnownAnswers)
+{
+    unsigned char digest[Sha256::digest_size];
+    sha256("", 0, digest);
+    ASSERT_EQ(hex(digest, sizeof(digest)), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    sha256("abc", 3, digest);
+    ASSERT_EQ(hex(digest, sizeof(digest)), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    const std::string two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    sha256(two_blocks.data(), two_blocks.length(), digest);
+    ASSERT_EQ(hex(digest, sizeof(digest)), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+// feeding the hash in uneven pieces must give the same digest as one call
+TEST(Sha256Test, PiecesMatchOneCall)
+{
+    const std::string data = random_bytes(10000, 1);
+    unsigned char whole[Sha256::digest_size];
+    sha256(data.data(), data.length(), whole);
+
+    Sha256 hash;
+    for (size_t done = 0, piece = 1; done < data.length(); done += piece, piece = piece * 3 % 257 + 1)
+    {
+        hash.update(data.data() + done, std::min(piece, data.length() - done));
+    }
+    unsigned char pieces[Sha256::digest_size];
+    hash.finish(pieces);
+    ASSERT_EQ(hex(pieces, sizeof(pieces)), hex(whole, sizeof(whole)));
+}
+
+// RFC 4231 test cases 2 and 6, a short key and one longer than a block
+TEST(HmacSha256Test, KnownAnswers)
+{
+    unsigned char digest[Sha256::digest_size];
+    const std::string message = "what do ya want for nothing?";
+    HmacSha256("Jefe").mac(message.data(), message.length(), digest);
+    ASSERT_EQ(hex(digest, sizeof(digest)), "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+
+    const std::string long_message = "Test Using Larger Than Block-Size Key - Hash Key First";
+    HmacSha256(std::string(131, '\xaa')).mac(long_message.data(), long_message.length(), digest);
+    ASSERT_EQ(hex(digest, sizeof(digest)), "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+}
+
+// RFC 7914 section 11
+TEST(KdfTest, Pbkdf2KnownAnswer)
+{
+    ASSERT_EQ(hex(pbkdf2_sha256("passwd", "salt", 1, 64)),
+        "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783");
+}
+
+// RFC 7914 section 12
+TEST(KdfTest, ScryptKnownAnswers)
+{
+    ASSERT_EQ(hex(scrypt("", "", 4, 1, 1, 64)),
+        "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906");
+    ASSERT_EQ(hex(scrypt("password", "NaCl", 10, 8, 16, 64)),
+        "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640");
+}
+
+TEST(KdfTest, ParseParamsBoundsCosts)
+{
+    kdf_params params;
+    ASSERT_TRUE(parse_kdf_params("scrypt:14:8:1", params));
+    ASSERT_TRUE(params.kind == kdf_id::scrypt);
+    ASSERT_EQ(params.scrypt_log2_n, 14u);
+    ASSERT_TRUE(parse_kdf_params("pbkdf2:1000", params));
+    ASSERT_TRUE(params.kind == kdf_id::pbkdf2_sha256);
+    ASSERT_EQ(params.iterations, 1000u);
+
+    // costs whose table size would overflow the shift or wrap to a small number
+    ASSERT_FALSE(parse_kdf_params("scrypt:62", params));
+    ASSERT_FALSE(parse_kdf_params("scrypt:64", params));
+    ASSERT_FALSE(parse_kdf_params("scrypt:99:1:1", params));
+    ASSERT_FALSE(parse_kdf_params("scrypt:25:8", params));
+    ASSERT_FALSE(parse_kdf_params("scrypt:0", params));
+    ASSERT_FALSE(parse_kdf_params("pbkdf2:0", params));
+
+    std::string salt;
+    ASSERT_TRUE(parse_kdf_descriptor("scrypt$15$8$1$00ff", params, salt));
+    ASSERT_EQ(salt, std::string("\x00\xff", 2));
+    ASSERT_FALSE(parse_kdf_descriptor("scrypt$62$1$1$00ff", params, salt));
+}
+
+// the fused re-key pass must give the same bytes as decrypting with the old key and encrypting with the new one, for
+// combined periods that are short, long, and too long to build
+TEST(RekeyTest, MatchesDecryptThenEncrypt)
+{
+    const std::string original = random_bytes(1000003, 8);
+    const std::pair<size_t, size_t> key_lengths[] = { { 8, 8 }, { 8, 13 }, { 61, 64 }, { 509, 503 }, { 1021, 1019 } };
+    unsigned int seed = 100;
+    for (const auto& lengths : key_lengths)
+    {
+        const std::string old_key = random_bytes(lengths.first, ++seed);
+        const std::string new_key = random_bytes(lengths.second, ++seed);
+        for (const unsigned long long offset : { 0ull, 12345ull })
+        {
+            std::string two_pass(original.length(), '\0');
+            encrypt_decrypt(original.data(), &two_pass[0], original.length(), old_key, offset);
+            encrypt_decrypt(two_pass.data(), &two_pass[0], two_pass.length(), new_key, offset);
+
+            std::string fused(original.length(), '\0');
+            Rekey(old_key, new_key).transform(original.data(), &fused[0], original.length(), offset);
+            ASSERT_EQ(fused, two_pass) << "keys " << lengths.first << " -> " << lengths.second << " at offset " << offset;
+        }
+    }
+}
+
+// files for the update tests go in a scratch directory of their own that is removed afterwards
+class UpdateTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        directory = std::filesystem::temp_directory_path()
+            / ("EncryptionTest-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::filesystem::create_directories(directory);
+        input = (directory / "input.txt").string();
+        output = (directory / "output.txt").string();
+        full = (directory / "full.txt").string();
+    }
+
+    void TearDown() override
+    {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    }
+
+    void write_input(const std::string& data)
+    {
+        std::ofstream writeFile(input, std::ios::out | std::ios::binary | std::ios::trunc);
+        writeFile.write(data.data(), static_cast<std::streamsize>(data.length()));
+    }
+
+    // bring output up to date and check it is byte for byte what encrypting the whole input again writes
+    void update_and_compare()
+    {
+        ASSERT_TRUE(update_data_file(input, output, key, block_size, nullptr));
+        ASSERT_TRUE(stream_data_file(input, full, key, 64 * 1024, false));
+        ASSERT_EQ(read_file(output), read_file(full));
+    }
+
+    const std::string key = "password";
+    const size_t block_size = 4096;
+    std::filesystem::path directory;
+    std::string input;
+    std::string output;
+    std::string full;
+};
+
+// the first update has no manifest and writes everything
+TEST_F(UpdateTest, FirstUpdateMatchesFullRewrite)
+{
+    write_input("Student Name\n" + random_bytes(100000, 9));
+    update_and_compare();
+}
+
+// a few scattered changed bytes are rewritten in place
+TEST_F(UpdateTest, ChangedBytesMatchFullRewrite)
+{
+    std::string data = "Student Name\n" + random_bytes(100000, 10);
+    write_input(data);
+    update_and_compare();
+
+    for (const size_t at : { size_t(20), size_t(4096), size_t(50001), data.length() - 1 })
+    {
+        data[at] ^= 0x5a;
+    }
+    write_input(data);
+    update_and_compare();
+}
+
+// an input that grows or shrinks still ends up as a full rewrite would leave it
+TEST_F(UpdateTest, ChangedLengthMatchesFullRewrite)
+{
+    std::string data = "Student Name\n" + random_bytes(100000, 11);
+    write_input(data);
+    update_and_compare();
+
+    data += random_bytes(5000, 12);
+    write_input(data);
+    update_and_compare();
+
+    data.resize(30000);
+    write_input(data);
+    update_and_compare();
+}
+
+// the standard check value for crc-32c
+TEST(Crc32cTest, KnownAnswer)
+{
+    ASSERT_EQ(crc32c("123456789", 9), 0xe3069283u);
+    ASSERT_EQ(crc32c("", 0), 0u);
+}
+
+// the sse4.2 path runs three lanes and merges them, it must match the byte at a time table on every length around a lane
+TEST(Crc32cTest, MatchesTable)
+{
+    const std::string data = random_bytes(3 * crc32c_lane_size * 4 + 100, 2);
+    for (const size_t length : { size_t(0), size_t(1), size_t(7), size_t(8), size_t(9), 3 * crc32c_lane_size - 1, 3 * crc32c_lane_size,
+        3 * crc32c_lane_size + 1, data.length() })
+    {
+        ASSERT_EQ(crc32c(data.data(), length), ~crc32c_update_table(~0u, data.data(), length)) << "length " << length;
+    }
+}
+
+// a crc taken in pieces, or combined from the crcs of the pieces, is the crc of the whole
+TEST(Crc32cTest, PiecesAndCombine)
+{
+    const std::string data = random_bytes(100000, 3);
+    const unsigned int whole = crc32c(data.data(), data.length());
+    const size_t split = 12345;
+    const unsigned int first = crc32c(data.data(), split);
+    const unsigned int second = crc32c(data.data() + split, data.length() - split);
+    ASSERT_EQ(crc32c(data.data() + split, data.length() - split, first), whole);
+    ASSERT_EQ(crc32c_combine(first, second, data.length() - split), whole);
+}
+
+// taking the crc inside the encryption pass must give the same bytes and crc as encrypting and then checking
+TEST(Crc32cTest, FusedWithEncryption)
+{
+    const std::string source = random_bytes(1000003, 4);
+    const std::string key = "password";
+    std::string separate(source.length(), '\0');
+    encrypt_decrypt(source.data(), &separate[0], source.length(), key, 5);
+    std::string fused(source.length(), '\0');
+    unsigned int crc = 0;
+    encrypt_decrypt_crc32c(source.data(), &fused[0], source.length(), key, 5, crc);
+    ASSERT_EQ(fused, separate);
+    ASSERT_EQ(crc, crc32c(separate.data(), separate.length()));
+}